@@ -1,65 +1,39 @@
+// ocr-enhanced.cpp
+// Compacts OCR text for LLM prompts: whitespace cleanup, comma removal, abbreviations
+// and phonetic shortening of 7+ letter words (see ocr/law/2025/text_compactor.hpp).
+//
+// Build:
+// g++ -std=c++17 -O2 -o ocr-enhanced ocr-enhanced.cpp -ljsoncpp
+//
+// Usage:
+// ./ocr-enhanced                       demo on a built-in sentence, saves output.json
+// ./ocr-enhanced INPUT|- [--abbrev=abbreviations.tsv] [--json=out.json] [--guard]
+//
+// INPUT is memory-mapped (or read from stdin for "-") and processed in one streaming
+// pass; output goes to stdout, or into {"processed_text": ...} with --json. Memory use
+// stays constant regardless of input size. --guard leaves words with digits or capitals
+// (names, numbers) unshortened.
+
 #include <iostream>
 #include <fstream>
 #include <string>
-#include <regex>
+#include <cstdio>
 #include <json/json.h>
 
-// Function to remove whitespace and trim the string
-std::string cleanWhitespace(const std::string &input) {
-    std::string result = std::regex_replace(input, std::regex("^\\s+|\\s+$"), "");
-    result = std::regex_replace(result, std::regex("\\s+"), " ");
-    return result;
-}
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-// Function to abbreviate words (can be expanded)
-std::string abbreviate(const std::string &word) {
-    // Add your custom abbreviation rules here
-    if (word == "example") return "ex";
-    if (word == "information") return "info";
-    if (word == "approximate") return "approx";
-    return word; // Return original word if no abbreviation rule matches
-}
-
-// Function to remove a letter from a 7+ letter word while keeping phonetic similarity
-std::string shortenPhonetically(const std::string &word) {
-    if (word.length() < 7) return word;
-    // Example: Removing vowels except the first one
-    std::string result;
-    bool firstVowel = true;
-    for (char c : word) {
-        if (std::string("aeiouAEIOU").find(c) != std::string::npos) {
-            if (firstVowel) {
-                result += c;
-                firstVowel = false;
-            }
-        } else {
-            result += c;
-        }
-    }
-    return result;
-}
+#include "ocr/law/2025/text_compactor.hpp"
 
-// Function to process the text
+// Function to process the text: whitespace cleanup, comma removal, abbreviations and
+// phonetic shortening of 7+ letter words. See ocr/law/2025/text_compactor.hpp.
 std::string processText(const std::string &input) {
-    std::string result;
-    std::istringstream stream(input);
-    std::string word;
-
-    while (stream >> word) {
-        // Remove commas
-        word = std::regex_replace(word, std::regex(","), "");
-
-        // Abbreviate
-        word = abbreviate(word);
-
-        // Shorten phonetically if 7+ letters
-        word = shortenPhonetically(word);
-
-        // Append to result
-        result += word + " ";
-    }
-
-    return cleanWhitespace(result);
+    CompactOptions opt;
+    opt.guard = false; // this demo shortens every word, names and numbers included
+    static const TextCompactor compactor(opt);
+    return compactor.compact(input);
 }
 
 // Save processed data to a JSON file
@@ -77,18 +51,141 @@ void saveToJson(const std::string &data, const std::string &filename) {
     std::cout << "Data saved to JSON file: " << filename << std::endl;
 }
 
-int main() {
-    // Input text (for testing)
-    std::string inputText = "This,    is an example of   input text that needs to be cleaned, abbreviated, and processed.";
+// Incremental writer: plain text, or the same {"processed_text": ...} document as
+// saveToJson() with the string escaped on the fly.
+class OutputSink {
+public:
+    OutputSink(FILE *f, bool json) : f_(f), json_(json) {
+        if (json_) std::fputs("{\"processed_text\":\"", f_);
+    }
+    void write(const std::string &s) {
+        if (!json_) { std::fwrite(s.data(), 1, s.size(), f_); return; }
+        escaped_.clear();
+        for (unsigned char c : s) {
+            switch (c) {
+            case '"':  escaped_ += "\\\""; break;
+            case '\\': escaped_ += "\\\\"; break;
+            case '\n': escaped_ += "\\n"; break;
+            case '\r': escaped_ += "\\r"; break;
+            case '\t': escaped_ += "\\t"; break;
+            default:
+                if (c < 0x20) { char buf[8]; std::snprintf(buf, sizeof buf, "\\u%04x", c); escaped_ += buf; }
+                else escaped_.push_back((char)c);
+            }
+        }
+        std::fwrite(escaped_.data(), 1, escaped_.size(), f_);
+    }
+    void close() {
+        if (json_) std::fputs("\"}\n", f_);
+        std::fflush(f_);
+    }
+private:
+    FILE *f_;
+    bool json_;
+    std::string escaped_;
+};
+
+static const size_t kSlice = 4 << 20; // input consumed and output flushed per slice
+
+// Memory-mapped input; processed pages are dropped again so resident memory stays flat.
+static bool compact_file(const std::string &path, const TextCompactor &compactor, OutputSink &sink) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return false; }
+    size_t size = (size_t)st.st_size;
+    CompactStream stream(compactor);
+    std::string out;
+    if (size > 0) {
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) { close(fd); return false; }
+        madvise(map, size, MADV_SEQUENTIAL);
+        const char *base = static_cast<const char *>(map);
+        for (size_t off = 0; off < size; off += kSlice) {
+            size_t len = std::min(kSlice, size - off);
+            out.clear();
+            stream.feed(std::string_view(base + off, len), out);
+            sink.write(out);
+            madvise((void *)(base + off), len, MADV_DONTNEED);
+        }
+        munmap(map, size);
+    }
+    close(fd);
+    out.clear();
+    stream.finish(out);
+    sink.write(out);
+    return true;
+}
+
+static void compact_stdin(const TextCompactor &compactor, OutputSink &sink) {
+    CompactStream stream(compactor);
+    std::string buf(kSlice, '\0'), out;
+    size_t n;
+    while ((n = std::fread(&buf[0], 1, buf.size(), stdin)) > 0) {
+        out.clear();
+        stream.feed(std::string_view(buf.data(), n), out);
+        sink.write(out);
+    }
+    out.clear();
+    stream.finish(out);
+    sink.write(out);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        // Input text (for testing)
+        std::string inputText = "This,    is an example of   input text that needs to be cleaned, abbreviated, and processed.";
+
+        // Process the text
+        std::string cleanedText = processText(inputText);
+
+        // Output the cleaned text
+        std::cout << "Processed Text: " << cleanedText << std::endl;
 
-    // Process the text
-    std::string cleanedText = processText(inputText);
+        // Save to JSON
+        saveToJson(cleanedText, "output.json");
 
-    // Output the cleaned text
-    std::cout << "Processed Text: " << cleanedText << std::endl;
+        return 0;
+    }
 
-    // Save to JSON
-    saveToJson(cleanedText, "output.json");
+    std::string input = argv[1];
+    std::string abbrev_path, json_path;
+    CompactOptions opt;
+    opt.guard = false;
+    for (int i = 2; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a.rfind("--abbrev=", 0) == 0) abbrev_path = a.substr(9);
+        else if (a.rfind("--json=", 0) == 0) json_path = a.substr(7);
+        else if (a == "--guard") opt.guard = true;
+        else { std::cerr << "Error: Unknown option: " << a << std::endl; return 1; }
+    }
 
+    TextCompactor compactor(opt);
+    if (!abbrev_path.empty() && !compactor.load_abbreviations(abbrev_path)) {
+        std::cerr << "Error: Could not read abbreviations: " << abbrev_path << std::endl;
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (!json_path.empty()) {
+        out = std::fopen(json_path.c_str(), "wb");
+        if (!out) {
+            std::cerr << "Error: Could not open file for writing: " << json_path << std::endl;
+            return 1;
+        }
+    }
+    OutputSink sink(out, !json_path.empty());
+
+    if (input == "-") {
+        compact_stdin(compactor, sink);
+    } else if (!compact_file(input, compactor, sink)) {
+        std::cerr << "Error: Could not read input: " << input << std::endl;
+        return 1;
+    }
+    sink.close();
+    if (out != stdout) {
+        std::fclose(out);
+        std::cerr << "Data saved to JSON file: " << json_path << std::endl;
+    }
     return 0;
 }
@@ -0,0 +1,521 @@
+// Micro-benchmarks for the legal_ocr_pro text hot path on synthetic OCR output.
+// No OCR is run; pages are generated in memory. Only "dispatch" makes network calls,
+// to the server given with --url (e.g. mock_llm_server.py), and "all" skips it.
+//
+// Build (one command):
+// g++ -std=c++17 -O2 -pthread -o legal_ocr_bench legal_ocr_bench.cpp
+//   -ltesseract -llept -lopencv_core -lopencv_imgproc -lopencv_imgcodecs -lcurl
+//
+// Usage:
+// ./legal_ocr_bench [BENCH|all] [--pages=300] [--iters=20] [--tokenizer=o200k_base.tiktoken]
+// ./legal_ocr_bench dispatch --url=http://127.0.0.1:8089/v1 [--requests=200] [--inflight=16] [--rpm=60000]
+
+#define LEGAL_OCR_NO_MAIN
+#include "legal_ocr_pro.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <functional>
+#include <regex>
+
+// ---------------- Allocation counting ----------------
+static std::atomic<size_t> g_allocs{0};
+static std::atomic<size_t> g_alloc_bytes{0};
+
+void *operator new(size_t n) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1)) return p;
+    throw std::bad_alloc();
+}
+void *operator new(size_t n, std::align_val_t al) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    size_t a = std::max(sizeof(void *), (size_t)al);
+    if (void *p = std::aligned_alloc(a, (n + a - 1) / a * a)) return p;
+    throw std::bad_alloc();
+}
+// The sized forms forward to the unsized ones, so new and delete are a matched set.
+// The unsized ones are kept out of line: inlined, GCC sees free() on memory from
+// operator new and warns (-Wmismatched-new-delete).
+#if defined(__GNUC__)
+#define BENCH_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE
+#endif
+BENCH_NOINLINE void operator delete(void *p) noexcept { std::free(p); }
+BENCH_NOINLINE void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { ::operator delete(p); }
+void operator delete(void *p, size_t, std::align_val_t al) noexcept { ::operator delete(p, al); }
+
+struct AllocSnapshot {
+    size_t allocs = g_allocs.load();
+    size_t bytes = g_alloc_bytes.load();
+};
+
+struct BenchOpts {
+    int pages = 300;
+    int iters = 20;
+    std::string tokenizer_path;
+    std::string url;           // dispatch: OpenAI-compatible base URL
+    int requests = 200;
+    int inflight = 16;
+    double rpm = 60000;
+};
+
+// ---------------- Synthetic documents ----------------
+// Hospital-chart style pages: repeated header/footer, progress note body with
+// dates, phones and keyword hits scattered across the record.
+static std::vector<std::string> synth_medical_pages(int pages) {
+    std::vector<std::string> out;
+    std::mt19937 rng(42);
+    const char *body[] = {
+        "Chief complaint: low back pain radiating to the left leg after MVA.",
+        "History of present illness: patient reports pain 7/10, worse with sitting.",
+        "Assessment: lumbar strain, rule out L4-L5 disc herniation.",
+        "Plan: physical therapy 3x weekly, follow up in 2 weeks, MRI lumbar spine.",
+        "Medication: cyclobenzaprine 10 mg qhs, ibuprofen 600 mg tid prn.",
+        "Vitals: BP 128/82 HR 76 RR 14 T 98.4 SpO2 99%.",
+        "Nursing note: patient ambulating with steady gait, no acute distress.",
+        "Callback number 718-555-0142 for results.",
+    };
+    for (int p = 0; p < pages; ++p) {
+        std::string t;
+        t += "MEMORIAL HOSPITAL OF BROOKLYN        Patient: DOE, JANE   MRN: 00123456\n";
+        t += "DOB: 04/12/1979                      Encounter Date: 03/" + std::to_string(1 + p % 28) + "/2024\n\n";
+        for (int l = 0; l < 44; ++l) {
+            t += "  ";
+            t += body[rng() % (sizeof(body) / sizeof(body[0]))];
+            t += "\n";
+        }
+        t += "\nPage " + std::to_string(p + 1) + " of " + std::to_string(pages) + "        CONFIDENTIAL PATIENT INFORMATION\n";
+        out.push_back(std::move(t));
+    }
+    return out;
+}
+
+// Deposition pages: printed page number, 25 margin-numbered lines of Q/A and colloquy,
+// reporter footer.
+static std::vector<std::string> synth_transcript_pages(int pages) {
+    std::vector<std::string> out;
+    std::mt19937 rng(7);
+    const char *body[] = {
+        "Q.   Were you stopped at the light on Atlantic Avenue?",
+        "A.   Yes, the light was red and I was in the left lane.",
+        "     I felt the impact from behind, very hard.",
+        "Q.   Did you go to the emergency room that day?",
+        "A.   No, the next morning, at Kings County.",
+        "MR. SMITH:  Objection to form.",
+        "MS. JONES:  You can answer.",
+        "THE WITNESS:  I don't remember.",
+    };
+    for (int p = 0; p < pages; ++p) {
+        std::string t = "                                                  " + std::to_string(p + 1) + "\n";
+        for (int l = 1; l <= 25; ++l) {
+            t += (l < 10 ? " " : "") + std::to_string(l) + "      ";
+            t += body[rng() % (sizeof(body) / sizeof(body[0]))];
+            t += "\n";
+        }
+        t += "          DIAMOND REPORTING (718) 624-7200  info@diamondreporting.com\n";
+        out.push_back(std::move(t));
+    }
+    return out;
+}
+
+// ---------------- arena: per-document allocation counts ----------------
+// Runs the post-OCR local stage the way prepare_document() does, with the
+// per-document arena off (global allocator) and on.
+static void bench_arena(const BenchOpts &o, const DocTypeRegistry &reg) {
+    auto pages = synth_medical_pages(o.pages);
+    for (bool use_arena : {false, true}) {
+        Config cfg;
+        cfg.doc_arena = use_arena;
+        size_t sink = 0;
+        AllocSnapshot before;
+        auto t0 = std::chrono::steady_clock::now();
+        for (int it = 0; it < o.iters; ++it) {
+            DocArena arena(cfg.doc_arena);
+            std::pmr::memory_resource *mr = arena.resource();
+            std::pmr::vector<std::pmr::string> page_texts(mr);
+            for (auto &p : pages) page_texts.emplace_back(p);
+            DocText doc(mr);
+            doc.assign_pages(page_texts);
+            LocalAnalysis a = analyze_document_text(doc, reg, cfg);
+            std::string key = std::to_string(fnv1a_64(a.doc_type->id + "\n" + a.local.dump()));
+            sink += key.size() + std::string(doc.buf, 0, 4000).size();
+        }
+        auto t1 = std::chrono::steady_clock::now();
+        AllocSnapshot after;
+        double us = std::chrono::duration<double, std::micro>(t1 - t0).count() / o.iters;
+        std::printf("arena %-3s  pages=%d  allocs/doc=%zu  bytes/doc=%zu  us/doc=%.1f  (sink %zu)\n",
+                    use_arena ? "on" : "off", o.pages,
+                    (after.allocs - before.allocs) / o.iters, (after.bytes - before.bytes) / o.iters, us, sink);
+    }
+}
+
+// ---------------- tokenizer: BPE count throughput ----------------
+// Counts every line of the synthetic record, as --max-tokens budgeting does.
+static void bench_tokenizer(const BenchOpts &o, const DocTypeRegistry &) {
+    if (o.tokenizer_path.empty()) { std::printf("skipped, pass --tokenizer=FILE.tiktoken\n"); return; }
+    BpeTokenizer tok;
+    if (!tok.load(o.tokenizer_path)) die("Cannot load tokenizer: " + o.tokenizer_path);
+    auto pages = synth_medical_pages(o.pages);
+    DocText doc;
+    doc.assign_pages(pages);
+    size_t tokens = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < o.iters; ++it)
+        for (auto &l : doc.lines) tokens += tok.count(l);
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    double lines = (double)doc.lines.size() * o.iters;
+    std::printf("lines=%zu  tokens/line=%.1f  %.2f M lines/s  %.1f MB/s\n", doc.lines.size(),
+                tokens / lines, lines / sec / 1e6, (double)doc.buf.size() * o.iters / sec / 1e6);
+}
+
+// ---------------- windows: ranked snippet selection over the whole record ----------------
+static void bench_windows(const BenchOpts &o, const DocTypeRegistry &reg) {
+    auto pages = synth_medical_pages(o.pages);
+    Config cfg;
+    DocText doc;
+    doc.assign_pages(pages);
+    const DocTypeSpec &dt = reg.types.front();
+    size_t kept = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < o.iters; ++it) {
+        std::pmr::vector<std::string_view> keep;
+        select_ranked_windows(keep, doc, LineRange{0, doc.lines.size()}, dt.snippet_matcher, cfg);
+        kept += keep.size();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / o.iters;
+    std::printf("pages=%d  lines=%zu  kept=%zu  ms/doc=%.2f  pages/s=%.0f\n", o.pages, doc.lines.size(),
+                kept / o.iters, sec * 1e3, o.pages / sec);
+}
+
+// ---------------- compactor: streaming compactor vs the original processText() ----------------
+// The regex-per-word version ocr-enhanced.cpp shipped with, kept here as the baseline.
+static std::string legacy_process_text(const std::string &input) {
+    auto clean_ws = [](const std::string &in) {
+        std::string r = std::regex_replace(in, std::regex("^\\s+|\\s+$"), "");
+        return std::regex_replace(r, std::regex("\\s+"), " ");
+    };
+    auto abbreviate = [](const std::string &w) -> std::string {
+        if (w == "example") return "ex";
+        if (w == "information") return "info";
+        if (w == "approximate") return "approx";
+        return w;
+    };
+    std::string result;
+    std::istringstream stream(input);
+    std::string word;
+    while (stream >> word) {
+        word = std::regex_replace(word, std::regex(","), "");
+        word = TextCompactor::shorten_phonetically(abbreviate(word));
+        result += word + " ";
+    }
+    return clean_ws(result);
+}
+
+static void bench_compactor(const BenchOpts &o, const DocTypeRegistry &) {
+    std::string text;
+    for (auto &p : synth_medical_pages(o.pages)) text += p;
+    CompactOptions opt;
+    opt.guard = false;
+
+    auto t0 = std::chrono::steady_clock::now();
+    size_t legacy_out = legacy_process_text(text).size();
+    double legacy_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("input=%.1f MB  legacy: %.1f MB/s (out %zu)\n", text.size() / 1e6, text.size() / legacy_sec / 1e6, legacy_out);
+
+    for (bool phrases : {false, true}) {
+        TextCompactor compactor(opt);
+        if (phrases) compactor.load_abbreviations_text(kBuiltinAbbreviations);
+        size_t out_bytes = 0;
+        AllocSnapshot before;
+        t0 = std::chrono::steady_clock::now();
+        for (int it = 0; it < o.iters; ++it) {
+            // 64 KiB slices through one reused buffer, as ocr-enhanced streams a file
+            CompactStream stream(compactor);
+            std::string out;
+            for (size_t off = 0; off < text.size(); off += 65536) {
+                out.clear();
+                stream.feed(std::string_view(text).substr(off, 65536), out);
+                out_bytes += out.size();
+            }
+            out.clear();
+            stream.finish(out);
+            out_bytes += out.size();
+        }
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / o.iters;
+        AllocSnapshot after;
+        std::printf("streaming%-9s %.1f MB/s (out %zu)  allocs/iter=%zu  speedup=%.0fx\n", phrases ? "+phrases:" : ":",
+                    text.size() / sec / 1e6, out_bytes / o.iters, (after.allocs - before.allocs) / o.iters, legacy_sec / sec);
+    }
+}
+
+// ---------------- normalize: OCR text normalization kernel ----------------
+// Same record with a transcript-style margin and hyphenated line wraps mixed in.
+static void bench_normalize(const BenchOpts &o, const DocTypeRegistry &) {
+    std::string text;
+    int line = 0;
+    for (auto &p : synth_medical_pages(o.pages)) {
+        for (size_t i = 0; i < p.size();) {
+            size_t nl = p.find('\n', i);
+            if (nl == std::string::npos) nl = p.size();
+            std::string l = p.substr(i, nl - i);
+            if (++line % 7 == 0 && l.size() > 20) l.insert(l.size() / 2, "-\n   ");
+            text += std::to_string(line % 25 + 1) + "    " + l + "   \n";
+            i = nl + 1;
+        }
+    }
+    std::string out(text.size(), '\0');
+    NormalizeOptions variants[3];
+    variants[1].lowercase = true;
+    variants[2].lowercase = variants[2].strip_margin_numbers = true;
+    const char *names[3] = {"default", "+lower", "+lower+margins"};
+    for (int v = 0; v < 3; ++v) {
+        const NormalizeOptions &opt = variants[v];
+        std::string ref(text.size(), '\0');
+        ref.resize(normalize_text_scalar(text, &ref[0], opt));
+        double secs[2];
+        size_t n = 0;
+        for (int k = 0; k < 2; ++k) {
+            auto t0 = std::chrono::steady_clock::now();
+            for (int it = 0; it < o.iters; ++it)
+                n = k ? normalize_text(text, &out[0], opt) : normalize_text_scalar(text, &out[0], opt);
+            secs[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / o.iters;
+        }
+        bool same = std::string_view(out.data(), n) == ref;
+        std::printf("%-15s input=%.1f MB  out=%.1f MB  scalar: %.2f GB/s  %s: %.2f GB/s  match=%s\n", names[v],
+                    text.size() / 1e6, n / 1e6, text.size() / secs[0] / 1e9, normalize_kernel_name(),
+                    text.size() / secs[1] / 1e9, same ? "yes" : "NO");
+    }
+}
+
+// ---------------- entities: single-pass scanner vs std::regex ----------------
+// The regexes the scanner replaced (local extraction, citations, redaction), each run
+// over the whole record with regex_iterator, against one scanner pass for all kinds.
+static void bench_entities(const BenchOpts &o, const DocTypeRegistry &) {
+    std::string text;
+    int p = 0;
+    for (auto &page : synth_medical_pages(o.pages)) {
+        text += page;
+        text += "Billing contact billing@memorial-brooklyn.org, claim no. NF-2024-" + std::to_string(1000 + p) +
+                ", SSN 123-45-" + std::to_string(1000 + p % 9000) + ". See page " + std::to_string(p + 1) + " lines 4-9.\n";
+        ++p;
+    }
+    const std::regex legacy[] = {
+        std::regex(R"((?:Patient|Name)\s*[:\-]\s*([A-Za-z ,.\-']{3,90}))", std::regex::icase),
+        std::regex(R"((\b\d{4}-\d{2}-\d{2}\b)|(\b\d{1,2}[\/\-]\d{1,2}[\/\-]\d{2,4}\b))"),
+        std::regex(R"((\+?\d{1,2}[\s\-\.])?(?:\(?\d{3}\)?[\s\-\.])?\d{3}[\s\-\.]\d{4})"),
+        std::regex(R"((\b\d{3}[- ]?\d{2}[- ]?\d{4}\b))"),
+        std::regex(R"(([A-Za-z0-9._%+\-]+@[A-Za-z0-9.\-]+\.[A-Za-z]{2,}))"),
+        std::regex(R"(page\s+(\d+))", std::regex::icase),
+        std::regex(R"(line[s]?\s+(\d+)(?:\s*-\s*(\d+))?)", std::regex::icase),
+    };
+    int regex_iters = std::max(1, o.iters / 10);
+    size_t regex_hits = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < regex_iters; ++it)
+        for (auto &re : legacy)
+            regex_hits += (size_t)std::distance(std::sregex_iterator(text.begin(), text.end(), re), std::sregex_iterator());
+    double regex_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / regex_iters;
+
+    size_t counts[(int)Entity::Count] = {};
+    t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < o.iters; ++it)
+        EntityScanner::scan(text, kAllEntities, [&](const EntitySpan &sp) { counts[(int)sp.kind]++; });
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / o.iters;
+
+    size_t hits = 0;
+    for (size_t c : counts) hits += c / o.iters;
+    std::printf("input=%.1f MB  std::regex (7 patterns): %.1f MB/s, %zu hits  scanner (9 kinds): %.1f MB/s, %zu hits  speedup=%.0fx\n",
+                text.size() / 1e6, text.size() / regex_sec / 1e6, regex_hits / regex_iters, text.size() / sec / 1e6, hits,
+                regex_sec / sec);
+}
+
+// ---------------- redact: serializer-side masking vs regex DOM walk ----------------
+// --audit style results (snippets plus a 4000 char raw OCR preview per document). The
+// legacy path copied every string through three regex_replace calls and then dumped;
+// serialize_redacted() masks while it writes.
+static void legacy_redact_in_place(json &j) {
+    auto redact_string = [](std::string s){
+        s = std::regex_replace(s, std::regex(R"((\b\d{3}[- ]?\d{2}[- ]?\d{4}\b))"), "***-**-****");
+        s = std::regex_replace(s, std::regex(R"((\+?\d{1,2}[\s\-\.])?(?:\(?\d{3}\)?[\s\-\.])?\d{3}[\s\-\.]\d{4})"), "***-***-****");
+        s = std::regex_replace(s, std::regex(R"(([A-Za-z0-9._%+\-]+@[A-Za-z0-9.\-]+\.[A-Za-z]{2,}))"), "***@***.***");
+        return s;
+    };
+    std::function<void(json&)> walk = [&](json &node){
+        if (node.is_string()) node = redact_string(node.get<std::string>());
+        else if (node.is_array() || node.is_object()) for (auto &el : node) walk(el);
+    };
+    walk(j);
+}
+
+static void bench_redact(const BenchOpts &o, const DocTypeRegistry &) {
+    json docs = json::array();
+    int p = 0;
+    for (auto &page : synth_medical_pages(o.pages)) {
+        std::string preview = page + "Billing billing@memorial-brooklyn.org, SSN 123-45-" + std::to_string(1000 + p++) +
+                              ", call (718) 555-0100.\n";
+        while (preview.size() < 4000) preview += preview;
+        preview.resize(4000);
+        docs.push_back({{"doc_type", "medical_record"}, {"patient_name", "DOE, JANE"}, {"page_count", 1},
+                        {"snippets", preview.substr(0, 1400)}, {"raw_ocr_preview", preview}});
+    }
+    const uint32_t classes = parse_redact_classes("ssn,phone,email");
+
+    int legacy_iters = std::max(1, o.iters / 10);
+    size_t legacy_bytes = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < legacy_iters; ++it) {
+        for (const auto &d : docs) {
+            json copy = d;
+            legacy_redact_in_place(copy);
+            legacy_bytes += copy.dump().size();
+        }
+    }
+    double legacy_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / legacy_iters;
+
+    size_t bytes = 0;
+    RedactionCounts counts{};
+    std::string out;
+    t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < o.iters; ++it) {
+        for (const auto &d : docs) {
+            out.clear();
+            serialize_redacted(d, classes, out, counts);
+            bytes += out.size();
+        }
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / o.iters;
+
+    double mb = (double)(bytes / o.iters) / 1e6;
+    std::printf("docs=%zu  output=%.1f MB  regex walk+dump: %.1f MB/s  serialize_redacted: %.1f MB/s  speedup=%.0fx  "
+                "masked/pass: ssn=%zu phone=%zu email=%zu\n",
+                docs.size(), mb, (double)(legacy_bytes / legacy_iters) / 1e6 / legacy_sec, mb / sec, legacy_sec / sec,
+                counts[(size_t)Entity::Ssn] / o.iters, counts[(size_t)Entity::Phone] / o.iters,
+                counts[(size_t)Entity::Email] / o.iters);
+}
+
+// ---------------- transcript: page:line index ----------------
+// Layout parse plus margin stripping over a deposition, then random page:line lookups.
+static void bench_transcript(const BenchOpts &o, const DocTypeRegistry &) {
+    auto pages = synth_transcript_pages(o.pages);
+    DocText doc;
+    doc.assign_pages(pages);
+    const auto lines = doc.lines;
+
+    TranscriptIndex ix;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int it = 0; it < o.iters; ++it) {
+        doc.lines = lines;
+        ix.build(doc.lines, doc.page_first_line);
+        ix.strip_margins(doc.lines);
+    }
+    double build_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / o.iters;
+
+    std::mt19937 rng(1);
+    const int lookups = 1000000;
+    size_t found = 0;
+    t0 = std::chrono::steady_clock::now();
+    for (int q = 0; q < lookups; ++q)
+        found += ix.find(1 + rng() % (uint32_t)o.pages, 1 + rng() % 25) != nullptr;
+    double find_sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    std::printf("pages=%zu lines=%zu turns=%zu  build+strip: %.2f ms (%.0f MB/s)  find: %.0f ns/lookup, %zu/%d found\n",
+                ix.pages().size(), ix.lines().size(), ix.turns().size(), build_sec * 1e3,
+                doc.buf.size() / build_sec / 1e6, find_sec / lookups * 1e9, found, lookups);
+}
+
+// ---------------- dispatch: model requests over HTTP ----------------
+// Real schema requests built from a synthetic record, sent through the async dispatcher
+// (pacing, AIMD window, retries) to --url. Latency is submit to reply, queueing included.
+static void bench_dispatch(const BenchOpts &o, const DocTypeRegistry &reg) {
+    if (o.url.empty()) die("dispatch needs --url=BASE_URL (see mock_llm_server.py)");
+    Config cfg;
+    cfg.base_url = o.url;
+    cfg.auth = "none";
+    cfg.max_inflight = o.inflight;
+    auto pages = synth_medical_pages(4);
+    DocText doc;
+    doc.assign_pages(pages);
+    LocalAnalysis a = analyze_document_text(doc, reg, cfg);
+    ModelRequest mr = build_model_request(cfg, *a.doc_type, a.local, a.local.value("important_snippets", ""));
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    http_pool.init();
+    limiter.configure(o.rpm, 0);
+    LlmDispatcher d;
+    d.start(cfg);
+    std::mutex mu;
+    std::vector<double> latency;
+    size_t ok = 0;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < o.requests; ++i) {
+        auto sent = std::chrono::steady_clock::now();
+        d.submit(mr.body, mr.usage.predicted_prompt, [&, sent](ModelReply &&reply){
+            double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count();
+            std::lock_guard<std::mutex> lk(mu);
+            latency.push_back(ms);
+            if (reply.error.empty() && reply.http_code == 200) {
+                ModelRequest copy = mr;
+                try { parse_model_reply(cfg, copy, reply); ok++; } catch (const DocError &) {}
+            }
+        });
+    }
+    d.stop();
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::sort(latency.begin(), latency.end());
+    auto pct = [&](double p){ return latency.empty() ? 0.0 : latency[std::min(latency.size() - 1, (size_t)(p * latency.size()))]; };
+    json st = limiter.to_json();
+    st.update(d.stats());
+    std::printf("requests=%d ok=%zu  %.1f req/s  latency p50=%.0f ms p95=%.0f ms  http=%s  rate_limit=%s\n",
+                o.requests, ok, o.requests / sec, pct(0.5), pct(0.95), http_pool.stats.to_json().dump().c_str(),
+                st.dump().c_str());
+    http_pool.cleanup();
+    curl_global_cleanup();
+}
+
+// ---------------- Main ----------------
+int main(int argc, char **argv) {
+    BenchOpts o;
+    std::string which = "all";
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        if (a.rfind("--pages=",0)==0) o.pages = std::max(1, std::stoi(a.substr(8)));
+        else if (a.rfind("--iters=",0)==0) o.iters = std::max(1, std::stoi(a.substr(8)));
+        else if (a.rfind("--tokenizer=",0)==0) o.tokenizer_path = a.substr(12);
+        else if (a.rfind("--url=",0)==0) o.url = a.substr(6);
+        else if (a.rfind("--requests=",0)==0) o.requests = std::max(1, std::stoi(a.substr(11)));
+        else if (a.rfind("--inflight=",0)==0) o.inflight = std::max(1, std::stoi(a.substr(11)));
+        else if (a.rfind("--rpm=",0)==0) o.rpm = std::max(1.0, std::stod(a.substr(6)));
+        else which = a;
+    }
+    const DocTypeRegistry reg = load_doc_registry("");
+
+    struct Bench { const char *name; void (*fn)(const BenchOpts &, const DocTypeRegistry &); };
+    const Bench benches[] = {
+        {"arena", bench_arena},
+        {"tokenizer", bench_tokenizer},
+        {"windows", bench_windows},
+        {"compactor", bench_compactor},
+        {"normalize", bench_normalize},
+        {"entities", bench_entities},
+        {"redact", bench_redact},
+        {"transcript", bench_transcript},
+        {"dispatch", bench_dispatch},
+    };
+    bool ran = false;
+    for (auto &b : benches) {
+        if (which != "all" && which != b.name) continue;
+        if (which == "all" && std::string(b.name) == "dispatch") continue;
+        std::printf("== %s\n", b.name);
+        b.fn(o, reg);
+        ran = true;
+    }
+    if (!ran) die("Unknown benchmark: " + which);
+    return 0;
+}
@@ -7,10 +7,13 @@
 // doc type classification -> compact prompt -> OpenAI function schema -> merge -> outputs.
 // Features:
 // - Medical records, Pleadings, Police reports, Transcripts, Insurance EOB, Imaging report
-// - Snippet windows around keywords to minimize tokens
-// - Parallel processing, rate limiting, retries with backoff
-// - Cache by hash of snippet to avoid repeat API calls
-// - Optional PII redaction in final JSON
+// - Doc types as data (--doctypes), built-in table otherwise
+// - Snippet windows around keywords, token budgets and prompt compaction to minimize tokens
+// - Transcript page:line parsing and condensed (4-up) page splitting
+// - Parallel OCR, async model requests (curl multi) paced by rate limits, retries with backoff
+// - Cache by hash of snippet and near-duplicate reuse to avoid repeat API calls
+// - Batch API mode, any OpenAI-compatible server, or in-process llama.cpp
+// - Optional PII redaction of all outputs, per class, counted in stats
 // - Optional raw OCR auditing
 // - Combined JSON, per file JSON, and JSONL export
 //
@@ -20,23 +23,60 @@
 //   -lopencv_core -lopencv_imgproc -lopencv_imgcodecs \
 //   -lcurl \
 //   -o legal_ocr_pro legal_ocr_pro.cpp
+// With the in-process llama.cpp backend (--llama-model), add
+//   -DLEGAL_OCR_WITH_LLAMA -I$LLAMA_CPP/include -L$LLAMA_CPP/lib -lllama
 //
 // Usage:
 // ./legal_ocr_pro INPUT_PATH OPENAI_API_KEY OUTPUT_JSON [--threads=N] [--lang=eng] [--model=gpt-4o-mini]
-//    [--per-file] [--jsonl=path.jsonl] [--cache=.cache] [--redact] [--audit] [--timeout=120]
-//    [--max-lines=14] [--max-chars=1400]
+//    [--per-file] [--jsonl=path.jsonl] [--cache=.cache] [--redact[=ssn,phone,email]] [--audit] [--timeout=120]
+//    [--max-lines=14] [--max-chars=1400] [--doctypes=doc_types.json] [--no-arena] [--no-normalize] [--no-condensed]
+//    [--tokenizer=o200k_base.tiktoken] [--max-tokens=400] [--chunked] [--chunk-tokens=6000] [--max-chunks=8]
+//    [--near-dup=3] [--compact-prompt] [--abbrev=abbreviations.tsv] [--inflight=16] [--rpm=N] [--tpm=N]
+//    [--batch-out=batch.jsonl] [--batch-in=results.jsonl --batch-state=batch.state.json]
+//    [--base-url=https://api.openai.com/v1] [--auth=bearer|api-key|none] [--dialect=functions|tools|json-schema]
+//    [--llama-model=model.gguf] [--llama-ctx=8192] [--llama-threads=N] [--llama-workers=1]
+//    [--coalesce=8] [--coalesce-wait=1500] [--coalesce-tokens=400]
+//
+// Flags:
+//   --doctypes                   doc type table (keywords, snippet keys, schemas)
+//   --max-tokens                 snippet budget in tokens (exact with --tokenizer)
+//   --chunked                    map-reduce extraction of long documents
+//   --near-dup                   reuse answers for near-identical documents of the same person
+//   --compact-prompt             compress snippets; --abbrev sets the phrase table
+//   --redact                     mask PII classes in every output
+//   --no-condensed               do not split 4-up transcript sheets
+//   --inflight/--rpm/--tpm       request concurrency and rate ceilings
+//   --batch-out/--batch-in       two-phase run through the provider's batch API
+//   --base-url/--auth/--dialect  OpenAI-compatible server and schema style
+//   --llama-*                    in-process extraction with llama.cpp
+//   --coalesce*                  pack small same-type documents into one request
+//
+// See the repository README for how each of these behaves.
 
 #include <filesystem>
-#include <regex>
 #include <mutex>
 #include <atomic>
 #include <thread>
 #include <fstream>
 #include <iostream>
 #include <sstream>
+#include <string_view>
+#include <cstring>
 #include <unordered_map>
 #include <chrono>
 #include <random>
+#include <memory_resource>
+#include <optional>
+#include <limits>
+#include <queue>
+#include <cmath>
+#include <future>
+#include <shared_mutex>
+#include <array>
+#include <deque>
+#include <map>
+#include <functional>
+#include <condition_variable>
 
 #include <tesseract/baseapi.h>
 #include <leptonica/allheaders.h>
@@ -44,31 +84,101 @@
 
 #include <curl/curl.h>
 #include "nlohmann_json.hpp"
+#ifdef LEGAL_OCR_WITH_LLAMA
+#include <llama.h>
+#endif
+#include "text_compactor.hpp"
+#include "text_normalize.hpp"
 
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 
 // ---------------- Config defaults ----------------
+class BpeTokenizer;
+
+// How the doc type schema goes into a chat/completions request: "functions" and
+// "function_call" (OpenAI's original form), "tools" and "tool_choice", or a JSON
+// schema "response_format" for servers without tool calling.
+enum class Dialect { Functions, Tools, JsonSchema };
+
 struct Config {
     std::string input_path;
     std::string api_key;
     std::string output_json;
     std::string ocr_lang = "eng";
     std::string model = "gpt-4o-mini";
+    std::string base_url = "https://api.openai.com/v1"; // any OpenAI-compatible server
+    std::string auth = "bearer";   // bearer | api-key | none
+    Dialect dialect = Dialect::Functions;
     std::string cache_dir;     // empty disables cache
     std::string jsonl_path;    // empty disables jsonl
+    std::string doctypes_path; // empty uses the built-in doc types
+    std::string tokenizer_path; // tiktoken-format BPE ranks; empty estimates tokens from chars
     bool per_file = false;
-    bool redact = false;
+    std::string redact_classes; // PII classes masked in all outputs; empty disables
+    uint32_t redact_mask = 0;   // Entity bits, resolved in main from redact_classes
     bool audit_raw_ocr = false;
+    bool doc_arena = true;     // per-document monotonic arena for text temporaries
+    bool normalize = true;     // whitespace collapse and de-hyphenation of OCR pages
+    bool condensed = true;     // split 4-up transcript sheets into their pages before OCR
     int threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 4;
     int http_timeout = 120; // seconds
+    int max_inflight = 16;  // cap on the dispatcher's AIMD window of requests in flight
+    double rpm = 0;         // requests/tokens per minute ceilings; 0 follows the API's limit headers
+    double tpm = 0;
     size_t max_snippet_lines = 14;
     size_t max_chars_per_snippet = 1400;
+    size_t max_tokens = 0;     // snippet token budget; 0 uses max_chars_per_snippet
+    const BpeTokenizer *tokenizer = nullptr; // loaded in main from tokenizer_path
+    bool chunked = false;      // map-reduce extraction over the whole document
+    size_t chunk_tokens = 6000;
+    size_t max_chunks = 8;
+    int near_dup_bits = 0;     // SimHash Hamming radius for reusing model output; 0 disables
+    bool compact_prompt = false;
+    std::string abbrev_path;   // --compact-prompt dictionary; empty uses the built-in phrases
+    const TextCompactor *compactor = nullptr; // set in main when compact_prompt
+    std::string batch_out;     // phase one: write batch requests here instead of calling the API
+    std::string batch_in;      // phase two: provider batch results to merge
+    std::string batch_state;   // phase two: the state file written next to --batch-out
+    std::string llama_model;   // GGUF file: in-process CPU inference instead of an API
+    int llama_ctx = 8192;      // KV cache per inference worker, cached prefixes included
+    int llama_threads = 0;     // CPU threads for inference; 0 uses every core
+    int llama_workers = 1;     // inference contexts decoding in parallel
+    int coalesce = 0;          // small documents of a type per request; 0 sends each on its own
+    int coalesce_wait_ms = 1500; // a partial group is sent after waiting this long
+    long coalesce_tokens = 400;  // "small": the document's part of the prompt, in tokens
 };
 
 // ---------------- Helpers ----------------
 static void die(const std::string &m) { std::cerr << "Error: " << m << std::endl; std::exit(1); }
 
+// Failures of a single document. die() is for setup errors only; anything that goes
+// wrong while processing one document throws this and ends up in its DocResult.
+// kind is the failing stage: "ocr" (PDF, image or OCR), "transport" (curl), "http"
+// (status >= 400, in http_status), "response" (reply is not JSON), "output" (model
+// output is not JSON), "batch" (no usable line in a --batch-in results file), "local"
+// (the in-process model could not run the request, e.g. a prompt over --llama-ctx).
+struct DocError : std::runtime_error {
+    std::string kind;
+    long http_status = 0;
+    DocError(std::string k, const std::string &m, long status = 0)
+        : std::runtime_error(m), kind(std::move(k)), http_status(status) {}
+};
+
+// HTTP statuses that may succeed when the same request is sent again: timeouts,
+// rate limits and server errors. Shared by the dispatcher's retries and the requeue.
+static bool transient_http_status(long http_status) {
+    return http_status == 408 || http_status == 429 || http_status >= 500;
+}
+
+// Whether the model stage is worth another try: not for OCR failures or for requests
+// the API rejects as such (400, 401, 403, 404, ...)
+static bool retryable_failure(const std::string &kind, long http_status) {
+    if (kind == "ocr" || kind == "batch" || kind == "local" || kind.empty()) return false;
+    if (kind != "http") return true;
+    return transient_http_status(http_status);
+}
+
 static bool has_ext(const fs::path &p, std::initializer_list<std::string> exts) {
     if (!p.has_extension()) return false;
     auto e = p.extension().string();
@@ -80,11 +190,12 @@ static bool is_pdf(const fs::path &p)   { return has_ext(p, {".pdf"}); }
 static bool is_image(const fs::path &p) { return has_ext(p, {".png",".jpg",".jpeg",".tif",".tiff",".bmp",".webp"}); }
 
 static std::string to_lower(std::string s) { std::transform(s.begin(), s.end(), s.begin(), ::tolower); return s; }
-static std::string trim_copy(const std::string &s) {
-    size_t a = s.find_first_not_of(" \t\r\n");
-    if (a == std::string::npos) return "";
-    size_t b = s.find_last_not_of(" \t\r\n");
-    return s.substr(a, b - a + 1);
+static bool is_trim_space(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+static std::string_view trim_view(std::string_view s) {
+    size_t a = 0, b = s.size();
+    while (a < b && is_trim_space(s[a])) ++a;
+    while (b > a && is_trim_space(s[b - 1])) --b;
+    return s.substr(a, b - a);
 }
 
 // FNV-1a 64 bit for cache keys
@@ -96,12 +207,30 @@ static uint64_t fnv1a_64(const std::string &s) {
     return h;
 }
 
+// Set bits, e.g. the Hamming distance of two SimHashes
+static int popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ULL);
+    x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
 // ---------------- CLI ----------------
 static Config parse_cli(int argc, char** argv) {
     if (argc < 4) {
         std::cerr << "Usage: " << argv[0] << " INPUT_PATH OPENAI_API_KEY OUTPUT_JSON [--threads=N] [--lang=eng] "
                   << "[--model=gpt-4o-mini] [--per-file] [--jsonl=path.jsonl] [--cache=.cache] "
-                  << "[--redact] [--audit] [--timeout=120] [--max-lines=14] [--max-chars=1400]\n";
+                  << "[--redact[=ssn,phone,email]] [--audit] [--timeout=120] [--max-lines=14] [--max-chars=1400] [--doctypes=doc_types.json] [--no-arena] [--no-normalize] [--no-condensed]\n"
+                  << "[--tokenizer=o200k_base.tiktoken] [--max-tokens=400] [--chunked] [--chunk-tokens=6000] [--max-chunks=8]\n"
+                  << "[--near-dup=3] [--compact-prompt] [--abbrev=abbreviations.tsv] [--inflight=16] [--rpm=N] [--tpm=N]\n"
+                  << "[--base-url=https://api.openai.com/v1] [--auth=bearer|api-key|none] [--dialect=functions|tools|json-schema]\n"
+                  << "[--batch-out=batch.jsonl] [--batch-in=results.jsonl --batch-state=batch.state.json]\n"
+                  << "[--llama-model=model.gguf] [--llama-ctx=8192] [--llama-threads=N] [--llama-workers=1]\n"
+                  << "[--coalesce=8] [--coalesce-wait=1500] [--coalesce-tokens=400]\n";
         std::exit(1);
     }
     Config c;
@@ -113,15 +242,63 @@ static Config parse_cli(int argc, char** argv) {
         if (a.rfind("--threads=",0)==0) c.threads = std::max(1, std::stoi(a.substr(10)));
         else if (a.rfind("--lang=",0)==0) c.ocr_lang = a.substr(7);
         else if (a.rfind("--model=",0)==0) c.model = a.substr(8);
+        else if (a.rfind("--base-url=",0)==0) c.base_url = a.substr(11);
+        else if (a.rfind("--auth=",0)==0) {
+            c.auth = a.substr(7);
+            if (c.auth != "bearer" && c.auth != "api-key" && c.auth != "none") die("--auth must be bearer, api-key or none");
+        }
+        else if (a.rfind("--dialect=",0)==0) {
+            std::string d = a.substr(10);
+            if (d == "functions") c.dialect = Dialect::Functions;
+            else if (d == "tools") c.dialect = Dialect::Tools;
+            else if (d == "json-schema") c.dialect = Dialect::JsonSchema;
+            else die("--dialect must be functions, tools or json-schema");
+        }
         else if (a == "--per-file") c.per_file = true;
         else if (a.rfind("--jsonl=",0)==0) c.jsonl_path = a.substr(8);
         else if (a.rfind("--cache=",0)==0) c.cache_dir = a.substr(8);
-        else if (a == "--redact") c.redact = true;
+        else if (a.rfind("--doctypes=",0)==0) c.doctypes_path = a.substr(11);
+        else if (a.rfind("--tokenizer=",0)==0) c.tokenizer_path = a.substr(12);
+        else if (a.rfind("--max-tokens=",0)==0) c.max_tokens = std::max<size_t>(64, std::stoul(a.substr(13)));
+        else if (a == "--chunked") c.chunked = true;
+        else if (a.rfind("--chunk-tokens=",0)==0) c.chunk_tokens = std::max<size_t>(500, std::stoul(a.substr(15)));
+        else if (a.rfind("--max-chunks=",0)==0) c.max_chunks = std::max<size_t>(2, std::stoul(a.substr(13)));
+        else if (a.rfind("--near-dup=",0)==0) c.near_dup_bits = std::clamp(std::stoi(a.substr(11)), 0, 15);
+        else if (a == "--compact-prompt") c.compact_prompt = true;
+        else if (a.rfind("--abbrev=",0)==0) c.abbrev_path = a.substr(9);
+        else if (a == "--redact") c.redact_classes = "ssn,phone,email";
+        else if (a.rfind("--redact=",0)==0) c.redact_classes = a.substr(9);
         else if (a == "--audit") c.audit_raw_ocr = true;
+        else if (a == "--no-arena") c.doc_arena = false;
+        else if (a == "--no-normalize") c.normalize = false;
+        else if (a == "--no-condensed") c.condensed = false;
+        else if (a.rfind("--rpm=",0)==0) c.rpm = std::max(0.0, std::stod(a.substr(6)));
+        else if (a.rfind("--tpm=",0)==0) c.tpm = std::max(0.0, std::stod(a.substr(6)));
+        else if (a.rfind("--batch-out=",0)==0) c.batch_out = a.substr(12);
+        else if (a.rfind("--batch-in=",0)==0) c.batch_in = a.substr(11);
+        else if (a.rfind("--batch-state=",0)==0) c.batch_state = a.substr(14);
+        else if (a.rfind("--llama-model=",0)==0) c.llama_model = a.substr(14);
+        else if (a.rfind("--llama-ctx=",0)==0) c.llama_ctx = std::clamp(std::stoi(a.substr(12)), 2048, 131072);
+        else if (a.rfind("--llama-threads=",0)==0) c.llama_threads = std::max(0, std::stoi(a.substr(16)));
+        else if (a.rfind("--llama-workers=",0)==0) c.llama_workers = std::clamp(std::stoi(a.substr(16)), 1, 16);
+        else if (a.rfind("--coalesce=",0)==0) {
+            c.coalesce = std::clamp(std::stoi(a.substr(11)), 0, 32);
+            if (c.coalesce == 1) c.coalesce = 0;
+        }
+        else if (a.rfind("--coalesce-wait=",0)==0) c.coalesce_wait_ms = std::clamp(std::stoi(a.substr(16)), 10, 60000);
+        else if (a.rfind("--coalesce-tokens=",0)==0) c.coalesce_tokens = std::max(50L, std::stol(a.substr(18)));
+        else if (a.rfind("--inflight=",0)==0) c.max_inflight = std::clamp(std::stoi(a.substr(11)), 1, 256);
         else if (a.rfind("--timeout=",0)==0) c.http_timeout = std::max(30, std::stoi(a.substr(10)));
         else if (a.rfind("--max-lines=",0)==0) c.max_snippet_lines = std::max<size_t>(6, std::stoul(a.substr(12)));
         else if (a.rfind("--max-chars=",0)==0) c.max_chars_per_snippet = std::max<size_t>(500, std::stoul(a.substr(12)));
     }
+    if (!c.llama_model.empty()) {
+#ifndef LEGAL_OCR_WITH_LLAMA
+        die("--llama-model needs a build with -DLEGAL_OCR_WITH_LLAMA and -lllama");
+#endif
+        // names the outputs; model_cache_key() also covers the model file
+        c.model = "local:" + fs::path(c.llama_model).filename().string();
+    }
     return c;
 }
 
@@ -133,43 +310,77 @@ static size_t curl_write_cb(void* contents, size_t size, size_t nmemb, void* use
     return size * nmemb;
 }
 
-static json http_post_json(const std::string &url, const std::string &bearer, const json &payload, long &http_code, int timeout_sec) {
-    CURL *curl = curl_easy_init();
-    if (!curl) die("curl init failed");
-    std::string response;
-    struct curl_slist *headers = nullptr;
-    std::string auth = "Authorization: Bearer " + bearer;
-    headers = curl_slist_append(headers, auth.c_str());
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+// Keep-alive HTTP. Model requests run on the dispatcher's curl multi handle (see Async
+// LLM dispatch), whose connection cache keeps connections to the API open between
+// requests. Its easy handles also share the DNS cache and TLS sessions through one
+// CURLSH, so a reconnect resumes the TLS session instead of a full handshake.
+struct HttpStats {
+    std::atomic<long> requests{0};
+    std::atomic<long> new_connections{0};   // requests - new_connections went over a reused one
+    std::atomic<long long> connect_us{0};   // TCP + TLS setup
+    std::atomic<long long> total_us{0};
 
-    std::string body = payload.dump();
-
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body.c_str());
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout_sec);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    json to_json() const {
+        long n = requests.load(), fresh = new_connections.load();
+        return {{"requests", n}, {"new_connections", fresh}, {"reused_connections", n - fresh},
+                {"avg_connect_ms", fresh ? connect_us.load() / 1000.0 / fresh : 0.0},
+                {"avg_request_ms", n ? total_us.load() / 1000.0 / n : 0.0}};
+    }
+};
 
-    CURLcode res = curl_easy_perform(curl);
-    http_code = 0;
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+class HttpPool {
+public:
+    // After curl_global_init()
+    void init() {
+        share_ = curl_share_init();
+        if (!share_) die("curl share init failed");
+        curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock_cb);
+        curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock_cb);
+        curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    }
+    // Once every easy handle is cleaned up, before curl_global_cleanup()
+    void cleanup() {
+        if (share_) curl_share_cleanup(share_);
+        share_ = nullptr;
+    }
 
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
+    // Shared caches and keep-alive on a (freshly reset) easy handle
+    void attach(CURL *c) {
+        if (share_) curl_easy_setopt(c, CURLOPT_SHARE, share_);
+        curl_easy_setopt(c, CURLOPT_TCP_KEEPALIVE, 1L);
+    }
 
-    if (res != CURLE_OK) {
-        die(std::string("curl failed: ") + curl_easy_strerror(res));
+    // Connection reuse and timing of the transfer that just finished on c
+    void record(CURL *c) {
+        long fresh = 0;
+        curl_off_t connect = 0, total = 0;
+        curl_easy_getinfo(c, CURLINFO_NUM_CONNECTS, &fresh);
+        curl_easy_getinfo(c, CURLINFO_APPCONNECT_TIME_T, &connect);
+        if (!connect) curl_easy_getinfo(c, CURLINFO_CONNECT_TIME_T, &connect); // plain http
+        curl_easy_getinfo(c, CURLINFO_TOTAL_TIME_T, &total);
+        stats.requests++;
+        if (fresh) {
+            stats.new_connections += fresh;
+            stats.connect_us += (long long)connect;
+        }
+        stats.total_us += (long long)total;
     }
 
-    try {
-        return json::parse(response.empty() ? "{}" : response);
-    } catch (...) {
-        std::cerr << "Raw response: " << response << std::endl;
-        die("Failed to parse JSON response from API");
+    HttpStats stats;
+
+private:
+    static void lock_cb(CURL *, curl_lock_data d, curl_lock_access, void *self) {
+        static_cast<HttpPool *>(self)->mu_[d].lock();
+    }
+    static void unlock_cb(CURL *, curl_lock_data d, void *self) {
+        static_cast<HttpPool *>(self)->mu_[d].unlock();
     }
-    return {};
-}
+
+    CURLSH *share_ = nullptr;
+    std::mutex mu_[CURL_LOCK_DATA_LAST];
+} http_pool;
 
 // ---------------- PDF to images ----------------
 static std::vector<std::string> pdf_to_images(const std::string &pdf_path, const std::string &out_dir_base) {
@@ -177,7 +388,7 @@ static std::vector<std::string> pdf_to_images(const std::string &pdf_path, const
     std::string prefix = (fs::path(out_dir_base) / "page").string();
     std::string cmd = "pdftoppm -png \"" + pdf_path + "\" \"" + prefix + "\"";
     int rc = run_cmd(cmd);
-    if (rc != 0) die("pdftoppm failed for " + pdf_path);
+    if (rc != 0) throw DocError("ocr", "pdftoppm failed for " + pdf_path);
 
     std::vector<std::string> paths;
     for (auto &entry : fs::directory_iterator(out_dir_base)) {
@@ -213,573 +424,3472 @@ static cv::Mat deskew(const cv::Mat &srcGray) {
     return dst;
 }
 
-static std::string ocr_image_path(const std::string &image_path, const Config &cfg) {
+// Deskewed, denoised and binarized (text black on white) page raster; empty if unreadable
+static cv::Mat prepare_page(const std::string &image_path) {
     cv::Mat img = cv::imread(image_path, cv::IMREAD_COLOR);
-    if (img.empty()) return "";
+    if (img.empty()) return img;
     cv::Mat gray; cv::cvtColor(img, gray, cv::COLOR_BGR2GRAY);
     cv::Mat gray2 = deskew(gray);
     cv::Mat den; cv::fastNlMeansDenoising(gray2, den, 30.0);
     cv::Mat th;  cv::adaptiveThreshold(den, th, 255, cv::ADAPTIVE_THRESH_GAUSSIAN_C, cv::THRESH_BINARY, 31, 15);
+    return th;
+}
 
-    std::string tmp = (fs::temp_directory_path() / (fs::path(image_path).filename().string() + ".ocr.png")).string();
-    cv::imwrite(tmp, th);
-
+// OCR of a binarized raster (or a region of one) into out
+template <class Str> static void ocr_mat(const cv::Mat &bin, const Config &cfg, Str &out) {
     tesseract::TessBaseAPI tess;
     if (tess.Init(nullptr, cfg.ocr_lang.c_str(), tesseract::OEM_LSTM_ONLY)) {
         std::cerr << "Tesseract init failed" << std::endl;
-        return "";
+        return;
     }
     tess.SetVariable("preserve_interword_spaces", "1");
-    Pix *px = pixRead(tmp.c_str());
-    if (!px) return "";
-    tess.SetImage(px);
-    char *out = tess.GetUTF8Text();
-    std::string text = out ? std::string(out) : std::string();
-    delete [] out;
-    pixDestroy(&px);
+    tess.SetImage(bin.data, bin.cols, bin.rows, 1, (int)bin.step);
+    char *text = tess.GetUTF8Text();
+    if (text) out.assign(text);
+    delete [] text;
     tess.End();
-    return text;
-}
-
-// ---------------- Doc type classification ----------------
-enum class DocType { MEDICAL, PLEADING, POLICE, TRANSCRIPT, INSURANCE_EOB, IMAGING, UNKNOWN };
-
-static DocType classify_doc(const std::string &text) {
-    std::string t = to_lower(text);
-    int med=0, pld=0, pol=0, tr=0, eob=0, img=0;
-
-    for (auto &k : { "diagnosis","treatment","medication","mrn","cpt","icd","history of present illness" }) if (t.find(k)!=std::string::npos) med++;
-    for (auto &k : { "plaintiff","defendant","index no","caption","verified complaint","affirmation","affidavit","notice of motion","bill of particulars" }) if (t.find(k)!=std::string::npos) pld++;
-    for (auto &k : { "police report","officer","badge","mv104","collision","accident report","precinct" }) if (t.find(k)!=std::string::npos) pol++;
-    for (auto &k : { "examination before trial","ebt","deposition","q:","a:","court reporter","witness" }) if (t.find(k)!=std::string::npos) tr++;
-    for (auto &k : { "explanation of benefits","eob","claim number","payer","allowed amount","denied","adjustment code"}) if (t.find(k)!=std::string::npos) eob++;
-    for (auto &k : { "impression","findings","radiology","mri","ct","x-ray","ultrasound","images reviewed" }) if (t.find(k)!=std::string::npos) img++;
-
-    int best = std::max({med,pld,pol,tr,eob,img});
-    if (best==0) return DocType::UNKNOWN;
-    if (best==med) return DocType::MEDICAL;
-    if (best==pld) return DocType::PLEADING;
-    if (best==pol) return DocType::POLICE;
-    if (best==tr)  return DocType::TRANSCRIPT;
-    if (best==eob) return DocType::INSURANCE_EOB;
-    if (best==img) return DocType::IMAGING;
-    return DocType::UNKNOWN;
-}
-
-static const char* doc_type_str(DocType d) {
-    switch(d) {
-        case DocType::MEDICAL: return "medical_record";
-        case DocType::PLEADING: return "pleading";
-        case DocType::POLICE: return "police_report";
-        case DocType::TRANSCRIPT: return "transcript";
-        case DocType::INSURANCE_EOB: return "insurance_eob";
-        case DocType::IMAGING: return "imaging_report";
-        default: return "unknown";
-    }
 }
 
-// ---------------- Snippet extraction ----------------
-static void add_keyword_windows(std::vector<std::string> &keep, const std::string &text,
-                                const std::vector<std::string> &keys, size_t max_lines) {
-    std::vector<std::string> lines;
-    std::istringstream iss(text);
-    std::string line;
-    while (std::getline(iss, line)) lines.push_back(trim_copy(line));
+// ---------------- Condensed transcripts ----------------
+// Court reporters often deliver condensed (4-up) transcripts: four deposition pages per
+// sheet in a 2x2 grid, read down the left column and then the right. OCR of the whole
+// sheet interleaves the columns, so the grid is found on the binarized raster and each
+// quadrant is OCR'd as its own page, in parallel. The quadrant's printed page number is
+// picked up later by the transcript parser.
+//
+// A separator is either a blank band (the gap between page frames) or a single ruled
+// line. The vertical one must lie in the middle fifth of the sheet. The horizontal one
+// must lie in the middle fifth of both halves at the same height, and all four
+// quadrants must contain ink. An ordinary page fails the first test, because its text
+// lines cross the middle.
+struct Band { int begin = 0, end = 0; };
 
-    auto tolow = [](std::string s){ std::transform(s.begin(), s.end(), s.begin(), ::tolower); return s; };
-    for (size_t i = 0; i < lines.size(); ++i) {
-        std::string low = tolow(lines[i]);
-        bool hit = false;
-        for (auto &k : keys) if (low.find(k)!=std::string::npos) { hit = true; break; }
-        if (hit) {
-            size_t start = (i>=2? i-2 : 0);
-            size_t end = std::min(lines.size(), i+3);
-            for (size_t j = start; j < end; ++j) {
-                if (!lines[j].empty()) keep.push_back(lines[j]);
-                if (keep.size() >= max_lines) return;
-            }
+// Separator in bins [lo, hi) of an ink profile over a cross extent of `extent` pixels
+static std::optional<Band> find_separator(const std::vector<int> &ink, int extent, int lo, int hi) {
+    const int blank = std::max(1, extent / 500), ruled = extent * 85 / 100;
+    const int min_gap = std::max(4, (int)ink.size() / 200), max_rule = std::max(3, (int)ink.size() / 100);
+    Band best;
+    for (int kind = 0; kind < 2; ++kind) {
+        for (int i = lo; i < hi;) {
+            auto hit = [&](int k) { return kind == 0 ? ink[k] <= blank : ink[k] >= ruled; };
+            if (!hit(i)) { ++i; continue; }
+            int j = i;
+            while (j < hi && hit(j)) ++j;
+            bool ok = kind == 0 ? j - i >= min_gap : j - i <= max_rule;
+            if (ok && j - i > best.end - best.begin) best = {i, j};
+            i = j;
         }
+        if (best.end > best.begin) return best;
     }
+    return std::nullopt;
 }
 
-static std::string join_lines_trunc(const std::vector<std::string> &v, size_t max_chars) {
-    std::string s;
-    for (auto &l : v) {
-        if (s.size() + l.size() + 1 > max_chars) break;
-        s += l; s += "\n";
-    }
-    if (s.size() > max_chars) s.resize(max_chars);
-    return s;
+static std::vector<int> ink_profile(const cv::Mat &ink, int dim) {
+    cv::Mat sum;
+    cv::reduce(ink, sum, dim, cv::REDUCE_SUM, CV_32S);
+    std::vector<int> v(sum.begin<int>(), sum.end<int>());
+    for (int &x : v) x /= 255;
+    return v;
 }
 
-static json regex_first(const std::string &text, const std::regex &re) {
-    std::smatch m;
-    if (std::regex_search(text, m, re)) return json(m[0]);
-    return nullptr;
-}
+// Quadrants in reading order (TL, BL, TR, BR), or nothing if the sheet is not 4-up
+static std::optional<std::array<cv::Rect, 4>> find_condensed_grid(const cv::Mat &bin) {
+    const int W = bin.cols, H = bin.rows;
+    if (W < 400 || H < 400) return std::nullopt;
+    cv::Mat ink = bin == 0;
+    auto v = find_separator(ink_profile(ink, 0), H, W * 2 / 5, W * 3 / 5);
+    if (!v) return std::nullopt;
 
-static json local_extract_generic(const std::string &text) {
-    json j;
-    auto name = regex_first(text, std::regex(R"((?:Patient|Name)\s*[:\-]\s*([A-Za-z ,.\-']{3,90}))", std::regex::icase));
-    if (!name.is_null()) j["name_candidate"] = name;
-    auto date_any = regex_first(text, std::regex(R"((\b\d{4}-\d{2}-\d{2}\b)|(\b\d{1,2}[\/\-]\d{1,2}[\/\-]\d{2,4}\b))"));
-    if (!date_any.is_null()) j["date_candidate"] = date_any;
-    auto phone = regex_first(text, std::regex(R"((\+?\d{1,2}[\s\-\.])?(?:\(?\d{3}\)?[\s\-\.])?\d{3}[\s\-\.]\d{4})"));
-    if (!phone.is_null()) j["phone_candidate"] = phone;
-    return j;
+    cv::Rect left(0, 0, v->begin, H), right(v->end, 0, W - v->end, H);
+    auto hl = find_separator(ink_profile(ink(left), 1), left.width, H * 2 / 5, H * 3 / 5);
+    auto hr = find_separator(ink_profile(ink(right), 1), right.width, H * 2 / 5, H * 3 / 5);
+    if (!hl || !hr || std::abs((hl->begin + hl->end) - (hr->begin + hr->end)) > H / 25) return std::nullopt;
+
+    std::array<cv::Rect, 4> q = {
+        cv::Rect(0, 0, left.width, hl->begin), cv::Rect(0, hl->end, left.width, H - hl->end),
+        cv::Rect(right.x, 0, right.width, hr->begin), cv::Rect(right.x, hr->end, right.width, H - hr->end)};
+    for (auto &r : q) {
+        if (r.width < W / 5 || r.height < H / 5) return std::nullopt;
+        if (cv::countNonZero(ink(r)) < r.area() / 200) return std::nullopt; // blank quadrant
+    }
+    return q;
 }
 
-static json local_extract_by_type(const std::string &text, DocType dt, const Config &cfg) {
-    json j = local_extract_generic(text);
+// OCR of one page image into pages: one entry, or four for a condensed sheet. Returns
+// the number of logical pages on the sheet (0 if the image cannot be read); pages with
+// no text are not appended.
+static int ocr_image_path(const std::string &image_path, const Config &cfg, std::pmr::vector<std::pmr::string> &pages) {
+    cv::Mat bin = prepare_page(image_path);
+    if (bin.empty()) return 0;
+    auto grid = cfg.condensed ? find_condensed_grid(bin) : std::nullopt;
+    if (!grid) {
+        std::pmr::string text(pages.get_allocator().resource());
+        ocr_mat(bin, cfg, text);
+        if (!text.empty()) pages.push_back(std::move(text));
+        return 1;
+    }
+    // The arena is single threaded: quadrants are OCR'd into plain strings
+    std::array<std::string, 4> texts;
+    std::array<std::future<void>, 3> rest;
+    for (int k = 1; k < 4; ++k)
+        rest[k - 1] = std::async(std::launch::async, [&, k]{ ocr_mat(bin((*grid)[k]), cfg, texts[k]); });
+    ocr_mat(bin((*grid)[0]), cfg, texts[0]);
+    for (auto &f : rest) f.get();
+    for (auto &t : texts) if (!t.empty()) pages.emplace_back(t.data(), t.size());
+    return 4;
+}
 
-    std::vector<std::string> keys;
-    if (dt == DocType::MEDICAL) {
-        keys = {"diagnosis","dx","treatment","medication","procedure","impression","assessment","plan","chief complaint","history"};
-    } else if (dt == DocType::PLEADING) {
-        keys = {"caption","plaintiff","defendant","index no","cause of action","negligence","damages","wherefore","relief"};
-    } else if (dt == DocType::POLICE) {
-        keys = {"police report","officer","badge","mv104","collision","accident","location","vehicle","license","injury"};
-    } else if (dt == DocType::TRANSCRIPT) {
-        keys = {"q:","a:","examination before trial","deposition","witness","objection","page","line"};
-    } else if (dt == DocType::INSURANCE_EOB) {
-        keys = {"explanation of benefits","eob","payer","claim","allowed","denied","adjustment","remark code","member"};
-    } else if (dt == DocType::IMAGING) {
-        keys = {"impression","findings","technique","comparison","mri","ct","x-ray","ultrasound"};
-    } else {
-        keys = {"plaintiff","defendant","diagnosis","mv104","deposition","impression","eob"};
+// ---------------- Keyword matcher ----------------
+// Aho-Corasick automaton over ASCII-lowercased bytes. Built once at startup and
+// shared read-only by every worker, so matching a line is one table walk no
+// matter how many keywords are configured.
+class KeywordMatcher {
+public:
+    KeywordMatcher() = default;
+    explicit KeywordMatcher(const std::vector<std::string> &patterns) {
+        count_ = patterns.size();
+        delta_.assign(256, 0);
+        out_.emplace_back();
+        for (size_t id = 0; id < patterns.size(); ++id) {
+            int s = 0;
+            for (unsigned char c : to_lower(patterns[id])) {
+                int &nx = delta_[(size_t)s * 256 + c];
+                if (nx == 0) {
+                    nx = (int)out_.size();
+                    out_.emplace_back();
+                    delta_.resize(delta_.size() + 256, 0);
+                }
+                s = delta_[(size_t)s * 256 + c];
+            }
+            if (!patterns[id].empty()) out_[s].push_back((int)id);
+        }
+        // BFS to turn the trie into a full DFA (failure links folded into delta_)
+        std::vector<int> fail(out_.size(), 0), queue;
+        for (int c = 0; c < 256; ++c) if (delta_[c]) queue.push_back(delta_[c]);
+        for (size_t qi = 0; qi < queue.size(); ++qi) {
+            int s = queue[qi];
+            out_[s].insert(out_[s].end(), out_[fail[s]].begin(), out_[fail[s]].end());
+            for (int c = 0; c < 256; ++c) {
+                int &nx = delta_[(size_t)s * 256 + c];
+                int f = delta_[(size_t)fail[s] * 256 + c];
+                if (nx) { fail[nx] = f; queue.push_back(nx); }
+                else nx = f;
+            }
+        }
     }
 
-    std::vector<std::string> keep;
-    add_keyword_windows(keep, text, keys, cfg.max_snippet_lines);
-    if (keep.empty()) {
-        std::istringstream iss(text);
-        std::string line;
-        while (std::getline(iss, line) && keep.size() < cfg.max_snippet_lines) {
-            line = trim_copy(line);
-            if (!line.empty()) keep.push_back(line);
+    size_t size() const { return count_; }
+
+    // Calls on_hit(pattern_id) for every occurrence, case-insensitively.
+    template <class F> void scan(std::string_view text, F &&on_hit) const {
+        if (!count_) return;
+        int s = 0;
+        for (unsigned char c : text) {
+            s = delta_[(size_t)s * 256 + (unsigned char)std::tolower(c)];
+            for (int id : out_[s]) on_hit(id);
         }
     }
-    j["important_snippets"] = join_lines_trunc(keep, cfg.max_chars_per_snippet);
-    j["char_count"] = (int)text.size();
 
-    // transcript page, line, quote extraction
-    if (dt == DocType::TRANSCRIPT) {
-        std::vector<json> cites;
-        std::regex re_pg(R"(page\s+(\d+))", std::regex::icase);
-        std::regex re_ln(R"(line[s]?\s+(\d+)(?:\s*-\s*(\d+))?)", std::regex::icase);
-        std::istringstream iss(text);
-        std::string line;
-        int curPage = -1;
-        while (std::getline(iss, line)) {
-            std::smatch m;
-            if (std::regex_search(line, m, re_pg)) curPage = std::stoi(m[1]);
-            if (std::regex_search(line, m, re_ln)) {
-                json c; c["page"] = std::max(0, curPage);
-                c["line"] = m[0].str();
-                c["text"] = trim_copy(line);
-                cites.push_back(c);
-                if (cites.size() >= 10) break;
-            }
+    bool any(std::string_view text) const {
+        if (!count_) return false;
+        int s = 0;
+        for (unsigned char c : text) {
+            s = delta_[(size_t)s * 256 + (unsigned char)std::tolower(c)];
+            if (!out_[s].empty()) return true;
         }
-        if (!cites.empty()) j["local_citations"] = cites;
+        return false;
     }
 
-    return j;
-}
+private:
+    size_t count_ = 0;
+    std::vector<int> delta_;             // state * 256 + byte -> next state
+    std::vector<std::vector<int>> out_;  // state -> pattern ids ending here
+};
 
-// ---------------- Schemas ----------------
-static json schema_medical() {
-    return {
-        {"name","extract_medical_json"},
-        {"description","Return compact JSON for medical record"},
-        {"parameters", {
-            {"type","object"},
-            {"properties", {
-                {"patient_name", {{"type","string"}}},
-                {"dob", {{"type","string"}}},
-                {"dates_of_service", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"diagnoses", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"procedures", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"medications", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"confidence", {{"type","number"}}}
-            }},
-            {"required", json::array({"patient_name","confidence"})}
-        }}
-    };
-}
-static json schema_pleading() {
-    return {
-        {"name","extract_pleading_json"},
-        {"description","Return compact JSON for pleading"},
-        {"parameters", {
-            {"type","object"},
-            {"properties", {
-                {"court", {{"type","string"}}},
-                {"caption", {{"type","string"}}},
-                {"index_number", {{"type","string"}}},
-                {"parties", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"causes_of_action", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"relief_sought", {{"type","string"}}},
-                {"confidence", {{"type","number"}}}
-            }},
-            {"required", json::array({"caption","confidence"})}
-        }}
-    };
-}
-static json schema_police() {
-    return {
-        {"name","extract_police_json"},
-        {"description","Return compact JSON for police report"},
-        {"parameters", {
-            {"type","object"},
-            {"properties", {
-                {"report_number", {{"type","string"}}},
-                {"incident_date", {{"type","string"}}},
-                {"location", {{"type","string"}}},
-                {"officer", {{"type","string"}}},
-                {"vehicles", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"injuries", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"violations", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"confidence", {{"type","number"}}}
-            }},
-            {"required", json::array({"incident_date","confidence"})}
-        }}
-    };
-}
-static json schema_transcript() {
-    return {
-        {"name","extract_transcript_json"},
-        {"description","Return compact JSON for deposition or 50-h transcript"},
-        {"parameters", {
-            {"type","object"},
-            {"properties", {
-                {"witness_name", {{"type","string"}}},
-                {"date", {{"type","string"}}},
-                {"key_admissions", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"key_inconsistencies", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"credibility_factors", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"citations", {{"type","array"}, {"items", {
-                    {"type","object"},
-                    {"properties", {
-                        {"page",{ {"type","integer"} }},
-                        {"line",{ {"type","string"} }},
-                        {"text",{ {"type","string"} }}
-                    }},
-                    {"required", json::array({"page","text"})}
-                }}}}},
-                {"confidence", {{"type","number"}}}
+// ---------------- Doc type registry ----------------
+// Doc types are data: keywords for classification, snippet keys, and the function
+// schema sent to the model. The registry is loaded once at startup (--doctypes=FILE,
+// otherwise the built-in table below) and compiled into immutable matchers and
+// pre-serialized request fragments.
+
+// A function schema serialized for each request dialect, with the system prompt that
+// goes with it. Both are fixed per doc type, so every request of the type starts with
+// the same bytes (schema, then system message) and the provider's prompt cache can
+// serve that prefix; only the user message differs between documents.
+struct SchemaFragments {
+    std::string func_name;
+    std::string system_prompt;
+    std::string functions_json;                // functions.dump()
+    std::string function_call_json;            // {"name":func_name} dumped
+    std::string tools_json;                    // the same for the tools dialect
+    std::string tool_choice_json;
+    std::string response_format_json;          // func_name's parameters for the json-schema dialect
+};
+
+struct DocTypeSpec {
+    std::string id;                            // output label, e.g. "medical_record"
+    std::vector<std::string> classify_keywords;
+    std::vector<std::string> snippet_keys;
+    bool transcript_citations = false;         // page/line citation extraction
+    json functions = json::array();            // OpenAI "functions" array
+    // compiled
+    std::string func_name;
+    KeywordMatcher snippet_matcher;
+    SchemaFragments schema;
+    SchemaFragments coalesced;                 // array of results with ids (--coalesce); empty for several functions
+};
+
+struct DocTypeRegistry {
+    std::vector<DocTypeSpec> types;            // classification ties resolve in this order
+    DocTypeSpec unknown;
+    KeywordMatcher classify_matcher;
+    std::vector<size_t> classify_owner;        // classify pattern id -> index into types
+
+    const DocTypeSpec *find(const std::string &id) const {
+        for (auto &t : types) if (t.id == id) return &t;
+        return id == unknown.id ? &unknown : nullptr;
+    }
+};
+
+static const char *kBuiltinDocTypes = R"JSON({
+  "doc_types": [
+    {
+      "id": "medical_record",
+      "classify_keywords": ["diagnosis","treatment","medication","mrn","cpt","icd","history of present illness"],
+      "snippet_keys": ["diagnosis","dx","treatment","medication","procedure","impression","assessment","plan","chief complaint","history"],
+      "function": {
+        "name": "extract_medical_json",
+        "description": "Return compact JSON for medical record",
+        "parameters": {
+          "type": "object",
+          "properties": {
+            "patient_name": {"type": "string"},
+            "dob": {"type": "string"},
+            "dates_of_service": {"type": "array", "items": {"type": "string"}},
+            "diagnoses": {"type": "array", "items": {"type": "string"}},
+            "procedures": {"type": "array", "items": {"type": "string"}},
+            "medications": {"type": "array", "items": {"type": "string"}},
+            "confidence": {"type": "number"}
+          },
+          "required": ["patient_name","confidence"]
+        }
+      }
+    },
+    {
+      "id": "pleading",
+      "classify_keywords": ["plaintiff","defendant","index no","caption","verified complaint","affirmation","affidavit","notice of motion","bill of particulars"],
+      "snippet_keys": ["caption","plaintiff","defendant","index no","cause of action","negligence","damages","wherefore","relief"],
+      "function": {
+        "name": "extract_pleading_json",
+        "description": "Return compact JSON for pleading",
+        "parameters": {
+          "type": "object",
+          "properties": {
+            "court": {"type": "string"},
+            "caption": {"type": "string"},
+            "index_number": {"type": "string"},
+            "parties": {"type": "array", "items": {"type": "string"}},
+            "causes_of_action": {"type": "array", "items": {"type": "string"}},
+            "relief_sought": {"type": "string"},
+            "confidence": {"type": "number"}
+          },
+          "required": ["caption","confidence"]
+        }
+      }
+    },
+    {
+      "id": "police_report",
+      "classify_keywords": ["police report","officer","badge","mv104","collision","accident report","precinct"],
+      "snippet_keys": ["police report","officer","badge","mv104","collision","accident","location","vehicle","license","injury"],
+      "function": {
+        "name": "extract_police_json",
+        "description": "Return compact JSON for police report",
+        "parameters": {
+          "type": "object",
+          "properties": {
+            "report_number": {"type": "string"},
+            "incident_date": {"type": "string"},
+            "location": {"type": "string"},
+            "officer": {"type": "string"},
+            "vehicles": {"type": "array", "items": {"type": "string"}},
+            "injuries": {"type": "array", "items": {"type": "string"}},
+            "violations": {"type": "array", "items": {"type": "string"}},
+            "confidence": {"type": "number"}
+          },
+          "required": ["incident_date","confidence"]
+        }
+      }
+    },
+    {
+      "id": "transcript",
+      "classify_keywords": ["examination before trial","ebt","deposition","q:","a:","court reporter","witness"],
+      "snippet_keys": ["q:","a:","examination before trial","deposition","witness","objection","page","line"],
+      "transcript_citations": true,
+      "function": {
+        "name": "extract_transcript_json",
+        "description": "Return compact JSON for deposition or 50-h transcript",
+        "parameters": {
+          "type": "object",
+          "properties": {
+            "witness_name": {"type": "string"},
+            "date": {"type": "string"},
+            "key_admissions": {"type": "array", "items": {"type": "string"}},
+            "key_inconsistencies": {"type": "array", "items": {"type": "string"}},
+            "credibility_factors": {"type": "array", "items": {"type": "string"}},
+            "citations": {"type": "array", "items": {
+              "type": "object",
+              "properties": {
+                "page": {"type": "integer"},
+                "line": {"type": "string"},
+                "text": {"type": "string"}
+              },
+              "required": ["page","text"]
             }},
-            {"required", json::array({"confidence"})}
-        }}
-    };
+            "confidence": {"type": "number"}
+          },
+          "required": ["confidence"]
+        }
+      }
+    },
+    {
+      "id": "insurance_eob",
+      "classify_keywords": ["explanation of benefits","eob","claim number","payer","allowed amount","denied","adjustment code"],
+      "snippet_keys": ["explanation of benefits","eob","payer","claim","allowed","denied","adjustment","remark code","member"],
+      "function": {
+        "name": "extract_eob_json",
+        "description": "Return compact JSON for insurance explanation of benefits",
+        "parameters": {
+          "type": "object",
+          "properties": {
+            "payer": {"type": "string"},
+            "member": {"type": "string"},
+            "claim_number": {"type": "string"},
+            "service_dates": {"type": "array", "items": {"type": "string"}},
+            "allowed_amount": {"type": "string"},
+            "denied_amount": {"type": "string"},
+            "adjustments": {"type": "array", "items": {"type": "string"}},
+            "confidence": {"type": "number"}
+          },
+          "required": ["payer","claim_number","confidence"]
+        }
+      }
+    },
+    {
+      "id": "imaging_report",
+      "classify_keywords": ["impression","findings","radiology","mri","ct","x-ray","ultrasound","images reviewed"],
+      "snippet_keys": ["impression","findings","technique","comparison","mri","ct","x-ray","ultrasound"],
+      "function": {
+        "name": "extract_imaging_json",
+        "description": "Return compact JSON for imaging report",
+        "parameters": {
+          "type": "object",
+          "properties": {
+            "patient_name": {"type": "string"},
+            "study_type": {"type": "string"},
+            "study_date": {"type": "string"},
+            "impression": {"type": "array", "items": {"type": "string"}},
+            "findings": {"type": "array", "items": {"type": "string"}},
+            "confidence": {"type": "number"}
+          },
+          "required": ["impression","confidence"]
+        }
+      }
+    }
+  ],
+  "unknown": {
+    "id": "unknown",
+    "snippet_keys": ["plaintiff","defendant","diagnosis","mv104","deposition","impression","eob"]
+  }
+})JSON";
+
+static std::vector<std::string> json_string_list(const json &j, const char *key) {
+    std::vector<std::string> v;
+    if (j.contains(key)) for (auto &s : j.at(key)) v.push_back(to_lower(s.get<std::string>()));
+    return v;
 }
-static json schema_eob() {
-    return {
-        {"name","extract_eob_json"},
-        {"description","Return compact JSON for insurance explanation of benefits"},
-        {"parameters", {
-            {"type","object"},
-            {"properties", {
-                {"payer", {{"type","string"}}},
-                {"member", {{"type","string"}}},
-                {"claim_number", {{"type","string"}}},
-                {"service_dates", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"allowed_amount", {{"type","string"}}},
-                {"denied_amount", {{"type","string"}}},
-                {"adjustments", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"confidence", {{"type","number"}}}
-            }},
-            {"required", json::array({"payer","claim_number","confidence"})}
-        }}
-    };
+
+static SchemaFragments compile_schema(const json &functions, const std::string &func_name, std::string system_prompt) {
+    SchemaFragments s;
+    s.func_name = func_name;
+    s.system_prompt = std::move(system_prompt);
+    s.functions_json = functions.dump();
+    s.function_call_json = json{{"name", func_name}}.dump();
+    json tools = json::array(), schema = json::object();
+    for (auto &f : functions) {
+        tools.push_back({{"type", "function"}, {"function", f}});
+        if (f.value("name", "") == func_name) schema = f.value("parameters", json::object());
+    }
+    s.tools_json = tools.dump();
+    s.tool_choice_json = json{{"type", "function"}, {"function", {{"name", func_name}}}}.dump();
+    s.response_format_json = json{{"type", "json_schema"}, {"json_schema", {{"name", func_name}, {"schema", schema}}}}.dump();
+    return s;
 }
-static json schema_imaging() {
+
+// The doc type's function wrapped for several documents in one request: a "results"
+// array whose items are the original object plus the document's "id".
+static json coalesced_function(const json &fn) {
+    json item = fn.value("parameters", json::object());
+    item["type"] = "object";
+    item["properties"]["id"] = {{"type", "string"}};
+    json req = json::array({"id"});
+    for (auto &r : item.value("required", json::array())) req.push_back(r);
+    item["required"] = req;
     return {
-        {"name","extract_imaging_json"},
-        {"description","Return compact JSON for imaging report"},
-        {"parameters", {
-            {"type","object"},
-            {"properties", {
-                {"patient_name", {{"type","string"}}},
-                {"study_type", {{"type","string"}}},
-                {"study_date", {{"type","string"}}},
-                {"impression", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"findings", {{"type","array"}, {"items", {{"type","string"}}}}},
-                {"confidence", {{"type","number"}}}
-            }},
-            {"required", json::array({"impression","confidence"})}
-        }}
+        {"name", fn.value("name", std::string("extract")) + "_batch"},
+        {"description", "One result per document id. " + fn.value("description", std::string(""))},
+        {"parameters", {{"type", "object"}, {"properties", {{"results", {{"type", "array"}, {"items", item}}}}},
+                        {"required", {"results"}}}}
     };
 }
 
-static json build_functions_for(DocType dt) {
-    switch(dt) {
-        case DocType::MEDICAL: return json::array({schema_medical()});
-        case DocType::PLEADING: return json::array({schema_pleading()});
-        case DocType::POLICE: return json::array({schema_police()});
-        case DocType::TRANSCRIPT: return json::array({schema_transcript()});
-        case DocType::INSURANCE_EOB: return json::array({schema_eob()});
-        case DocType::IMAGING: return json::array({schema_imaging()});
-        default: return json::array({schema_medical(), schema_pleading(), schema_police(), schema_transcript(), schema_eob(), schema_imaging()});
+static void compile_doc_type(DocTypeSpec &t) {
+    t.snippet_matcher = KeywordMatcher(t.snippet_keys);
+    // everything that does not depend on the document belongs here, not in the user message
+    std::string system = "You extract structured data for legal and medical workflows. Return only compact JSON "
+                         "matching the function schema, no extra text. Document type guess: " + t.id + ".";
+    t.schema = compile_schema(t.functions, t.func_name, system);
+    if (t.functions.size() == 1) {
+        json fn = coalesced_function(t.functions[0]);
+        t.coalesced = compile_schema(json::array({fn}), fn["name"].get<std::string>(),
+                                     system + " Several documents follow, each after a line \"### <id>\". Return one "
+                                     "entry in \"results\" per document, with its id.");
     }
 }
-static std::string func_name_for(DocType dt) {
-    switch(dt) {
-        case DocType::MEDICAL: return "extract_medical_json";
-        case DocType::PLEADING: return "extract_pleading_json";
-        case DocType::POLICE: return "extract_police_json";
-        case DocType::TRANSCRIPT: return "extract_transcript_json";
-        case DocType::INSURANCE_EOB: return "extract_eob_json";
-        case DocType::IMAGING: return "extract_imaging_json";
-        default: return "extract_medical_json";
+
+// The schema part of a request in the configured dialect
+static std::string_view schema_json(const SchemaFragments &s, Dialect d) {
+    switch (d) {
+    case Dialect::Tools: return s.tools_json;
+    case Dialect::JsonSchema: return s.response_format_json;
+    default: return s.functions_json;
     }
 }
 
-// ---------------- Rate limit and backoff ----------------
-struct RateLimiter {
-    std::mutex mu;
-    std::chrono::steady_clock::time_point next_ok = std::chrono::steady_clock::now();
-    int qps = 3; // rough client side limit
-    void wait() {
-        std::unique_lock<std::mutex> lk(mu);
-        auto now = std::chrono::steady_clock::now();
-        if (now < next_ok) std::this_thread::sleep_until(next_ok);
-        next_ok = std::chrono::steady_clock::now() + std::chrono::milliseconds(1000 / std::max(1,qps));
+// Loads doc types from a JSON file (or the built-in table when path is empty).
+// Format: {"doc_types":[{id, classify_keywords, snippet_keys, transcript_citations,
+// function:{name, description, parameters}}], "unknown":{id, snippet_keys, function_call}}
+static DocTypeRegistry load_doc_registry(const std::string &path) {
+    json cfg;
+    try {
+        if (path.empty()) {
+            cfg = json::parse(kBuiltinDocTypes);
+        } else {
+            std::ifstream f(path);
+            if (!f) die("Cannot open doc types file: " + path);
+            cfg = json::parse(f);
+        }
+    } catch (const json::exception &e) {
+        die("Invalid doc types file " + (path.empty() ? std::string("(built-in)") : path) + ": " + e.what());
     }
-} limiter;
+    if (!cfg.contains("doc_types") || !cfg["doc_types"].is_array() || cfg["doc_types"].empty())
+        die("Doc types file has no \"doc_types\" array");
 
-// ---------------- OpenAI call ----------------
-static json call_openai_compact(const Config &cfg, DocType dt, const json &local_candidates, const std::string &snippet) {
-    json req;
-    req["model"] = cfg.model;
-    req["temperature"] = 0.0;
+    DocTypeRegistry reg;
+    std::vector<std::string> classify_patterns;
+    json all_functions = json::array();
+    for (auto &d : cfg["doc_types"]) {
+        DocTypeSpec t;
+        try {
+            t.id = d.at("id").get<std::string>();
+            t.classify_keywords = json_string_list(d, "classify_keywords");
+            t.snippet_keys = json_string_list(d, "snippet_keys");
+            t.transcript_citations = d.value("transcript_citations", false);
+            t.func_name = d.at("function").at("name").get<std::string>();
+            t.functions.push_back(d.at("function"));
+        } catch (const json::exception &e) {
+            die("Invalid doc type entry " + d.dump() + ": " + e.what());
+        }
+        if (reg.find(t.id)) die("Duplicate doc type id: " + t.id);
+        for (auto &k : t.classify_keywords) {
+            classify_patterns.push_back(k);
+            reg.classify_owner.push_back(reg.types.size());
+        }
+        all_functions.push_back(t.functions[0]);
+        compile_doc_type(t);
+        reg.types.push_back(std::move(t));
+    }
 
-    json messages = json::array();
-    messages.push_back({
-        {"role","system"},
-        {"content","You extract structured data for legal and medical workflows. Return only compact JSON matching the function schema, no extra text."}
-    });
+    // Unknown documents get every schema and default to the first doc type's function
+    json u = cfg.value("unknown", json::object());
+    reg.unknown.id = u.value("id", "unknown");
+    reg.unknown.snippet_keys = json_string_list(u, "snippet_keys");
+    reg.unknown.functions = all_functions;
+    reg.unknown.func_name = u.value("function_call", reg.types.front().func_name);
+    compile_doc_type(reg.unknown);
 
-    json u = {
-        {"role","user"},
-        {"content",
-            std::string("Document type guess: ") + doc_type_str(dt) +
-            ". Keep output minified JSON only.\n" +
-            local_candidates.dump() + "\n---\n" +
-            snippet.substr(0, cfg.max_chars_per_snippet)
-        }
-    };
-    messages.push_back(u);
+    reg.classify_matcher = KeywordMatcher(classify_patterns);
+    return reg;
+}
 
-    req["messages"] = messages;
-    req["functions"] = build_functions_for(dt);
-    req["function_call"] = { {"name", func_name_for(dt)} };
+// ---------------- Doc type classification ----------------
+// Scores each doc type by the number of distinct classify keywords present.
+static const DocTypeSpec &classify_doc(const DocTypeRegistry &reg, std::string_view text) {
+    std::vector<char> seen(reg.classify_matcher.size(), 0);
+    reg.classify_matcher.scan(text, [&](int id){ seen[id] = 1; });
+    std::vector<int> score(reg.types.size(), 0);
+    for (size_t id = 0; id < seen.size(); ++id) if (seen[id]) score[reg.classify_owner[id]]++;
 
-    long http_code = 0;
-    json resp;
-    int attempts = 0;
-    int max_attempts = 4;
-    int backoff_ms = 400;
-    while (attempts < max_attempts) {
-        limiter.wait();
-        resp = http_post_json("https://api.openai.com/v1/chat/completions", cfg.api_key, req, http_code, cfg.http_timeout);
-        if (http_code >= 500) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
-            backoff_ms *= 2;
-            attempts++;
-            continue;
+    size_t best = 0;
+    for (size_t i = 1; i < score.size(); ++i) if (score[i] > score[best]) best = i;
+    if (score.empty() || score[best] == 0) return reg.unknown;
+    return reg.types[best];
+}
+
+// ---------------- BPE tokenizer ----------------
+// Byte-level BPE in the tiktoken file format: one "<base64 token> <rank>" per line
+// (cl100k_base.tiktoken, o200k_base.tiktoken). Loaded once with --tokenizer=FILE and
+// shared read-only by all workers. Merge priority is the rank of the merged token.
+// Pre-tokenization follows the cl100k split rules; non-ASCII bytes count as letters.
+class BpeTokenizer {
+public:
+    static std::string base64_decode(std::string_view in) {
+        static const std::string chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string out;
+        unsigned val = 0;
+        int bits = -8;
+        for (char c : in) {
+            if (c == '=') break;
+            size_t d = chars.find(c);
+            if (d == std::string::npos) continue;
+            val = (val << 6) | (unsigned)d;
+            bits += 6;
+            if (bits >= 0) { out.push_back((char)((val >> bits) & 0xFF)); bits -= 8; }
         }
-        if (http_code == 429) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
-            backoff_ms = std::min(5000, backoff_ms * 2);
-            attempts++;
-            continue;
+        return out;
+    }
+
+    bool load(const std::string &path) {
+        std::ifstream f(path);
+        if (!f) return false;
+        std::string line;
+        while (std::getline(f, line)) {
+            size_t sp = line.find(' ');
+            if (sp == std::string::npos) continue;
+            ranks_[base64_decode(std::string_view(line).substr(0, sp))] = std::stoi(line.substr(sp + 1));
         }
-        break;
+        name_ = fs::path(path).stem().string();
+        return !ranks_.empty();
     }
-    if (http_code >= 400) {
-        std::cerr << "OpenAI HTTP " << http_code << ": " << resp.dump() << std::endl;
-        die("OpenAI request failed");
+
+    const std::string &name() const { return name_; }
+
+    // Number of tokens text encodes to.
+    size_t count(std::string_view text) const {
+        size_t n = 0;
+        for_each_piece(text, [&](std::string_view piece){ n += count_piece(piece); });
+        return n;
     }
 
-    // parse function_call.arguments or content, with basic repair if needed
-    try {
-        auto &choice = resp["choices"][0];
-        std::string payload;
-        if (choice.contains("message") && choice["message"].contains("function_call")) {
-            payload = choice["message"]["function_call"]["arguments"].get<std::string>();
-        } else if (choice.contains("message") && choice["message"].contains("content")) {
-            payload = choice["message"]["content"].get<std::string>();
+private:
+    static bool is_letter(unsigned char c) { return std::isalpha(c) || c >= 0x80; }
+    static bool is_digit(unsigned char c) { return c >= '0' && c <= '9'; }
+    static bool is_space(unsigned char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f'; }
+    static bool is_nl(unsigned char c) { return c == '\r' || c == '\n'; }
+
+    // Splits text the way the cl100k pattern does:
+    // 's|'t|'re|'ve|'m|'ll|'d | [^\r\n\pL\pN]?\pL+ | \pN{1,3} | ?[^\s\pL\pN]+[\r\n]* | \s*[\r\n]+ | \s+(?!\S) | \s+
+    template <class F> static void for_each_piece(std::string_view s, F &&emit) {
+        const size_t n = s.size();
+        auto at = [&](size_t k) -> unsigned char { return k < n ? (unsigned char)s[k] : 0; };
+        size_t i = 0;
+        while (i < n) {
+            size_t j = i;
+            unsigned char c = at(i);
+            if (c == '\'') {
+                unsigned char a = (unsigned char)std::tolower(at(i + 1)), b = (unsigned char)std::tolower(at(i + 2));
+                if (a == 's' || a == 't' || a == 'm' || a == 'd') j = i + 2;
+                else if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') || (a == 'l' && b == 'l')) j = i + 3;
+            }
+            if (j == i && (is_letter(c) || (!is_nl(c) && !is_digit(c) && is_letter(at(i + 1))))) {
+                j = is_letter(c) ? i : i + 1;
+                while (j < n && is_letter(at(j))) ++j;
+            }
+            if (j == i && is_digit(c)) {
+                while (j < n && j < i + 3 && is_digit(at(j))) ++j;
+            }
+            if (j == i) {
+                size_t k = (c == ' ') ? i + 1 : i;
+                size_t p = k;
+                while (p < n && !is_space(at(p)) && !is_letter(at(p)) && !is_digit(at(p))) ++p;
+                if (p > k) {
+                    while (p < n && is_nl(at(p))) ++p;
+                    j = p;
+                }
+            }
+            if (j == i && is_space(c)) {
+                size_t e = i;
+                while (e < n && is_space(at(e))) ++e;
+                size_t last_nl = std::string::npos;
+                for (size_t k = i; k < e; ++k) if (is_nl(at(k))) last_nl = k;
+                if (last_nl != std::string::npos) j = last_nl + 1;
+                else if (e == n || e - i == 1) j = e;
+                else j = e - 1;
+            }
+            if (j == i) j = i + 1;
+            emit(s.substr(i, j - i));
+            i = j;
         }
-        // try parse, with brace repair
-        try {
-            return json::parse(payload);
-        } catch (...) {
-            auto start = payload.find('{');
-            auto end = payload.rfind('}');
-            if (start != std::string::npos && end != std::string::npos && end > start) {
-                return json::parse(payload.substr(start, end - start + 1));
+    }
+
+    size_t count_piece(std::string_view piece) const {
+        if (piece.size() == 1) return 1;
+        auto whole = ranks_.find(std::string(piece));
+        if (whole != ranks_.end()) return 1;
+
+        // Results are cached per thread; OCR text repeats the same words constantly
+        thread_local std::unordered_map<std::string, uint32_t> cache;
+        thread_local const BpeTokenizer *cache_owner = nullptr;
+        if (cache_owner != this || cache.size() > (1u << 16)) { cache.clear(); cache_owner = this; }
+        auto hit = cache.find(std::string(piece));
+        if (hit != cache.end()) return hit->second;
+
+        // parts[k] = start offset of the k-th current token within piece
+        std::vector<size_t> parts(piece.size() + 1);
+        for (size_t k = 0; k <= piece.size(); ++k) parts[k] = k;
+        std::string key;
+        while (parts.size() > 2) {
+            int best_rank = std::numeric_limits<int>::max();
+            size_t best = 0;
+            for (size_t k = 0; k + 2 < parts.size(); ++k) {
+                key.assign(piece.data() + parts[k], parts[k + 2] - parts[k]);
+                auto it = ranks_.find(key);
+                if (it != ranks_.end() && it->second < best_rank) { best_rank = it->second; best = k; }
             }
-            throw;
+            if (best_rank == std::numeric_limits<int>::max()) break;
+            parts.erase(parts.begin() + (long)best + 1);
         }
-    } catch (...) {
-        std::cerr << "Raw response: " << resp.dump(2) << std::endl;
-        die("Failed to parse model output JSON");
+        uint32_t tokens = (uint32_t)(parts.size() - 1);
+        cache.emplace(std::string(piece), tokens);
+        return tokens;
     }
-    return {};
+
+    std::unordered_map<std::string, int> ranks_;
+    std::string name_;
+};
+
+// Exact count with a loaded tokenizer, otherwise the usual ~4 chars per token estimate.
+static size_t count_tokens(const Config &cfg, std::string_view text) {
+    if (cfg.tokenizer) return cfg.tokenizer->count(text);
+    return (text.size() + 3) / 4;
 }
 
-// ---------------- Merge and redact ----------------
-static json merge_local_and_model(DocType dt, const json &local_cand, json model) {
-    if (!model.contains("snippets") && local_cand.contains("important_snippets")) {
-        model["snippets"] = local_cand["important_snippets"];
+// ---------------- Per-document arena ----------------
+// Monotonic arena for one document's temporaries: page text, the line index and
+// snippet/citation lists. Nothing is freed individually; everything goes in one shot
+// when the arena is destroyed after the DocResult is built. Each worker thread keeps
+// its first block between documents, so typical documents never reach the global
+// allocator for their text. Disabled with --no-arena (the bench compares both).
+class DocArena {
+public:
+    explicit DocArena(bool enabled) {
+        if (!enabled) return;
+        thread_local std::unique_ptr<std::byte[]> block;
+        thread_local bool block_in_use = false;
+        if (!block_in_use) {
+            if (!block) block.reset(new std::byte[kInitialBlock]);
+            block_in_use = true;
+            release_block_ = &block_in_use;
+            mono_.emplace(block.get(), kInitialBlock, std::pmr::new_delete_resource());
+        } else {
+            mono_.emplace(kInitialBlock, std::pmr::new_delete_resource());
+        }
     }
-    if (local_cand.contains("name_candidate")) {
-        if (!model.contains("patient_name")) model["patient_name"] = local_cand["name_candidate"];
-        if (!model.contains("member")) model["member"] = local_cand["name_candidate"];
+    ~DocArena() {
+        mono_.reset();
+        if (release_block_) *release_block_ = false;
     }
-    if (dt == DocType::TRANSCRIPT && local_cand.contains("local_citations")) {
-        // if model has no citations, add locals
-        if (!model.contains("citations")) model["citations"] = local_cand["local_citations"];
+    DocArena(const DocArena &) = delete;
+    DocArena &operator=(const DocArena &) = delete;
+
+    std::pmr::memory_resource *resource() {
+        return mono_ ? static_cast<std::pmr::memory_resource *>(&*mono_) : std::pmr::new_delete_resource();
     }
-    return model;
-}
 
-static void redact_in_place(json &j) {
-    // simple redactions for phone, SSN, email
-    auto redact_string = [](std::string s){
-        s = std::regex_replace(s, std::regex(R"((\b\d{3}[- ]?\d{2}[- ]?\d{4}\b))"), "***-**-****");
-        s = std::regex_replace(s, std::regex(R"((\+?\d{1,2}[\s\-\.])?(?:\(?\d{3}\)?[\s\-\.])?\d{3}[\s\-\.]\d{4})"), "***-***-****");
-        s = std::regex_replace(s, std::regex(R"(([A-Za-z0-9._%+\-]+@[A-Za-z0-9.\-]+\.[A-Za-z]{2,}))"), "***@***.***");
-        return s;
-    };
-    std::function<void(json&)> walk = [&](json &node){
-        if (node.is_string()) {
-            std::string val = node.get<std::string>();
-            node = redact_string(val);
-        } else if (node.is_array()) {
-            for (auto &el : node) walk(el);
-        } else if (node.is_object()) {
-            for (auto &kv : node.items()) walk(kv.value());
-        }
-    };
-    walk(j);
-}
+private:
+    static constexpr size_t kInitialBlock = 1 << 20;
+    std::optional<std::pmr::monotonic_buffer_resource> mono_;
+    bool *release_block_ = nullptr;
+};
 
-// ---------------- Cache ----------------
-static bool cache_load(const Config &cfg, const std::string &key, json &out) {
-    if (cfg.cache_dir.empty()) return false;
-    fs::create_directories(cfg.cache_dir);
-    std::string path = (fs::path(cfg.cache_dir) / (key + ".json")).string();
-    std::ifstream f(path);
-    if (!f) return false;
-    try {
-        out = json::parse(std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>()));
-        return true;
-    } catch (...) { return false; }
-}
-static void cache_store(const Config &cfg, const std::string &key, const json &val) {
-    if (cfg.cache_dir.empty()) return;
-    fs::create_directories(cfg.cache_dir);
-    std::string path = (fs::path(cfg.cache_dir) / (key + ".json")).string();
-    std::ofstream f(path);
-    if (f) f << val.dump();
-}
+// ---------------- Transcript layout ----------------
+// Deposition and EBT transcripts use a fixed page layout: a printed page number at the
+// top, margin line numbers 1-25 down the left, one line of testimony per number.
+// TranscriptIndex parses that layout once per transcript:
+// - logical pages, split at OCR page breaks and wherever the margin numbering restarts,
+//   numbered from the printed page number ("12" or "Page 12") when there is one
+// - a page:line -> document line index over the whole transcript
+// - Q/A turns, plus colloquy such as "MR. SMITH:" or "THE WITNESS:"
+// strip_margins() then drops the margin numbers from DocText::lines. Snippets carry one
+// [page:line] anchor per turn instead of a number on every line, and citations resolve
+// with two binary searches.
+class TranscriptIndex {
+public:
+    static constexpr int kMaxLine = 30;   // 25 is standard; some reporters go to 28
 
-// ---------------- Document processing ----------------
-struct DocResult {
-    std::string input_path;
-    DocType doc_type = DocType::UNKNOWN;
-    json result_json;
-    bool ok = false;
-    std::string error;
-    int pages = 0;
-    int chars_used = 0;
-};
+    struct Line { uint32_t doc_line; uint32_t page; uint8_t line; uint8_t margin; }; // page indexes pages()
+    struct Page { uint32_t number; uint32_t first; };                                 // first indexes lines()
+    enum class Speaker : uint8_t { Question, Answer, Colloquy };
+    struct Turn { Speaker who; uint32_t first, last; };                               // lines(), inclusive
 
-static std::string concat_for_selection(const std::vector<std::string> &page_texts, size_t max_lines) {
-    std::vector<std::string> lines;
-    for (auto &t : page_texts) {
-        std::istringstream iss(t);
-        std::string line;
-        while (std::getline(iss, line)) {
-            line = trim_copy(line);
-            if (!line.empty()) lines.push_back(line);
-            if (lines.size() >= max_lines * 2) break;
+    explicit TranscriptIndex(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : lines_(mr), pages_(mr), by_number_(mr), turns_(mr), labels_(mr) {}
+    // Copy into another resource, e.g. out of a document arena that is about to go away
+    TranscriptIndex(const TranscriptIndex &o, std::pmr::memory_resource *mr)
+        : lines_(o.lines_, mr), pages_(o.pages_, mr), by_number_(o.by_number_, mr), turns_(o.turns_, mr),
+          labels_(o.labels_, mr), detected_(o.detected_) {}
+
+    // Parses the layout from a document's line and page index; returns detected().
+    // Lines are not modified.
+    bool build(const std::pmr::vector<std::string_view> &lines, const std::pmr::vector<size_t> &page_first_line) {
+        lines_.clear(); pages_.clear(); by_number_.clear(); turns_.clear(); labels_.clear();
+        size_t body = 0;
+        uint32_t next_number = 1;
+        const size_t pages = page_first_line.size();
+        for (size_t p = 0; p < pages; ++p) {
+            size_t a = page_first_line[p], e = p + 1 < pages ? page_first_line[p + 1] : lines.size();
+            PageBuilder pb{*this, next_number};
+            for (size_t li = a; li < e; ++li) {
+                std::string_view l = lines[li];
+                if (l.empty()) continue;
+                uint32_t label;
+                if (pb.last == 0 && page_label(l, label) && !continues_numbering(lines, li, e, label)) {
+                    pb.printed = label;
+                    labels_.push_back((uint32_t)li);
+                    continue;
+                }
+                int n;
+                size_t margin = margin_number(l, n);
+                if (margin && n == 1 && pb.last > 0) {
+                    // numbering restarts: next page. A label in between heads the new page
+                    // when pages carry their number at the top, else it ends this one.
+                    uint32_t carry = pb.printed ? pb.trailing : 0;
+                    if (carry) pb.trailing = 0;
+                    pb.close();
+                    pb.open();
+                    pb.printed = carry;
+                }
+                if (margin && n > pb.last && (pb.last == 0 ? n <= 4 : n - pb.last <= 4)) {
+                    lines_.push_back({(uint32_t)li, (uint32_t)pages_.size(), (uint8_t)n, (uint8_t)margin});
+                    pb.last = n;
+                    continue;
+                }
+                // "Page 12" or a bare number after the last margin line
+                if (pb.last >= 20 && page_label(l, label)) {
+                    pb.trailing = label;
+                    labels_.push_back((uint32_t)li);
+                    continue;
+                }
+                body++;
+            }
+            pb.close();
+            next_number = pb.next;
+        }
+        detected_ = lines_.size() >= 20 && lines_.size() >= 2 * body;
+        if (!detected_) return false;
+
+        for (uint32_t k = 0; k < pages_.size(); ++k) by_number_.emplace_back(pages_[k].number, k);
+        std::stable_sort(by_number_.begin(), by_number_.end(),
+                         [](const auto &x, const auto &y) { return x.first < y.first; });
+        for (uint32_t k = 0; k < lines_.size(); ++k) {
+            std::string_view text = lines[lines_[k].doc_line].substr(lines_[k].margin);
+            std::optional<Speaker> who = turn_start(trim_view(text), turns_.empty() ? std::nullopt : std::optional<Speaker>(turns_.back().who));
+            if (who) turns_.push_back({*who, k, k});
+            else if (!turns_.empty()) turns_.back().last = k;
         }
-        if (lines.size() >= max_lines * 2) break;
+        return true;
     }
-    std::string out;
-    for (auto &l : lines) {
-        if (out.size() + l.size() + 1 > 4000) break;
-        out += l; out += "\n";
+
+    // Removes the margin numbers from the lines build() parsed.
+    void strip_margins(std::pmr::vector<std::string_view> &lines) const {
+        for (const Line &l : lines_) lines[l.doc_line] = trim_view(lines[l.doc_line].substr(l.margin));
     }
-    return out;
-}
 
-static DocResult process_single_document(const fs::path &path, const Config &cfg) {
-    DocResult r;
-    r.input_path = path.string();
+    bool detected() const { return detected_; }
 
-    try {
-        std::vector<std::string> images;
-        std::vector<std::string> page_texts;
+    // Flat integer arrays, for the --batch-out state file
+    json to_json() const {
+        json l = json::array(), p = json::array(), b = json::array(), t = json::array();
+        for (auto &x : lines_) for (uint32_t v : {x.doc_line, x.page, (uint32_t)x.line, (uint32_t)x.margin}) l.push_back(v);
+        for (auto &x : pages_) for (uint32_t v : {x.number, x.first}) p.push_back(v);
+        for (auto &x : by_number_) for (uint32_t v : {x.first, x.second}) b.push_back(v);
+        for (auto &x : turns_) for (uint32_t v : {(uint32_t)x.who, x.first, x.last}) t.push_back(v);
+        return {{"detected", detected_}, {"lines", l}, {"pages", p}, {"by_number", b}, {"turns", t}, {"labels", labels_}};
+    }
+    void from_json(const json &j) {
+        auto u = [](const json &a, size_t i){ return a[i].get<uint32_t>(); };
+        const json &l = j.at("lines"), &p = j.at("pages"), &b = j.at("by_number"), &t = j.at("turns");
+        lines_.clear(); pages_.clear(); by_number_.clear(); turns_.clear(); labels_.clear();
+        for (size_t i = 0; i + 3 < l.size(); i += 4) lines_.push_back({u(l, i), u(l, i + 1), (uint8_t)u(l, i + 2), (uint8_t)u(l, i + 3)});
+        for (size_t i = 0; i + 1 < p.size(); i += 2) pages_.push_back({u(p, i), u(p, i + 1)});
+        for (size_t i = 0; i + 1 < b.size(); i += 2) by_number_.emplace_back(u(b, i), u(b, i + 1));
+        for (size_t i = 0; i + 2 < t.size(); i += 3) turns_.push_back({(Speaker)u(t, i), u(t, i + 1), u(t, i + 2)});
+        for (auto &v : j.at("labels")) labels_.push_back(v.get<uint32_t>());
+        detected_ = j.value("detected", false);
+    }
+    const std::pmr::vector<Line> &lines() const { return lines_; }
+    const std::pmr::vector<Page> &pages() const { return pages_; }
+    const std::pmr::vector<Turn> &turns() const { return turns_; }
+    const std::pmr::vector<uint32_t> &label_lines() const { return labels_; } // printed page numbers
 
-        if (is_pdf(path)) {
-            std::string tmpdir = (fs::temp_directory_path() / (path.stem().string() + "_ppm")).string();
-            images = pdf_to_images(path.string(), tmpdir);
-            if (images.empty()) die("No pages produced from " + path.string());
-        } else if (is_image(path)) {
-            images.push_back(path.string());
-        } else {
-            die("Unsupported file type: " + path.string());
+    // Indexed line at printed page:line, or null
+    const Line *find(uint32_t page, unsigned line) const {
+        auto it = std::lower_bound(by_number_.begin(), by_number_.end(), page,
+                                   [](const auto &x, uint32_t v) { return x.first < v; });
+        for (; it != by_number_.end() && it->first == page; ++it) {
+            const Page &pg = pages_[it->second];
+            const Line *b = lines_.data() + pg.first, *e = lines_.data() + page_end(it->second);
+            const Line *hit = std::lower_bound(b, e, line, [](const Line &x, unsigned v) { return x.line < v; });
+            if (hit != e && hit->line == line) return hit;
         }
+        return nullptr;
+    }
 
-        for (auto &img : images) {
-            std::string text = ocr_image_path(img, cfg);
-            if (!text.empty()) page_texts.push_back(text);
-        }
-        if (page_texts.empty()) die("OCR produced no text for " + path.string());
-        r.pages = (int)images.size();
+    // Whether lines()[k] opens a Q/A or colloquy turn
+    bool starts_turn(uint32_t k) const {
+        return std::binary_search(turns_.begin(), turns_.end(), Turn{Speaker::Question, k, k},
+                                  [](const Turn &x, const Turn &y) { return x.first < y.first; });
+    }
 
-        std::string full_concat;
-        for (auto &t : page_texts) {
-            full_concat += t;
-            if (full_concat.size() > 40000) break;
-        }
+    // Index into turns() of the turn containing lines()[k], or -1
+    long turn_of(uint32_t k) const {
+        auto it = std::upper_bound(turns_.begin(), turns_.end(), k, [](uint32_t v, const Turn &t) { return v < t.first; });
+        if (it == turns_.begin() || (it - 1)->last < k) return -1;
+        return (long)(it - turns_.begin()) - 1;
+    }
 
-        DocType dt = classify_doc(full_concat);
-        r.doc_type = dt;
+    // Index into lines() of doc line li, or -1 when it is not a numbered line
+    long locate(size_t li) const {
+        auto it = std::lower_bound(lines_.begin(), lines_.end(), li,
+                                   [](const Line &x, size_t v) { return x.doc_line < v; });
+        return it != lines_.end() && it->doc_line == li ? (long)(it - lines_.begin()) : -1;
+    }
 
-        std::string selection = concat_for_selection(page_texts, cfg.max_snippet_lines);
-        json local = local_extract_by_type(selection.empty() ? page_texts.front() : selection, dt, cfg);
+    uint32_t page_number(const Line &l) const { return pages_[l.page].number; }
 
-        // Build snippet key for cache
-        std::string cache_material = std::string(doc_type_str(dt)) + "\n" + local.dump();
-        uint64_t h = fnv1a_64(cache_material);
-        std::string key = std::to_string(h);
+    // "12:4", or "12:4-9" / "12:24-13:3" for a range of lines()
+    std::string cite(uint32_t first, uint32_t last) const {
+        const Line &a = lines_[first], &b = lines_[last];
+        std::string s = std::to_string(page_number(a)) + ":" + std::to_string(a.line);
+        if (last == first) return s;
+        s += '-';
+        if (b.page != a.page) s += std::to_string(page_number(b)) + ":";
+        return s + std::to_string(b.line);
+    }
 
-        json model;
-        if (!cache_load(cfg, key, model)) {
-            model = call_openai_compact(cfg, dt, local, local.value("important_snippets",""));
-            cache_store(cfg, key, model);
+private:
+    struct PageBuilder {
+        TranscriptIndex &ix;
+        uint32_t next;          // number the page gets without a printed label
+        uint32_t first = (uint32_t)ix.lines_.size();
+        uint32_t printed = 0;   // label above line 1
+        uint32_t trailing = 0;  // label below the last line
+        int last = 0;
+        void open() { first = (uint32_t)ix.lines_.size(); printed = trailing = 0; last = 0; }
+        void close() {
+            if (ix.lines_.size() == first) return;
+            uint32_t number = printed ? printed : trailing ? trailing : next;
+            ix.pages_.push_back({number, first});
+            next = number + 1;
         }
+    };
 
-        json merged = merge_local_and_model(dt, local, model);
-        merged["doc_type"] = doc_type_str(dt);
-        merged["source"] = path.filename().string();
-        merged["page_count"] = r.pages;
-        if (cfg.audit_raw_ocr) {
-            // keep only the first 4000 chars to avoid giant outputs
-            std::string raw = full_concat.substr(0, 4000);
-            merged["raw_ocr_preview"] = raw;
+    size_t page_end(uint32_t k) const { return k + 1 < pages_.size() ? pages_[k + 1].first : lines_.size(); }
+
+    static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+    // Length of a leading 1-2 digit margin number plus the space after it, or 0
+    static size_t margin_number(std::string_view l, int &n) {
+        size_t d = 0;
+        while (d < l.size() && d < 3 && is_digit(l[d])) ++d;
+        if (d == 0 || d > 2 || (d < l.size() && l[d] != ' ')) return 0;
+        n = std::atoi(std::string(l.substr(0, d)).c_str());
+        if (n < 1 || n > kMaxLine) return 0;
+        return d < l.size() ? d + 1 : d;
+    }
+
+    // "12", "Page 12" (any case)
+    static bool page_label(std::string_view l, uint32_t &number) {
+        if (l.size() > 5 && (l[0] | 0x20) == 'p' && to_lower(std::string(l.substr(0, 5))) == "page ") l.remove_prefix(5);
+        if (l.empty() || l.size() > 5) return false;
+        for (char c : l) if (!is_digit(c)) return false;
+        number = (uint32_t)std::stoul(std::string(l));
+        return number > 0;
+    }
+
+    // A bare "7" before line 1 is a blank margin line when the next one is numbered 8
+    static bool continues_numbering(const std::pmr::vector<std::string_view> &lines, size_t li, size_t end, uint32_t n) {
+        if (n > kMaxLine || (lines[li][0] | 0x20) == 'p') return false;
+        for (size_t k = li + 1; k < end; ++k) {
+            if (lines[k].empty()) continue;
+            int m;
+            return margin_number(lines[k], m) && (uint32_t)m == n + 1;
+        }
+        return false;
+    }
+
+    // "Q. ", "Q: ", "A. ", "A: " always; a bare "Q " or "A " only where the turn
+    // alternates, since "A car ..." is also ordinary testimony. Uppercase labels
+    // ending in ':' ("MR. SMITH:", "THE WITNESS:") are colloquy.
+    static std::optional<Speaker> turn_start(std::string_view t, std::optional<Speaker> prev) {
+        if (t.size() >= 2 && (t[0] == 'Q' || t[0] == 'A')) {
+            Speaker who = t[0] == 'Q' ? Speaker::Question : Speaker::Answer;
+            if (t[1] == '.' || t[1] == ':') return who;
+            if (t[1] == ' ' && (!prev || *prev != who)) return who;
+        }
+        size_t colon = t.find(':');
+        if (colon == std::string_view::npos || colon < 3 || colon > 40) return std::nullopt;
+        size_t letters = 0;
+        for (size_t k = 0; k < colon; ++k) {
+            char c = t[k];
+            if (c >= 'A' && c <= 'Z') letters++;
+            else if (c != ' ' && c != '.' && c != '\'' && c != '-') return std::nullopt;
+        }
+        if (letters >= 3) return Speaker::Colloquy;
+        return std::nullopt;
+    }
+
+    std::pmr::vector<Line> lines_;
+    std::pmr::vector<Page> pages_;
+    std::pmr::vector<std::pair<uint32_t, uint32_t>> by_number_; // (printed number, page index)
+    std::pmr::vector<Turn> turns_;
+    std::pmr::vector<uint32_t> labels_;
+    bool detected_ = false;
+};
+
+// ---------------- Document text model ----------------
+// One buffer per document with a page and line index. Pages are normalized into buf
+// once after OCR (whitespace collapsed, line-wrapped words rejoined; see
+// text_normalize.hpp); lines are trimmed string_views into buf. Classification, snippet selection,
+// local extraction and citations all read the same index instead of re-splitting
+// copies. Views point into buf, so the model is neither copyable nor movable.
+struct DocText {
+    std::pmr::string buf;
+    std::pmr::vector<std::string_view> lines;   // trimmed, empty lines kept so indices map to layout
+    std::pmr::vector<size_t> page_offset;       // byte offset of each page in buf
+    std::pmr::vector<size_t> page_first_line;   // index into lines of each page's first line
+    std::pmr::vector<char> boilerplate;         // per line, set by mark_boilerplate()
+    std::optional<NormalizeOptions> normalize = NormalizeOptions{}; // applied by add_page(); nullopt copies as is
+    std::optional<TranscriptIndex> transcript;  // page:line layout, set by analyze_document_text() for transcripts
+
+    explicit DocText(std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+        : buf(mr), lines(mr), page_offset(mr), page_first_line(mr), boilerplate(mr) {}
+    DocText(const DocText &) = delete;
+    DocText &operator=(const DocText &) = delete;
+
+    // Copies all pages into buf with a single allocation and builds the index.
+    template <class Pages> void assign_pages(const Pages &pages) {
+        size_t total = 0;
+        for (auto &t : pages) total += t.size();
+        buf.clear();
+        page_offset.clear();
+        buf.reserve(total + pages.size());
+        page_offset.reserve(pages.size());
+        for (auto &t : pages) add_page(t);
+        finish();
+    }
+
+    void add_page(std::string_view text) {
+        page_offset.push_back(buf.size());
+        if (normalize) {
+            size_t at = buf.size();
+            buf.resize(at + text.size());
+            buf.resize(at + normalize_text(text, &buf[at], *normalize));
+        } else {
+            buf.append(text.data(), text.size());
+        }
+        if (buf.empty() || buf.back() != '\n') buf.push_back('\n');
+    }
+
+    // Builds the line index; call once after the last add_page().
+    void finish() {
+        lines.clear();
+        page_first_line.clear();
+        lines.reserve(buf.size() / 32 + 1);
+        page_first_line.reserve(page_offset.size());
+        const char *base = buf.data(), *end = base + buf.size();
+        size_t page = 0;
+        for (const char *p = base; p < end;) {
+            while (page < page_offset.size() && base + page_offset[page] <= p) { page_first_line.push_back(lines.size()); ++page; }
+            const char *nl = (const char *)std::memchr(p, '\n', (size_t)(end - p));
+            if (!nl) nl = end;
+            lines.push_back(trim_view(std::string_view(p, (size_t)(nl - p))));
+            p = nl + 1;
+        }
+        while (page_first_line.size() < page_offset.size()) page_first_line.push_back(lines.size());
+        boilerplate.assign(lines.size(), 0);
+        transcript.reset();
+    }
+
+    // Non-empty and not page boilerplate: eligible for snippets and previews
+    bool usable(size_t li) const { return !lines[li].empty() && !boilerplate[li]; }
+
+    size_t pages() const { return page_offset.size(); }
+
+    // 0-based page containing line li
+    size_t page_of_line(size_t li) const {
+        auto it = std::upper_bound(page_first_line.begin(), page_first_line.end(), li);
+        return it == page_first_line.begin() ? 0 : (size_t)(it - page_first_line.begin()) - 1;
+    }
+
+    // Whole pages from the start until at least max_chars are covered
+    std::string_view head_pages(size_t max_chars) const {
+        for (size_t p = 1; p < page_offset.size(); ++p)
+            if (page_offset[p] > max_chars) return std::string_view(buf).substr(0, page_offset[p]);
+        return buf;
+    }
+
+    // Index of the line a view from lines points at
+    size_t line_of(std::string_view l) const {
+        auto it = std::lower_bound(lines.begin(), lines.end(), l.data(),
+                                   [](std::string_view x, const char *p) { return x.data() < p; });
+        return (size_t)(it - lines.begin());
+    }
+
+    // Contiguous text spanning lines [begin, end)
+    std::string_view span(size_t begin, size_t end) const {
+        if (begin >= end) return {};
+        const char *a = lines[begin].data(), *b = lines[end - 1].data() + lines[end - 1].size();
+        return std::string_view(a, (size_t)(b - a));
+    }
+};
+
+// Range of line indices in a DocText
+struct LineRange { size_t begin = 0, end = 0; };
+
+// ---------------- Boilerplate suppression ----------------
+// Records repeat the same header and footer on every page (facility, patient, MRN,
+// "Page x of y"). The first and last few non-empty lines of each page are normalized
+// (ASCII lowercased, digit runs folded to '#', whitespace collapsed) and hashed with
+// their band, top or bottom. A key seen on at least half the pages (and 3 or more)
+// marks those lines as boilerplate, which snippet selection and the raw OCR preview
+// skip.
+struct BoilerplateStats {
+    size_t lines = 0;
+    size_t chars = 0;
+    size_t tokens = 0;
+};
+
+static uint64_t boilerplate_key(std::string_view line, bool bottom) {
+    uint64_t h = 1469598103934665603ULL;
+    auto mix = [&](unsigned char c){ h ^= c; h *= 1099511628211ULL; };
+    mix(bottom ? 'B' : 'T');
+    bool in_digits = false, in_space = false;
+    for (unsigned char c : line) {
+        if (c >= '0' && c <= '9') { if (!in_digits) mix('#'); in_digits = true; in_space = false; continue; }
+        in_digits = false;
+        if (c == ' ' || c == '\t' || c == '\r') { if (!in_space) mix(' '); in_space = true; continue; }
+        in_space = false;
+        mix((unsigned char)std::tolower(c));
+    }
+    return h;
+}
+
+static BoilerplateStats mark_boilerplate(DocText &doc, const Config &cfg) {
+    BoilerplateStats st;
+    const size_t pages = doc.pages(), band = 4;
+    if (pages < 3) return st;
+    const size_t min_pages = std::max<size_t>(3, (pages + 1) / 2);
+    std::pmr::memory_resource *mr = doc.buf.get_allocator().resource();
+
+    // Candidate (line, key) pairs per page, and how many pages each key occurs on
+    struct Cand { size_t line; uint64_t key; };
+    std::pmr::vector<Cand> cands(mr);
+    std::pmr::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> seen(mr);  // key -> (pages, last page + 1)
+    for (size_t p = 0; p < pages; ++p) {
+        size_t a = doc.page_first_line[p], e = p + 1 < pages ? doc.page_first_line[p + 1] : doc.lines.size();
+        auto add = [&](size_t li, bool bottom) {
+            if (doc.lines[li].size() < 3) return;
+            uint64_t k = boilerplate_key(doc.lines[li], bottom);
+            cands.push_back({li, k});
+            auto &s = seen[k];
+            if (s.second != p + 1) { s.first++; s.second = (uint32_t)(p + 1); }
+        };
+        size_t n = 0;
+        for (size_t li = a; li < e && n < band; ++li) if (!doc.lines[li].empty()) { add(li, false); ++n; }
+        n = 0;
+        for (size_t li = e; li > a && n < band; --li) if (!doc.lines[li - 1].empty()) { add(li - 1, true); ++n; }
+    }
+    for (auto &c : cands) {
+        if (doc.boilerplate[c.line] || seen[c.key].first < min_pages) continue;
+        doc.boilerplate[c.line] = 1;
+        st.lines++;
+        st.chars += doc.lines[c.line].size() + 1;
+        st.tokens += count_tokens(cfg, doc.lines[c.line]) + 1;
+    }
+    return st;
+}
+
+// Leading text of the document without boilerplate lines, for --audit output
+static std::string preview_text(const DocText &doc, size_t max_chars) {
+    std::string out;
+    for (size_t i = 0; i < doc.lines.size() && out.size() < max_chars; ++i) {
+        if (doc.boilerplate[i]) continue;
+        out.append(doc.lines[i].data(), doc.lines[i].size());
+        out.push_back('\n');
+    }
+    if (out.size() > max_chars) out.resize(max_chars);
+    return out;
+}
+
+// ---------------- Snippet extraction ----------------
+static std::string join_lines_trunc(const std::pmr::vector<std::string_view> &v, size_t max_chars) {
+    std::string s;
+    for (auto &l : v) {
+        if (s.size() + l.size() + 1 > max_chars) break;
+        s += l; s += "\n";
+    }
+    if (s.size() > max_chars) s.resize(max_chars);
+    return s;
+}
+
+// ---------------- Relevance-ranked snippet windows ----------------
+// Every line in range is scanned once with the doc type's snippet matcher. Each hit
+// line anchors a candidate window (2 lines before, 2 after) scored with BM25 against
+// the doc type's snippet keys, with the candidate windows as the corpus. Windows are
+// taken greedily by score and re-scored lazily so keys that are already covered count
+// for less. Overlapping picks share lines, so nothing is sent twice, and the kept
+// lines come back in document order.
+static void select_ranked_windows(std::pmr::vector<std::string_view> &keep, const DocText &doc, LineRange range,
+                                  const KeywordMatcher &keys, const Config &cfg) {
+    const double k1 = 1.2, b = 0.75, covered_weight = 0.35;
+    const size_t T = keys.size();
+    if (!T || range.begin >= range.end) return;
+    std::pmr::memory_resource *mr = keep.get_allocator().resource();
+    const auto &lines = doc.lines;
+
+    // Term hits per line, CSR layout over the hit lines only
+    std::pmr::vector<uint32_t> hit_lines(mr), hit_begin(mr), hit_terms(mr);
+    for (size_t i = range.begin; i < range.end; ++i) {
+        size_t before = hit_terms.size();
+        if (doc.boilerplate[i]) continue;
+        keys.scan(lines[i], [&](int id){ hit_terms.push_back((uint32_t)id); });
+        if (hit_terms.size() > before) { hit_lines.push_back((uint32_t)i); hit_begin.push_back((uint32_t)before); }
+    }
+    if (hit_lines.empty()) return;
+    hit_begin.push_back((uint32_t)hit_terms.size());
+
+    // Candidate windows: term frequencies (CSR again), length in chars, document frequency
+    struct Window { uint32_t anchor, begin, end, tf_begin, tf_end; double len; };
+    std::pmr::vector<Window> wins(mr);
+    std::pmr::vector<std::pair<uint32_t, uint32_t>> tfs(mr);  // (term, tf)
+    std::pmr::vector<uint32_t> cnt(T, 0, mr), df(T, 0, mr);
+    std::pmr::vector<uint32_t> touched(mr);
+    wins.reserve(hit_lines.size());
+    double total_len = 0;
+    size_t h_lo = 0;
+    for (size_t h = 0; h < hit_lines.size(); ++h) {
+        uint32_t i = hit_lines[h];
+        Window w{i, (uint32_t)(i >= range.begin + 2 ? i - 2 : range.begin),
+                 (uint32_t)std::min(range.end, (size_t)i + 3), (uint32_t)tfs.size(), 0, 0.0};
+        while (hit_lines[h_lo] < w.begin) ++h_lo;
+        for (size_t g = h_lo; g < hit_lines.size() && hit_lines[g] < w.end; ++g)
+            for (uint32_t k = hit_begin[g]; k < hit_begin[g + 1]; ++k)
+                if (cnt[hit_terms[k]]++ == 0) touched.push_back(hit_terms[k]);
+        for (uint32_t t : touched) { tfs.emplace_back(t, cnt[t]); df[t]++; cnt[t] = 0; }
+        touched.clear();
+        w.tf_end = (uint32_t)tfs.size();
+        for (uint32_t j = w.begin; j < w.end; ++j) if (doc.usable(j)) w.len += (double)lines[j].size() + 1;
+        total_len += w.len;
+        wins.push_back(w);
+    }
+    const double N = (double)wins.size(), avg_len = std::max(1.0, total_len / N);
+    std::pmr::vector<double> idf(T, 0.0, mr);
+    for (size_t t = 0; t < T; ++t) idf[t] = std::log(1.0 + (N - df[t] + 0.5) / (df[t] + 0.5));
+
+    std::pmr::vector<char> covered(T, 0, mr);
+    auto score = [&](const Window &w) {
+        double s = 0, norm = k1 * (1 - b + b * w.len / avg_len);
+        for (uint32_t k = w.tf_begin; k < w.tf_end; ++k) {
+            auto [t, tf] = tfs[k];
+            s += idf[t] * (tf * (k1 + 1)) / (tf + norm) * (covered[t] ? covered_weight : 1.0);
+        }
+        return s;
+    };
+
+    // Budget: --max-lines plus --max-tokens (or --max-chars)
+    auto line_cost = [&](uint32_t j) -> size_t {
+        return cfg.max_tokens ? count_tokens(cfg, lines[j]) + 1 : lines[j].size() + 1;
+    };
+    const size_t max_cost = cfg.max_tokens ? cfg.max_tokens : cfg.max_chars_per_snippet;
+    size_t used_lines = 0, used_cost = 0;
+    std::pmr::vector<char> picked(range.end - range.begin, 0, mr);
+    auto is_picked = [&](uint32_t j) -> char & { return picked[j - range.begin]; };
+
+    auto try_take = [&](uint32_t a, uint32_t e) {
+        size_t add_lines = 0, add_cost = 0;
+        for (uint32_t j = a; j < e; ++j) {
+            if (!doc.usable(j) || is_picked(j)) continue;
+            add_lines++;
+            add_cost += line_cost(j);
+        }
+        if (add_lines == 0) return true;
+        if (used_lines + add_lines > cfg.max_snippet_lines || used_cost + add_cost > max_cost) return false;
+        for (uint32_t j = a; j < e; ++j) if (doc.usable(j)) is_picked(j) = 1;
+        used_lines += add_lines;
+        used_cost += add_cost;
+        return true;
+    };
+
+    using Entry = std::pair<double, uint32_t>;  // (score, window index); ties favour earlier windows
+    auto cmp = [](const Entry &x, const Entry &y) { return x.first < y.first || (x.first == y.first && x.second > y.second); };
+    std::priority_queue<Entry, std::pmr::vector<Entry>, decltype(cmp)> pq(cmp, std::pmr::vector<Entry>(mr));
+    for (uint32_t w = 0; w < wins.size(); ++w) pq.emplace(score(wins[w]), w);
+    while (!pq.empty() && used_lines < cfg.max_snippet_lines) {
+        auto [s, wi] = pq.top();
+        pq.pop();
+        const Window &w = wins[wi];
+        double now = score(w);
+        if (now < s && !pq.empty() && now < pq.top().first) { pq.emplace(now, wi); continue; }
+        if (try_take(w.begin, w.end) || try_take(w.anchor, w.anchor + 1))
+            for (uint32_t k = w.tf_begin; k < w.tf_end; ++k) covered[tfs[k].first] = 1;
+    }
+
+    for (uint32_t j = (uint32_t)range.begin; j < range.end; ++j) if (is_picked(j)) keep.push_back(lines[j]);
+}
+
+// Transcript lines have no margin numbers left; instead each turn, and each jump in the
+// kept lines, starts with its [page:line] anchor so the model can cite exactly.
+static std::string join_transcript_budget(const std::pmr::vector<std::string_view> &v, const DocText &doc, const Config &cfg) {
+    const TranscriptIndex &ix = *doc.transcript;
+    const size_t budget = cfg.max_tokens ? cfg.max_tokens : cfg.max_chars_per_snippet;
+    std::string s, line;
+    size_t used = 0;
+    long prev = -2;
+    for (auto &l : v) {
+        long k = ix.locate(doc.line_of(l));
+        line.clear();
+        if (k >= 0 && (k != prev + 1 || ix.starts_turn((uint32_t)k))) line = "[" + ix.cite((uint32_t)k, (uint32_t)k) + "] ";
+        line.append(l.data(), l.size());
+        size_t cost = cfg.max_tokens ? count_tokens(cfg, line) + 1 : line.size() + 1;
+        if (used + cost > budget) break;
+        used += cost;
+        s += line; s += "\n";
+        if (k >= 0) prev = k;
+    }
+    return s;
+}
+
+// Joins kept lines under the token budget when --max-tokens is set, else by characters.
+// Transcripts with a parsed layout get [page:line] anchors.
+static std::string join_lines_budget(const std::pmr::vector<std::string_view> &v, const DocText &doc, const Config &cfg) {
+    if (doc.transcript) return join_transcript_budget(v, doc, cfg);
+    if (!cfg.max_tokens) return join_lines_trunc(v, cfg.max_chars_per_snippet);
+    std::string s;
+    size_t tokens = 0;
+    for (auto &l : v) {
+        size_t t = count_tokens(cfg, l) + 1;  // + newline
+        if (tokens + t > cfg.max_tokens) break;
+        tokens += t;
+        s += l; s += "\n";
+    }
+    return s;
+}
+
+
+// ---------------- Entity scanner ----------------
+// Hand-written single pass that finds the entities the local stage and redaction care
+// about and reports them as typed spans in text order:
+// - names after a "Patient:" or "Name:" label
+// - dates (2024-03-15, 3/15/24)
+// - phone numbers, SSNs and emails
+// - page and line references ("page 12", "lines 4-9")
+// - MRNs and claim numbers after their labels
+// Labels match case-insensitively on word boundaries. It replaces the std::regex
+// searches, which dominated the local stage.
+enum class Entity : uint8_t { Name, Date, Phone, Ssn, Email, PageRef, LineRef, Mrn, Claim, Count };
+
+constexpr uint32_t entity_bit(Entity e) { return 1u << (unsigned)e; }
+constexpr uint32_t kAllEntities = (1u << (unsigned)Entity::Count) - 1;
+
+static const char *entity_name(Entity e) {
+    static const char *const names[] = {"name", "date", "phone", "ssn", "email", "page_ref", "line_ref", "mrn", "claim"};
+    return names[(unsigned)e];
+}
+
+struct EntitySpan {
+    Entity kind;
+    size_t begin, end;             // whole match, label included
+    size_t value_begin, value_end; // the name, number or id itself
+};
+
+class EntityScanner {
+public:
+    // Calls on_span(const EntitySpan &) for every entity of the kinds in the mask.
+    template <class F> static void scan(std::string_view s, uint32_t kinds, F &&on_span) {
+        const size_t n = s.size();
+        size_t i = 0;
+        size_t no_email_until = 0; // end of a local-part run already known to have no '@'
+        while (i < n) {
+            unsigned char c = (unsigned char)s[i];
+            if (i > 0 && is_word((unsigned char)s[i - 1])) { ++i; continue; }
+
+            if ((kinds & entity_bit(Entity::Email)) && i >= no_email_until && is_email_local(c)) {
+                size_t j = i;
+                while (j < n && is_email_local((unsigned char)s[j])) ++j;
+                size_t e = j < n && s[j] == '@' ? email_domain_end(s, j + 1) : 0;
+                if (e) { on_span(EntitySpan{Entity::Email, i, e, i, e}); i = e; continue; }
+                no_email_until = j;
+            }
+
+            EntitySpan sp{};
+            if (is_alpha(c)) {
+                if (match_label(s, i, kinds, sp)) { on_span(sp); i = sp.end; continue; }
+                while (i < n && is_word((unsigned char)s[i])) ++i;
+                continue;
+            }
+            if (is_digit(c) || c == '+' || c == '(') {
+                if (match_number(s, i, kinds, sp)) { on_span(sp); i = sp.end; continue; }
+                while (i < n && is_digit((unsigned char)s[i])) ++i;
+                if (i < n && !is_digit((unsigned char)s[i]) && !is_word((unsigned char)s[i])) ++i;
+                continue;
+            }
+            ++i;
+        }
+    }
+
+private:
+    static bool is_digit(unsigned char c) { return c >= '0' && c <= '9'; }
+    static bool is_alpha(unsigned char c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; }
+    static bool is_word(unsigned char c) { return is_digit(c) || is_alpha(c) || c == '_'; }
+    static bool is_hws(unsigned char c) { return c == ' ' || c == '\t'; }
+    static bool is_email_local(unsigned char c) {
+        return is_digit(c) || is_alpha(c) || c == '.' || c == '_' || c == '%' || c == '+' || c == '-';
+    }
+
+    static size_t digits(std::string_view s, size_t i, size_t max) {
+        size_t k = 0;
+        while (i + k < s.size() && k < max && is_digit((unsigned char)s[i + k])) ++k;
+        return k;
+    }
+    // Exactly lo..hi digits at i, not followed by another digit; returns the count or 0
+    static size_t digit_run(std::string_view s, size_t i, size_t lo, size_t hi) {
+        size_t k = digits(s, i, hi + 1);
+        return k >= lo && k <= hi ? k : 0;
+    }
+    static bool word_end(std::string_view s, size_t i) { return i >= s.size() || !is_word((unsigned char)s[i]); }
+    static size_t skip_ws(std::string_view s, size_t i) {
+        while (i < s.size() && (is_hws((unsigned char)s[i]) || s[i] == '\n' || s[i] == '\r')) ++i;
+        return i;
+    }
+
+    // Case-insensitive whole word at i; returns the end or 0
+    static size_t word_at(std::string_view s, size_t i, std::string_view w) {
+        if (i + w.size() > s.size()) return 0;
+        for (size_t k = 0; k < w.size(); ++k)
+            if (std::tolower((unsigned char)s[i + k]) != w[k]) return 0;
+        return word_end(s, i + w.size()) ? i + w.size() : 0;
+    }
+
+    static size_t email_domain_end(std::string_view s, size_t i) {
+        size_t j = i;
+        while (j < s.size() && (is_digit((unsigned char)s[j]) || is_alpha((unsigned char)s[j]) || s[j] == '.' || s[j] == '-')) ++j;
+        while (j > i && (s[j - 1] == '.' || s[j - 1] == '-')) --j;
+        size_t dot = j > i ? s.rfind('.', j - 1) : std::string_view::npos;
+        if (dot == std::string_view::npos || dot <= i || j - dot - 1 < 2) return 0;
+        for (size_t k = dot + 1; k < j; ++k) if (!is_alpha((unsigned char)s[k])) return 0;
+        return j;
+    }
+
+    // Labeled id (MRN, claim number): optional "number/no/#", optional ':' '#' '.', then an
+    // alphanumeric id with at least one digit and four characters.
+    static bool labeled_id(std::string_view s, size_t i, size_t label_begin, Entity kind, EntitySpan &sp) {
+        size_t j = skip_ws(s, i);
+        for (std::string_view w : {"number", "num", "no", "id"}) if (size_t e = word_at(s, j, w)) { j = skip_ws(s, e); break; }
+        while (j < s.size() && (s[j] == ':' || s[j] == '#' || s[j] == '.')) ++j;
+        j = skip_ws(s, j);
+        size_t v = j;
+        bool digit = false;
+        while (j < s.size() && (is_word((unsigned char)s[j]) || s[j] == '-')) digit |= is_digit((unsigned char)s[j++]);
+        while (j > v && s[j - 1] == '-') --j;
+        if (!digit || j - v < 4) return false;
+        sp = {kind, label_begin, j, v, j};
+        return true;
+    }
+
+    static bool match_label(std::string_view s, size_t i, uint32_t kinds, EntitySpan &sp) {
+        unsigned char c = (unsigned char)std::tolower((unsigned char)s[i]);
+        size_t e;
+        if ((kinds & entity_bit(Entity::Name)) && (c == 'p' || c == 'n') &&
+            ((e = word_at(s, i, "patient")) || (e = word_at(s, i, "name")))) {
+            size_t j = e;
+            while (j < s.size() && is_hws((unsigned char)s[j])) ++j;
+            if (j < s.size() && (s[j] == ':' || s[j] == '-')) {
+                j++;
+                while (j < s.size() && is_hws((unsigned char)s[j])) ++j;
+                size_t v = j;
+                while (j < s.size() && j - v < 90 &&
+                       (is_alpha((unsigned char)s[j]) || s[j] == ' ' || s[j] == ',' || s[j] == '.' || s[j] == '-' || s[j] == '\'')) ++j;
+                size_t ve = j;
+                // "DOE, JANE MRN: 123": the last word belongs to the next label
+                if (j < s.size() && s[j] == ':') {
+                    while (ve > v && s[ve - 1] != ' ') --ve;
+                }
+                while (ve > v && (s[ve - 1] == ' ' || s[ve - 1] == ',' || s[ve - 1] == '.' || s[ve - 1] == '-')) --ve;
+                if (ve - v >= 3) { sp = {Entity::Name, i, ve, v, ve}; return true; }
+            }
+        }
+        if ((kinds & entity_bit(Entity::PageRef)) && c == 'p' && (e = word_at(s, i, "page"))) {
+            size_t j = e;
+            while (j < s.size() && is_hws((unsigned char)s[j])) ++j;
+            size_t k = j > e ? digits(s, j, 6) : 0;
+            if (k && word_end(s, j + k)) { sp = {Entity::PageRef, i, j + k, j, j + k}; return true; }
+        }
+        if ((kinds & entity_bit(Entity::LineRef)) && c == 'l' && ((e = word_at(s, i, "lines")) || (e = word_at(s, i, "line")))) {
+            size_t j = e;
+            while (j < s.size() && is_hws((unsigned char)s[j])) ++j;
+            size_t k = j > e ? digits(s, j, 6) : 0;
+            if (k) {
+                size_t v = j, end = j + k;
+                size_t r = end;
+                while (r < s.size() && is_hws((unsigned char)s[r])) ++r;
+                if (r < s.size() && s[r] == '-') {
+                    ++r;
+                    while (r < s.size() && is_hws((unsigned char)s[r])) ++r;
+                    if (size_t k2 = digits(s, r, 6)) end = r + k2;
+                }
+                sp = {Entity::LineRef, i, end, v, end};
+                return true;
+            }
+        }
+        if ((kinds & entity_bit(Entity::Mrn)) && c == 'm') {
+            if ((e = word_at(s, i, "mrn")) && labeled_id(s, e, i, Entity::Mrn, sp)) return true;
+            if ((e = word_at(s, i, "medical"))) {
+                size_t r = word_at(s, skip_ws(s, e), "record");
+                if (r && labeled_id(s, r, i, Entity::Mrn, sp)) return true;
+            }
+        }
+        if ((kinds & entity_bit(Entity::Claim)) && c == 'c' && (e = word_at(s, i, "claim")) &&
+            labeled_id(s, e, i, Entity::Claim, sp)) return true;
+        return false;
+    }
+
+    // Phone tail: [area sep] ddd sep dddd, area being ddd or (ddd)
+    static size_t phone_core(std::string_view s, size_t i) {
+        auto sep = [&](size_t k) { return k < s.size() && (is_hws((unsigned char)s[k]) || s[k] == '-' || s[k] == '.'); };
+        auto local = [&](size_t k) -> size_t {
+            if (digit_run(s, k, 3, 3) != 3 || !sep(k + 3) || digit_run(s, k + 4, 4, 4) != 4) return 0;
+            return k + 8;
+        };
+        size_t k = i;
+        bool paren = k < s.size() && s[k] == '(';
+        if (paren) ++k;
+        if (digit_run(s, k, 3, 3) == 3) {
+            size_t a = k + 3;
+            if (paren && a < s.size() && s[a] == ')') {
+                ++a;
+                if (sep(a)) ++a;
+                if (size_t e = local(a)) return e;
+            } else if (!paren && sep(a)) {
+                if (size_t e = local(a + 1)) return e;
+            }
+        }
+        return paren ? 0 : local(i);
+    }
+
+    static bool match_number(std::string_view s, size_t i, uint32_t kinds, EntitySpan &sp) {
+        if (kinds & entity_bit(Entity::Date)) {
+            // 2024-03-15
+            if (digit_run(s, i, 4, 4) && i + 10 <= s.size() && s[i + 4] == '-' && digit_run(s, i + 5, 2, 2) &&
+                s[i + 7] == '-' && digit_run(s, i + 8, 2, 2) && word_end(s, i + 10)) {
+                sp = {Entity::Date, i, i + 10, i, i + 10};
+                return true;
+            }
+            // 3/15/24, 03-15-2024
+            if (size_t a = digit_run(s, i, 1, 2)) {
+                size_t j = i + a;
+                if (j < s.size() && (s[j] == '/' || s[j] == '-')) {
+                    if (size_t b = digit_run(s, j + 1, 1, 2)) {
+                        size_t k = j + 1 + b;
+                        if (k < s.size() && (s[k] == '/' || s[k] == '-')) {
+                            size_t y = digit_run(s, k + 1, 2, 4);
+                            if (y && word_end(s, k + 1 + y)) { sp = {Entity::Date, i, k + 1 + y, i, k + 1 + y}; return true; }
+                        }
+                    }
+                }
+            }
+        }
+        // 123-45-6789, 123 45 6789, 123456789
+        if ((kinds & entity_bit(Entity::Ssn)) && digits(s, i, 3) == 3) {
+            size_t j = i + 3;
+            if (j < s.size() && (s[j] == '-' || s[j] == ' ')) ++j;
+            if (digits(s, j, 2) == 2) {
+                j += 2;
+                if (j < s.size() && (s[j] == '-' || s[j] == ' ')) ++j;
+                if (digits(s, j, 4) == 4 && word_end(s, j + 4)) { sp = {Entity::Ssn, i, j + 4, i, j + 4}; return true; }
+            }
+        }
+        if (kinds & entity_bit(Entity::Phone)) {
+            // Optional country code: [+]d{1,2} sep
+            size_t k = i + (s[i] == '+' ? 1 : 0);
+            if (size_t cc = digit_run(s, k, 1, 2)) {
+                size_t a = k + cc;
+                if (a < s.size() && (is_hws((unsigned char)s[a]) || s[a] == '-' || s[a] == '.')) {
+                    if (size_t e = phone_core(s, a + 1)) { sp = {Entity::Phone, i, e, i, e}; return true; }
+                }
+            }
+            if (s[i] != '+') {
+                if (size_t e = phone_core(s, i)) { sp = {Entity::Phone, i, e, i, e}; return true; }
+            }
+        }
+        return false;
+    }
+};
+
+// First entity of each wanted kind, as strings (value part)
+static json local_extract_generic(std::string_view text) {
+    json j;
+    const char *keys[(int)Entity::Count] = {};
+    keys[(int)Entity::Name] = "name_candidate";
+    keys[(int)Entity::Date] = "date_candidate";
+    keys[(int)Entity::Phone] = "phone_candidate";
+    uint32_t want = entity_bit(Entity::Name) | entity_bit(Entity::Date) | entity_bit(Entity::Phone);
+    EntityScanner::scan(text, want, [&](const EntitySpan &sp) {
+        uint32_t bit = entity_bit(sp.kind);
+        if (!(want & bit)) return;
+        j[keys[(int)sp.kind]] = std::string(text.substr(sp.value_begin, sp.value_end - sp.value_begin));
+        want &= ~bit;
+    });
+    return j;
+}
+
+// First lines of the document used for local extraction: up to 2 * max_lines
+// non-empty lines and 4000 characters.
+static LineRange selection_range(const DocText &doc, size_t max_lines) {
+    LineRange r;
+    size_t kept = 0, chars = 0;
+    for (size_t i = 0; i < doc.lines.size(); ++i) {
+        auto &l = doc.lines[i];
+        if (l.empty()) continue;
+        if (chars + l.size() + 1 > 4000 || kept >= max_lines * 2) break;
+        chars += l.size() + 1;
+        kept++;
+        r.end = i + 1;
+    }
+    return r;
+}
+
+static json local_extract_by_type(const DocText &doc, LineRange range, const DocTypeSpec &dt, const Config &cfg) {
+    std::pmr::memory_resource *mr = doc.buf.get_allocator().resource();
+    std::string_view text = doc.span(range.begin, range.end);
+    json j = local_extract_generic(text);
+
+    std::pmr::vector<std::string_view> keep(mr);
+    keep.reserve(cfg.max_snippet_lines);
+    select_ranked_windows(keep, doc, LineRange{0, doc.lines.size()}, dt.snippet_matcher, cfg);
+    if (keep.empty()) {
+        for (size_t i = range.begin; i < range.end && keep.size() < cfg.max_snippet_lines; ++i)
+            if (doc.usable(i)) keep.push_back(doc.lines[i]);
+    }
+    j["important_snippets"] = join_lines_budget(keep, doc, cfg);
+    size_t char_count = 0;
+    for (size_t i = range.begin; i < range.end; ++i) if (!doc.lines[i].empty()) char_count += doc.lines[i].size() + 1;
+    j["char_count"] = (int)char_count;
+
+    // transcript citations: the Q/A turns behind the snippet, straight from the index
+    if (dt.transcript_citations && doc.transcript) {
+        const TranscriptIndex &ix = *doc.transcript;
+        json arr = json::array();
+        long last_turn = -1;
+        std::string text;
+        for (auto &l : keep) {
+            long k = ix.locate(doc.line_of(l));
+            long t = k >= 0 ? ix.turn_of((uint32_t)k) : -1;
+            if (t < 0 || t == last_turn) continue;
+            last_turn = t;
+            const auto &turn = ix.turns()[(size_t)t];
+            const auto &first = ix.lines()[turn.first], &last = ix.lines()[turn.last];
+            text.clear();
+            for (uint32_t q = turn.first; q <= turn.last && text.size() < 400; ++q) {
+                if (!text.empty()) text += ' ';
+                text.append(doc.lines[ix.lines()[q].doc_line]);
+            }
+            if (text.size() > 400) text.resize(400);
+            std::string line = std::to_string(first.line);
+            if (last.page == first.page && last.line != first.line) line += "-" + std::to_string(last.line);
+            arr.push_back({{"page", ix.page_number(first)}, {"line", line}, {"cite", ix.cite(turn.first, turn.last)},
+                           {"text", text}});
+        }
+        if (!arr.empty()) j["local_citations"] = std::move(arr);
+        size_t questions = 0, answers = 0;
+        for (auto &t : ix.turns()) {
+            questions += t.who == TranscriptIndex::Speaker::Question;
+            answers += t.who == TranscriptIndex::Speaker::Answer;
+        }
+        j["transcript"] = {{"pages", ix.pages().size()}, {"first_page", ix.pages().front().number},
+                           {"last_page", ix.pages().back().number}, {"numbered_lines", ix.lines().size()},
+                           {"questions", questions}, {"answers", answers}};
+    } else if (dt.transcript_citations) {
+        // no margin layout found: page and line references in the text
+        struct Cite { int page; std::string_view line, text; };
+        std::pmr::vector<Cite> cites(mr);
+        int curPage = -1;
+        const uint32_t refs = entity_bit(Entity::PageRef) | entity_bit(Entity::LineRef);
+        for (size_t i = range.begin; i < range.end && cites.size() < 10; ++i) {
+            std::string_view line = doc.lines[i];
+            bool cited = false;
+            EntityScanner::scan(line, refs, [&](const EntitySpan &sp) {
+                if (sp.kind == Entity::PageRef) {
+                    curPage = std::atoi(std::string(line.substr(sp.value_begin, sp.value_end - sp.value_begin)).c_str());
+                } else if (!cited) {
+                    cites.push_back({std::max(0, curPage), line.substr(sp.begin, sp.end - sp.begin), line});
+                    cited = true;
+                }
+            });
+        }
+        if (!cites.empty()) {
+            json arr = json::array();
+            for (auto &c : cites) arr.push_back({{"page", c.page}, {"line", std::string(c.line)}, {"text", std::string(c.text)}});
+            j["local_citations"] = std::move(arr);
+        }
+    }
+
+    return j;
+}
+
+// Local (pre-model) stage: classification plus snippet and candidate extraction.
+struct LocalAnalysis {
+    const DocTypeSpec *doc_type = nullptr;
+    BoilerplateStats boilerplate;
+    json local;
+};
+
+static LocalAnalysis analyze_document_text(DocText &doc, const DocTypeRegistry &reg, const Config &cfg) {
+    LocalAnalysis a;
+    a.boilerplate = mark_boilerplate(doc, cfg);
+    a.doc_type = &classify_doc(reg, doc.head_pages(40000));
+    if (a.doc_type->transcript_citations) {
+        doc.transcript.emplace(doc.buf.get_allocator().resource());
+        if (doc.transcript->build(doc.lines, doc.page_first_line)) {
+            doc.transcript->strip_margins(doc.lines);
+            for (uint32_t li : doc.transcript->label_lines()) doc.boilerplate[li] = 1;
+        } else {
+            doc.transcript.reset();
+        }
+    }
+    a.local = local_extract_by_type(doc, selection_range(doc, cfg.max_snippet_lines), *a.doc_type, cfg);
+    return a;
+}
+
+// ---------------- Rate limit and backoff ----------------
+// Two token buckets, requests and tokens per minute, in GCRA form: each bucket is one
+// atomic "theoretical arrival time" moved forward by cost * interval with a CAS, so
+// reserving never takes a lock. A bucket holds about a second of its rate as burst.
+// Rates start from --rpm/--tpm (180 requests/minute and no token limit when unset) and
+// follow the API's x-ratelimit-limit-* headers, never above an explicit --rpm/--tpm.
+// x-ratelimit-remaining-* drains a bucket down to what the API says is left, and
+// retry-after closes both until it passes.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // per_minute <= 0 disables the bucket
+    void set_rate(double per_minute) {
+        interval_ns_.store(per_minute > 0 ? (int64_t)(60e9 / per_minute) : 0, std::memory_order_relaxed);
+    }
+    double rate() const {
+        int64_t t = interval_ns_.load(std::memory_order_relaxed);
+        return t ? 60e9 / t : 0.0;
+    }
+
+    // Charges cost units and returns when they may be spent.
+    Clock::time_point reserve(double cost) {
+        const int64_t t = interval_ns_.load(std::memory_order_relaxed);
+        const int64_t now = ns(Clock::now());
+        if (!t) return at(now);
+        const int64_t inc = (int64_t)(cost * t), tau = burst(t);
+        int64_t tat = tat_.load(std::memory_order_relaxed), start;
+        do {
+            start = std::max(now, tat - std::max<int64_t>(0, tau - inc));
+        } while (!tat_.compare_exchange_weak(tat, std::max(tat, now) + inc, std::memory_order_relaxed));
+        return at(start);
+    }
+
+    // The API reports `left` units; drop what the bucket holds to match (never raises it).
+    void sync_remaining(double left) {
+        const int64_t t = interval_ns_.load(std::memory_order_relaxed);
+        if (!t) return;
+        push_tat(ns(Clock::now()) + burst(t) - (int64_t)(std::max(0.0, left) * t));
+    }
+
+    // Nothing goes out before `until`.
+    void close_until(Clock::time_point until) {
+        const int64_t t = interval_ns_.load(std::memory_order_relaxed);
+        push_tat(ns(until) + (t ? burst(t) : 0));
+    }
+
+private:
+    static int64_t burst(int64_t interval) { return std::max<int64_t>(interval, 1000000000); }
+    static int64_t ns(Clock::time_point p) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(p.time_since_epoch()).count();
+    }
+    static Clock::time_point at(int64_t n) { return Clock::time_point(std::chrono::nanoseconds(n)); }
+    void push_tat(int64_t v) {
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        while (tat < v && !tat_.compare_exchange_weak(tat, v, std::memory_order_relaxed)) {}
+    }
+
+    std::atomic<int64_t> interval_ns_{0};  // time per unit
+    std::atomic<int64_t> tat_{0};
+};
+
+struct RateLimitHeaders {
+    double limit_requests = -1, limit_tokens = -1;          // -1: header absent
+    double remaining_requests = -1, remaining_tokens = -1;
+    double retry_after_ms = -1;
+
+    // One response header line, as passed to CURLOPT_HEADERFUNCTION
+    void parse_line(std::string_view line) {
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) return;
+        std::string name(line.substr(0, colon));
+        for (auto &ch : name) ch = (char)std::tolower((unsigned char)ch);
+        std::string_view v = line.substr(colon + 1);
+        while (!v.empty() && (v.front() == ' ' || v.front() == '\t')) v.remove_prefix(1);
+        while (!v.empty() && std::isspace((unsigned char)v.back())) v.remove_suffix(1);
+        double x = -1;
+        if (v.empty() || !std::isdigit((unsigned char)v.front())) return; // HTTP-date retry-after is ignored
+        try { x = std::stod(std::string(v)); } catch (...) { return; }
+        if (name == "x-ratelimit-limit-requests") limit_requests = x;
+        else if (name == "x-ratelimit-limit-tokens") limit_tokens = x;
+        else if (name == "x-ratelimit-remaining-requests") remaining_requests = x;
+        else if (name == "x-ratelimit-remaining-tokens") remaining_tokens = x;
+        else if (name == "retry-after-ms") retry_after_ms = x;
+        else if (name == "retry-after" && retry_after_ms < 0) retry_after_ms = x * 1000;
+    }
+};
+
+class RateLimiter {
+public:
+    using Clock = TokenBucket::Clock;
+    static constexpr double kDefaultRpm = 180;
+
+    // Ceilings from the CLI; 0 leaves the rate to the API headers
+    void configure(double rpm, double tpm) {
+        rpm_cap_ = rpm;
+        tpm_cap_ = tpm;
+        requests_.set_rate(rpm > 0 ? rpm : kDefaultRpm);
+        tokens_.set_rate(tpm);
+    }
+
+    // Claims one request costing `tokens` and returns when it may be sent; never blocks.
+    Clock::time_point reserve(long tokens) {
+        return std::max(requests_.reserve(1), tokens_.reserve((double)tokens));
+    }
+
+    void observe(const RateLimitHeaders &h) {
+        if (h.limit_requests > 0) requests_.set_rate(rpm_cap_ > 0 ? std::min(rpm_cap_, h.limit_requests) : h.limit_requests);
+        if (h.limit_tokens > 0) tokens_.set_rate(tpm_cap_ > 0 ? std::min(tpm_cap_, h.limit_tokens) : h.limit_tokens);
+        if (h.remaining_requests >= 0) requests_.sync_remaining(h.remaining_requests);
+        if (h.remaining_tokens >= 0) tokens_.sync_remaining(h.remaining_tokens);
+        if (h.retry_after_ms > 0) {
+            auto until = Clock::now() + std::chrono::milliseconds((long long)h.retry_after_ms);
+            requests_.close_until(until);
+            tokens_.close_until(until);
+        }
+    }
+
+    json to_json() const {
+        return {{"requests_per_minute", std::lround(requests_.rate())}, {"tokens_per_minute", std::lround(tokens_.rate())}};
+    }
+
+private:
+    double rpm_cap_ = 0, tpm_cap_ = 0;
+    TokenBucket requests_, tokens_;
+} limiter;
+
+// Additive-increase/multiplicative-decrease window for requests in flight. It starts
+// small and grows by one per reply (slow start) until the first throttle, then by one
+// per window of replies, while it is full; a 429 or 503 halves it, at most once per round trip. --inflight
+// caps it. Used on the dispatcher thread only.
+class AimdWindow {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void configure(int cap) {
+        cap_ = std::max(1, cap);
+        cwnd_ = std::min(4.0, (double)cap_);
+    }
+    int limit() const { return (int)cwnd_; }
+
+    // in_flight: requests on the wire when the reply came, this one included; the window
+    // only grows while it is the limit, not while the limiter's pacing is
+    void on_success(int in_flight) {
+        if (in_flight < limit()) return;
+        cwnd_ = std::min((double)cap_, cwnd_ + (slow_start_ ? 1.0 : 1.0 / cwnd_));
+    }
+    // sent: when the throttled request went out; replies to requests sent before the
+    // last decrease were already accounted for by it
+    void on_throttle(Clock::time_point sent) {
+        throttled_++;
+        if (sent < last_decrease_) return;
+        slow_start_ = false;
+        cwnd_ = std::max(1.0, cwnd_ / 2);
+        last_decrease_ = Clock::now();
+        decreases_++;
+    }
+
+    json to_json() const {
+        return {{"window", limit()}, {"window_cap", cap_}, {"throttled", throttled_}, {"window_decreases", decreases_}};
+    }
+
+private:
+    int cap_ = 16;
+    double cwnd_ = 4;
+    bool slow_start_ = true;
+    Clock::time_point last_decrease_{};
+    long throttled_ = 0, decreases_ = 0;
+};
+
+// ---------------- Prompt compaction ----------------
+// Phrases abbreviated by --compact-prompt when no --abbrev file is given. Only
+// abbreviations the model reads unambiguously; each maps back to one phrase.
+static const char *kBuiltinAbbreviations =
+    "history of present illness\tHPI\n"
+    "past medical history\tPMH\n"
+    "chief complaint\tCC\n"
+    "range of motion\tROM\n"
+    "magnetic resonance imaging\tMRI\n"
+    "emergency department\tED\n"
+    "motor vehicle accident\tMVA\n"
+    "examination before trial\tEBT\n"
+    "explanation of benefits\tEOB\n"
+    "bill of particulars\tBOP\n"
+    "verified bill of particulars\tVBOP\n"
+    "independent medical examination\tIME\n"
+    "statute of limitations\tSOL\n";
+
+// Expands the prompt's phrase abbreviations in the free text of the model's answer.
+// Single-token strings (study types, codes, IDs) are left as the model wrote them.
+static void expand_abbreviations(json &j, const TextCompactor &compactor, const std::vector<uint32_t> &used) {
+    if (j.is_string()) {
+        const std::string &s = j.get_ref<const std::string &>();
+        if (s.find(' ') != std::string::npos) j = compactor.expand_phrases(s, used);
+    }
+    else if (j.is_array() || j.is_object()) for (auto &v : j) expand_abbreviations(v, compactor, used);
+}
+
+// ---------------- OpenAI call ----------------
+// Prompt tokens predicted locally vs the usage the API billed.
+struct TokenUsage {
+    long predicted_prompt = 0;
+    long prompt = 0;
+    long cached = 0;           // billed prompt tokens served from the provider's prompt cache
+    long completion = 0;
+    long snippet_raw = 0;      // snippet tokens before and after --compact-prompt
+    long snippet_compact = 0;
+};
+
+// Chat framing costs 3 tokens per message plus its role, and 3 more to prime the reply.
+// Function definitions are counted as their JSON; the provider's internal rendering of
+// them differs slightly, which shows up as the predicted vs billed gap.
+static long predict_prompt_tokens(const Config &cfg, const json &messages, const SchemaFragments &schema) {
+    size_t n = 3;
+    for (auto &m : messages) {
+        n += 3 + count_tokens(cfg, m.value("role", "")) + count_tokens(cfg, m.value("content", ""));
+    }
+    n += count_tokens(cfg, schema_json(schema, cfg.dialect));
+    return (long)n;
+}
+
+// A schema call ready to send, plus what reading its answer needs
+struct ModelRequest {
+    std::string body;
+    std::string document;              // the document's part of the user message
+    long document_tokens = 0;
+    std::vector<uint32_t> abbreviated; // phrase abbreviations to expand in the answer
+    TokenUsage usage;                  // predicted and snippet counts; billed ones come with the reply
+};
+
+// What the dispatcher got back for a request, after its retries
+struct ModelReply {
+    long http_code = 0;
+    std::string body;
+    std::string error;   // no usable reply; http_code and body are then empty
+    std::string error_kind = "transport";
+    int attempts = 0;
+};
+
+// Serializes a request for the schema into mr.body, with its prediction. The system
+// message is the schema's fixed prompt, so user is the only per-document part.
+static void finish_request(const Config &cfg, ModelRequest &mr, const std::string &user, const SchemaFragments &schema) {
+    json req;
+    req["model"] = cfg.model;
+    req["temperature"] = 0.0;
+
+    json messages = json::array();
+    messages.push_back({{"role","system"}, {"content", schema.system_prompt}});
+    messages.push_back({{"role","user"}, {"content", user}});
+
+    mr.usage.predicted_prompt = predict_prompt_tokens(cfg, messages, schema);
+    req["messages"] = messages;
+    // the schema is spliced in pre-serialized from the registry
+    mr.body = req.dump();
+    mr.body.pop_back();
+    switch (cfg.dialect) {
+    case Dialect::Functions:
+        mr.body += ",\"functions\":" + schema.functions_json + ",\"function_call\":" + schema.function_call_json + "}";
+        break;
+    case Dialect::Tools:
+        mr.body += ",\"tools\":" + schema.tools_json + ",\"tool_choice\":" + schema.tool_choice_json + "}";
+        break;
+    case Dialect::JsonSchema:
+        mr.body += ",\"response_format\":" + schema.response_format_json + "}";
+        break;
+    }
+}
+
+static ModelRequest build_model_request(const Config &cfg, const DocTypeSpec &dt, const json &local_candidates,
+                                        const std::string &snippet) {
+    ModelRequest mr;
+    std::string body_text = cfg.max_tokens ? snippet : snippet.substr(0, cfg.max_chars_per_snippet);
+    if (cfg.compactor) {
+        mr.usage.snippet_raw = (long)count_tokens(cfg, body_text);
+        std::string compacted = cfg.compactor->compact(body_text, &mr.abbreviated);
+        cfg.compactor->keep_introduced(body_text, mr.abbreviated);
+        body_text = std::move(compacted);
+        mr.usage.snippet_compact = (long)count_tokens(cfg, body_text);
+    }
+    mr.document = local_candidates.dump() + "\n---\n" + body_text;
+    mr.document_tokens = (long)count_tokens(cfg, mr.document);
+    finish_request(cfg, mr, mr.document, dt.schema);
+    return mr;
+}
+
+// One request for several documents of a doc type (--coalesce), each after a "### id"
+// line; the answer is the coalesced schema's "results" array. Abbreviations are expanded
+// per document by CoalescedCall::take().
+static ModelRequest build_coalesced_request(const Config &cfg, const DocTypeSpec &dt,
+                                            const std::vector<const ModelRequest *> &docs) {
+    ModelRequest mr;
+    std::string user;
+    for (size_t i = 0; i < docs.size(); ++i) user += "### d" + std::to_string(i) + "\n" + docs[i]->document + "\n";
+    finish_request(cfg, mr, user, dt.coalesced);
+    return mr;
+}
+
+// Model output from a chat/completions reply (after retries); fills the billed usage.
+// Throws DocError for transport failures, error statuses and unusable replies.
+static json parse_model_reply(const Config &cfg, ModelRequest &mr, const ModelReply &reply) {
+    if (!reply.error.empty()) {
+        throw DocError(reply.error_kind, reply.attempts > 1 ? reply.error + " (" + std::to_string(reply.attempts) + " attempts)"
+                                                            : reply.error);
+    }
+    json resp;
+    try {
+        resp = json::parse(reply.body.empty() ? "{}" : reply.body);
+    } catch (...) {
+        std::cerr << "Raw response: " << reply.body << std::endl;
+        throw DocError("response", "Failed to parse JSON response from API (HTTP " + std::to_string(reply.http_code) + ")");
+    }
+    if (reply.http_code >= 400) {
+        std::string msg = "Model server HTTP " + std::to_string(reply.http_code);
+        if (resp.contains("error") && resp["error"].is_object()) msg += ": " + resp["error"].value("message", "");
+        if (reply.attempts > 1) msg += " (" + std::to_string(reply.attempts) + " attempts)";
+        throw DocError("http", msg, reply.http_code);
+    }
+
+    if (resp.contains("usage") && resp["usage"].is_object()) {
+        mr.usage.prompt = resp["usage"].value("prompt_tokens", 0L);
+        if (resp["usage"].contains("prompt_tokens_details") && resp["usage"]["prompt_tokens_details"].is_object())
+            mr.usage.cached = resp["usage"]["prompt_tokens_details"].value("cached_tokens", 0L);
+        mr.usage.completion = resp["usage"].value("completion_tokens", 0L);
+    }
+
+    // parse function_call / tool_calls arguments or content, with basic repair if needed
+    try {
+        auto &choice = resp["choices"][0];
+        std::string payload;
+        if (choice.contains("message") && choice["message"].contains("function_call")) {
+            payload = choice["message"]["function_call"]["arguments"].get<std::string>();
+        } else if (choice.contains("message") && choice["message"].contains("tool_calls") &&
+                   !choice["message"]["tool_calls"].empty()) {
+            payload = choice["message"]["tool_calls"][0]["function"]["arguments"].get<std::string>();
+        } else if (choice.contains("message") && choice["message"].contains("content")) {
+            payload = choice["message"]["content"].get<std::string>();
+        }
+        // try parse, with brace repair
+        json parsed;
+        try {
+            parsed = json::parse(payload);
+        } catch (...) {
+            auto start = payload.find('{');
+            auto end = payload.rfind('}');
+            if (start == std::string::npos || end == std::string::npos || end <= start) throw;
+            parsed = json::parse(payload.substr(start, end - start + 1));
+        }
+        if (cfg.compactor) expand_abbreviations(parsed, *cfg.compactor, mr.abbreviated);
+        return parsed;
+    } catch (...) {
+        std::cerr << "Raw response: " << resp.dump(2) << std::endl;
+        throw DocError("output", "Failed to parse model output JSON");
+    }
+}
+
+// ---------------- LLM backend ----------------
+// Endpoint and headers for an OpenAI-compatible chat/completions server. base_url is
+// the API root (".../v1"); a URL that already ends in /chat/completions is used as is,
+// and a query string (Azure's ?api-version=) is kept after the path.
+struct LlmBackend {
+    std::string url;
+    std::vector<std::string> headers;
+
+    static LlmBackend from_config(const Config &cfg) {
+        LlmBackend b;
+        std::string base = cfg.base_url, query;
+        if (auto q = base.find('?'); q != std::string::npos) {
+            query = base.substr(q);
+            base.resize(q);
+        }
+        while (!base.empty() && base.back() == '/') base.pop_back();
+        const std::string path = "/chat/completions";
+        bool has_path = base.size() >= path.size() && base.compare(base.size() - path.size(), path.size(), path) == 0;
+        b.url = base + (has_path ? "" : path) + query;
+
+        if (cfg.auth == "bearer") b.headers.push_back("Authorization: Bearer " + cfg.api_key);
+        else if (cfg.auth == "api-key") b.headers.push_back("api-key: " + cfg.api_key);
+        b.headers.push_back("Content-Type: application/json");
+        return b;
+    }
+};
+
+// ---------------- Local inference ----------------
+#ifdef LEGAL_OCR_WITH_LLAMA
+// In-process extraction with llama.cpp on the CPU (--llama-model), for records that may
+// not be sent to an API. It takes the same chat/completions request bodies as the HTTP
+// backend and answers with the same reply shape, so everything after the dispatcher is
+// unchanged. Needs a llama.cpp with the llama_memory_* API (mid 2025 or later).
+
+// GBNF grammar for a doc type's JSON schema, so the model can only produce JSON of
+// that shape. Covers what doc type schemas use: objects (required properties first,
+// then optional ones, each group in key order), arrays, strings, numbers, integers, booleans,
+// enums and type lists such as ["string","null"]. Anything else allows any JSON value.
+class GbnfBuilder {
+public:
+    std::string build(const json &schema) {
+        rules_.clear();
+        names_.clear();
+        std::string root = visit(schema, "root");
+        std::string out = root == "root" ? "" : "root ::= " + root + "\n";
+        for (auto &r : rules_) out += r.first + " ::= " + r.second + "\n";
+        out += kPrimitives;
+        return out;
+    }
+
+private:
+    static constexpr const char *kPrimitives = R"GBNF(ws ::= [ ]?
+string ::= "\"" ( [^"\\\x7F\x00-\x1F] | "\\" ( ["\\/bfnrt] | "u" [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] [0-9a-fA-F] ) )* "\""
+number ::= "-"? ( "0" | [1-9] [0-9]* ) ( "." [0-9]+ )? ( [eE] [-+]? [0-9]+ )?
+integer ::= "-"? ( "0" | [1-9] [0-9]* )
+boolean ::= "true" | "false"
+null ::= "null"
+value ::= object | array | string | number | boolean | null
+object ::= "{" ws ( string ":" ws value ( "," ws string ":" ws value )* )? "}"
+array ::= "[" ws ( value ( "," ws value )* )? "]"
+)GBNF";
+
+    static std::string literal(const std::string &s) {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if (c == '\n') { out += "\\n"; continue; }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+    // Rule names are [a-z0-9-]; repeated names get a number
+    std::string add_rule(const std::string &hint, std::string body) {
+        std::string name;
+        for (char c : hint) name += std::isalnum((unsigned char)c) ? (char)std::tolower((unsigned char)c) : '-';
+        int n = names_[name]++;
+        if (n) name += "-" + std::to_string(n);
+        rules_.emplace_back(name, std::move(body));
+        return name;
+    }
+
+    std::string visit(const json &s, const std::string &name) {
+        if (!s.is_object()) return "value";
+        if (s.contains("enum") && s["enum"].is_array()) {
+            std::string alts;
+            for (auto &v : s["enum"]) alts += (alts.empty() ? "" : " | ") + literal(v.dump());
+            return alts.empty() ? "value" : add_rule(name, alts);
+        }
+        const json type = s.value("type", json());
+        if (type.is_array()) {
+            std::string alts;
+            for (auto &t : type) {
+                json one = s;
+                one["type"] = t;
+                alts += (alts.empty() ? "" : " | ") + visit(one, name);
+            }
+            return alts.empty() ? "value" : add_rule(name, alts);
+        }
+        const std::string t = type.is_string() ? type.get<std::string>() : "";
+        if (t == "string" || t == "number" || t == "integer" || t == "boolean" || t == "null") return t;
+        if (t == "array") {
+            std::string item = s.contains("items") ? visit(s["items"], name + "-item") : "value";
+            return add_rule(name, "\"[\" ws ( " + item + " ( \",\" ws " + item + " )* )? \"]\"");
+        }
+        if (t == "object" && s.contains("properties") && s["properties"].is_object() && !s["properties"].empty()) {
+            std::vector<std::string> req_names = s.value("required", std::vector<std::string>());
+            std::vector<std::string> required, optional;
+            for (auto &[key, sub] : s["properties"].items()) {
+                std::string kv = literal(json(key).dump()) + " \":\" ws " + visit(sub, name + "-" + key);
+                bool is_req = std::find(req_names.begin(), req_names.end(), key) != req_names.end();
+                (is_req ? required : optional).push_back(kv);
+            }
+            std::string body = "\"{\" ws ";
+            if (!required.empty()) {
+                for (size_t i = 0; i < required.size(); ++i) body += (i ? "\",\" ws " : "") + required[i] + " ";
+                for (auto &kv : optional) body += "( \",\" ws " + kv + " )? ";
+            } else {
+                // no required key: any one optional key may come first, later ones follow it
+                std::string first;
+                for (size_t i = 0; i < optional.size(); ++i) {
+                    first += (i ? " | " : "") + optional[i];
+                    for (size_t k = i + 1; k < optional.size(); ++k) first += " ( \",\" ws " + optional[k] + " )?";
+                }
+                body += "( " + first + " )? ";
+            }
+            return add_rule(name, body + "\"}\"");
+        }
+        if (t == "object") return "object";
+        return "value";
+    }
+
+    std::vector<std::pair<std::string, std::string>> rules_;
+    std::unordered_map<std::string, int> names_;
+};
+
+// A pool of inference workers, each with its own llama context over one shared model.
+// The system message of a request (instructions plus the doc type's schema) is the
+// same for every document of that type, so its tokens are decoded once into a prefix
+// sequence of the worker's KV cache; a document copies that sequence and decodes only
+// its own message. A worker keeps up to kPrefixSlots prefixes (least recently used goes,
+// also when a request needs their cells), and a prefix decoded by one worker is handed
+// to the others as saved sequence state.
+class LocalLlm {
+public:
+    using Done = std::function<void(ModelReply &&reply)>;
+
+    void start(const Config &cfg) {
+        llama_backend_init();
+        llama_model_params mp = llama_model_default_params();
+        mp.n_gpu_layers = 0;
+        model_ = llama_model_load_from_file(cfg.llama_model.c_str(), mp);
+        if (!model_) die("Cannot load GGUF model: " + cfg.llama_model);
+        vocab_ = llama_model_get_vocab(model_);
+        const char *tmpl = llama_model_chat_template(model_, nullptr);
+        chat_template_ = tmpl ? tmpl : "chatml";
+
+        int cores = cfg.llama_threads ? cfg.llama_threads : (int)std::max(1u, std::thread::hardware_concurrency());
+        llama_context_params cp = llama_context_default_params();
+        cp.n_ctx = (uint32_t)cfg.llama_ctx;
+        cp.n_batch = 512;
+        cp.n_seq_max = kPrefixSlots + 1;
+        cp.kv_unified = true;   // the prefix sequences share cells with the working one
+        cp.n_threads = cp.n_threads_batch = std::max(1, cores / cfg.llama_workers);
+        n_workers_ = cfg.llama_workers;
+        for (int i = 0; i < cfg.llama_workers; ++i) {
+            auto w = std::make_unique<Worker>();
+            w->ctx = llama_init_from_model(model_, cp);
+            if (!w->ctx) die("Cannot create llama context (--llama-ctx=" + std::to_string(cfg.llama_ctx) + ")");
+            w->batch = llama_batch_init((int32_t)cp.n_batch, 0, 1);
+            workers_.push_back(std::move(w));
+        }
+        for (auto &w : workers_) w->thread = std::thread([this, w = w.get()]{ run(*w); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto &w : workers_) {
+            if (w->thread.joinable()) w->thread.join();
+            llama_batch_free(w->batch);
+            llama_free(w->ctx);
+        }
+        workers_.clear();
+        if (model_) llama_model_free(model_);
+        model_ = nullptr;
+        llama_backend_free();
+    }
+
+    void submit(std::string body, Done done) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            queue_.push_back({std::move(body), std::move(done)});
+        }
+        cv_.notify_one();
+    }
+
+    json stats() const {
+        std::lock_guard<std::mutex> lk(stats_mu_);
+        return {{"backend", "llama.cpp"}, {"workers", n_workers_}, {"requests", requests_},
+                {"prompt_tokens", prompt_tokens_}, {"prefix_tokens_reused", reused_tokens_},
+                {"prefix_decodes", prefix_decodes_}, {"prefix_state_loads", prefix_loads_},
+                {"completion_tokens", completion_tokens_},
+                {"decode_seconds", std::round(decode_seconds_ * 100) / 100}};
+    }
+
+private:
+    static constexpr int kPrefixSlots = 4;         // sequences 1..kPrefixSlots; 0 is the working one
+    static constexpr int kMaxOutputTokens = 1024;
+
+    struct Request {
+        std::string body;
+        Done done;
+    };
+    struct PrefixSlot {
+        std::vector<llama_token> tokens;
+        uint64_t last_used = 0;
+    };
+    struct Worker {
+        llama_context *ctx = nullptr;
+        llama_batch batch{};
+        std::array<PrefixSlot, kPrefixSlots> slots;
+        uint64_t clock = 0;
+        std::thread thread;
+    };
+    struct SavedPrefix {
+        std::vector<llama_token> tokens;
+        std::vector<uint8_t> state;
+    };
+
+    void run(Worker &w) {
+        for (;;) {
+            Request req;
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [&]{ return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                req = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            ModelReply reply;
+            reply.attempts = 1;
+            try {
+                reply.body = complete(w, req.body);
+                reply.http_code = 200;
+            } catch (const std::exception &e) {
+                reply.error = e.what();
+                reply.error_kind = "local";
+            }
+            req.done(std::move(reply));
+        }
+    }
+
+    std::vector<llama_token> tokenize(const std::string &text, bool add_special) const {
+        std::vector<llama_token> toks(text.size() + 8);
+        int n = llama_tokenize(vocab_, text.data(), (int32_t)text.size(), toks.data(), (int32_t)toks.size(), add_special, true);
+        if (n < 0) {
+            toks.resize(-n);
+            n = llama_tokenize(vocab_, text.data(), (int32_t)text.size(), toks.data(), (int32_t)toks.size(), add_special, true);
+        }
+        toks.resize(std::max(0, n));
+        return toks;
+    }
+
+    std::string apply_template(const std::vector<llama_chat_message> &msgs, bool add_assistant) const {
+        std::string buf(4096, '\0');
+        int n = llama_chat_apply_template(chat_template_.c_str(), msgs.data(), msgs.size(), add_assistant, buf.data(), (int32_t)buf.size());
+        if (n > (int)buf.size()) {
+            buf.resize(n);
+            n = llama_chat_apply_template(chat_template_.c_str(), msgs.data(), msgs.size(), add_assistant, buf.data(), (int32_t)buf.size());
+        }
+        if (n < 0) throw std::runtime_error("chat template failed for the local model");
+        buf.resize(n);
+        return buf;
+    }
+
+    // Decodes toks[from..] into seq at positions pos0.., requesting logits for the last token
+    void decode(Worker &w, const std::vector<llama_token> &toks, size_t from, llama_pos pos0, llama_seq_id seq, bool logits) {
+        const size_t n_batch = llama_n_batch(w.ctx);
+        for (size_t i = from; i < toks.size(); i += n_batch) {
+            size_t end = std::min(toks.size(), i + n_batch);
+            w.batch.n_tokens = 0;
+            for (size_t k = i; k < end; ++k) {
+                int b = w.batch.n_tokens++;
+                w.batch.token[b] = toks[k];
+                w.batch.pos[b] = pos0 + (llama_pos)(k - from);
+                w.batch.n_seq_id[b] = 1;
+                w.batch.seq_id[b][0] = seq;
+                w.batch.logits[b] = logits && k + 1 == toks.size();
+            }
+            if (llama_decode(w.ctx, w.batch) != 0) throw std::runtime_error("local model decode failed (KV cache full? raise --llama-ctx)");
+        }
+    }
+
+    // The prefix sequence holding these tokens, decoding or loading it when no slot has it
+    llama_seq_id prefix_seq(Worker &w, const std::vector<llama_token> &prefix, long &reused) {
+        llama_memory_t mem = llama_get_memory(w.ctx);
+        PrefixSlot *slot = nullptr;
+        for (auto &s : w.slots) if (s.tokens == prefix) slot = &s;
+        if (slot) {
+            reused = (long)prefix.size();
+        } else {
+            slot = &*std::min_element(w.slots.begin(), w.slots.end(),
+                                      [](const PrefixSlot &a, const PrefixSlot &b){ return a.last_used < b.last_used; });
+            llama_seq_id seq = (llama_seq_id)(slot - w.slots.data()) + 1;
+            llama_memory_seq_rm(mem, seq, -1, -1);
+            slot->tokens.clear();
+            std::shared_ptr<const SavedPrefix> saved;
+            {
+                std::lock_guard<std::mutex> lk(prefix_mu_);
+                auto it = saved_.find(prefix_key(prefix));
+                if (it != saved_.end() && it->second->tokens == prefix) saved = it->second;
+            }
+            if (saved && llama_state_seq_set_data(w.ctx, saved->state.data(), saved->state.size(), seq) != 0) {
+                reused = (long)prefix.size();
+                std::lock_guard<std::mutex> lk(stats_mu_);
+                prefix_loads_++;
+            } else {
+                llama_memory_seq_rm(mem, seq, -1, -1);
+                try {
+                    decode(w, prefix, 0, 0, seq, false);
+                } catch (...) {
+                    llama_memory_seq_rm(mem, seq, -1, -1);
+                    throw;
+                }
+                auto s = std::make_shared<SavedPrefix>();
+                s->tokens = prefix;
+                s->state.resize(llama_state_seq_get_size(w.ctx, seq));
+                s->state.resize(llama_state_seq_get_data(w.ctx, s->state.data(), s->state.size(), seq));
+                {
+                    std::lock_guard<std::mutex> lk(prefix_mu_);
+                    saved_[prefix_key(prefix)] = std::move(s);
+                }
+                std::lock_guard<std::mutex> lk(stats_mu_);
+                prefix_decodes_++;
+            }
+            slot->tokens = prefix;
+        }
+        slot->last_used = ++w.clock;
+        return (llama_seq_id)(slot - w.slots.data()) + 1;
+    }
+
+    // The prefix slots other than keep share the KV cache with the working sequence;
+    // drops the least recently used of them until the cells they hold fit in budget.
+    void make_room(Worker &w, const std::vector<llama_token> &keep, long budget) {
+        llama_memory_t mem = llama_get_memory(w.ctx);
+        for (;;) {
+            long held = 0;
+            PrefixSlot *lru = nullptr;
+            for (auto &s : w.slots) {
+                if (s.tokens.empty() || s.tokens == keep) continue;
+                held += (long)s.tokens.size();
+                if (!lru || s.last_used < lru->last_used) lru = &s;
+            }
+            if (held <= budget || !lru) return;
+            llama_memory_seq_rm(mem, (llama_seq_id)(lru - w.slots.data()) + 1, -1, -1);
+            lru->tokens.clear();
+            lru->last_used = 0;
+        }
+    }
+
+    static uint64_t prefix_key(const std::vector<llama_token> &toks) {
+        return fnv1a_64(std::string((const char *)toks.data(), toks.size() * sizeof(llama_token)));
+    }
+
+    const std::string &grammar_for(const json &schema) {
+        std::string key = schema.dump();
+        std::lock_guard<std::mutex> lk(prefix_mu_);
+        auto it = grammars_.find(key);
+        if (it == grammars_.end()) it = grammars_.emplace(key, GbnfBuilder().build(schema)).first;
+        return it->second;
+    }
+
+    // Runs one chat/completions body and returns a chat/completions reply body
+    std::string complete(Worker &w, const std::string &body) {
+        auto t0 = std::chrono::steady_clock::now();
+        json req = json::parse(body);
+        // the schema in whichever dialect the request was built for
+        json fn;
+        if (req.contains("response_format")) {
+            auto &js = req["response_format"]["json_schema"];
+            fn = {{"name", js.value("name", "extract")}, {"parameters", js.value("schema", json::object())}};
+        } else {
+            json fns = json::array();
+            std::string want;
+            if (req.contains("tools")) {
+                for (auto &t : req["tools"]) fns.push_back(t["function"]);
+                if (req.contains("tool_choice") && req["tool_choice"].is_object()) want = req["tool_choice"]["function"].value("name", "");
+            } else {
+                fns = req.value("functions", json::array());
+                if (req.contains("function_call") && req["function_call"].is_object()) want = req["function_call"].value("name", "");
+            }
+            for (auto &f : fns) if (fn.is_null() || f.value("name", "") == want) fn = f;
+        }
+        if (fn.is_null()) throw std::runtime_error("request has no schema for the local model");
+        const json schema = fn.value("parameters", json::object());
+
+        std::string system_text, user_text;
+        for (auto &m : req["messages"]) {
+            if (m.value("role", "") == "system") system_text = m.value("content", "");
+            else if (m.value("role", "") == "user") user_text = m.value("content", "");
+        }
+        // no function calling here: the schema goes into the static system message
+        system_text += "\nFill the JSON object for " + fn.value("name", std::string("extract")) + ": " +
+                       fn.value("description", std::string("")) + "\nJSON schema: " + schema.dump();
+
+        std::vector<llama_chat_message> msgs = {{"system", system_text.c_str()}, {"user", user_text.c_str()}};
+        const std::string head = apply_template({msgs[0]}, false);
+        const std::string full = apply_template(msgs, true);
+        std::vector<llama_token> prefix, rest;
+        if (full.compare(0, head.size(), head) == 0) {
+            prefix = tokenize(head, true);
+            rest = tokenize(full.substr(head.size()), false);
+        } else {
+            rest = tokenize(full, true);   // template without a separable system turn
+        }
+        const long prompt_tokens = (long)(prefix.size() + rest.size());
+        const long n_ctx = (long)llama_n_ctx(w.ctx);
+        if (prompt_tokens + kMaxOutputTokens > n_ctx)
+            throw std::runtime_error("prompt of " + std::to_string(prompt_tokens) + " tokens does not fit --llama-ctx");
+        make_room(w, prefix, n_ctx - prompt_tokens - kMaxOutputTokens);
+
+        llama_memory_t mem = llama_get_memory(w.ctx);
+        llama_memory_seq_rm(mem, 0, -1, -1);
+        long reused = 0;
+        if (!prefix.empty()) llama_memory_seq_cp(mem, prefix_seq(w, prefix, reused), 0, -1, -1);
+        decode(w, rest, 0, (llama_pos)prefix.size(), 0, true);
+
+        llama_sampler *smpl = llama_sampler_chain_init(llama_sampler_chain_default_params());
+        llama_sampler *grammar = llama_sampler_init_grammar(vocab_, grammar_for(schema).c_str(), "root");
+        if (!grammar) {
+            llama_sampler_free(smpl);
+            throw std::runtime_error("schema grammar rejected by llama.cpp for " + fn.value("name", std::string("")));
+        }
+        llama_sampler_chain_add(smpl, grammar);
+        llama_sampler_chain_add(smpl, llama_sampler_init_greedy());   // temperature 0
+
+        std::string out;
+        std::vector<llama_token> one(1);
+        llama_pos pos = (llama_pos)prompt_tokens;
+        int generated = 0;
+        try {
+            for (; generated < kMaxOutputTokens; ++generated) {
+                llama_token tok = llama_sampler_sample(smpl, w.ctx, -1);
+                if (llama_vocab_is_eog(vocab_, tok)) break;
+                char piece[256];
+                int n = llama_token_to_piece(vocab_, tok, piece, sizeof piece, 0, false);
+                if (n > 0) out.append(piece, n);
+                one[0] = tok;
+                decode(w, one, 0, pos++, 0, true);
+            }
+        } catch (...) {
+            llama_sampler_free(smpl);
+            throw;
+        }
+        llama_sampler_free(smpl);
+        llama_memory_seq_rm(mem, 0, -1, -1);
+
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        {
+            std::lock_guard<std::mutex> lk(stats_mu_);
+            requests_++;
+            prompt_tokens_ += prompt_tokens;
+            reused_tokens_ += reused;
+            completion_tokens_ += generated;
+            decode_seconds_ += secs;
+        }
+        json reply = {
+            {"object", "chat.completion"}, {"model", req.value("model", "")},
+            {"choices", json::array({{{"index", 0}, {"finish_reason", generated < kMaxOutputTokens ? "stop" : "length"},
+                                      {"message", {{"role", "assistant"}, {"content", out}}}}})},
+            {"usage", {{"prompt_tokens", prompt_tokens}, {"completion_tokens", generated},
+                       {"prompt_tokens_details", {{"cached_tokens", reused}}}}}
+        };
+        return reply.dump();
+    }
+
+    llama_model *model_ = nullptr;
+    const llama_vocab *vocab_ = nullptr;
+    std::string chat_template_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    int n_workers_ = 0;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Request> queue_;
+    bool stop_ = false;
+
+    std::mutex prefix_mu_;
+    std::unordered_map<uint64_t, std::shared_ptr<const SavedPrefix>> saved_;
+    std::unordered_map<std::string, std::string> grammars_;   // schema dump -> GBNF
+
+    mutable std::mutex stats_mu_;
+    long requests_ = 0, prompt_tokens_ = 0, reused_tokens_ = 0, completion_tokens_ = 0;
+    long prefix_decodes_ = 0, prefix_loads_ = 0;
+    double decode_seconds_ = 0;
+};
+#endif // LEGAL_OCR_WITH_LLAMA
+
+// ---------------- Async LLM dispatch ----------------
+// One event thread drives every model request through curl multi, so many calls are
+// in flight without a thread each. OCR workers submit a document's requests and move
+// on to the next document. Pacing by the shared limiter and retry backoff are timers
+// on the event thread, not sleeps, and the number of requests in flight follows an
+// AIMD window. Response headers feed the limiter. Curl errors, 408, 429 and 5xx are
+// retried after Retry-After or a jittered exponential backoff; what is left after the
+// last attempt is handed back as the reply, never fatal to the run. Replies go to the
+// submitter's callback on the event thread, which should only hand them off (see the
+// completion queue in Document processing). Easy handles are kept for reuse, and the
+// multi handle's connection cache keeps connections to the API alive between requests.
+// With --llama-model, requests go to the in-process LocalLlm pool instead.
+class LlmDispatcher {
+public:
+    using Done = std::function<void(ModelReply &&reply)>;
+
+    void start(const Config &cfg) {
+#ifdef LEGAL_OCR_WITH_LLAMA
+        if (!cfg.llama_model.empty()) {
+            local_ = std::make_unique<LocalLlm>();
+            local_->start(cfg);
+            return;
+        }
+#endif
+        LlmBackend backend = LlmBackend::from_config(cfg);
+        url_ = backend.url;
+        window_.configure(cfg.max_inflight);
+        timeout_sec_ = cfg.http_timeout;
+        for (auto &h : backend.headers) headers_ = curl_slist_append(headers_, h.c_str());
+        multi_ = curl_multi_init();
+        if (!multi_) die("curl multi init failed");
+        thread_ = std::thread([this]{ run(); });
+    }
+
+    // Waits for every submitted request to complete.
+    void stop() {
+#ifdef LEGAL_OCR_WITH_LLAMA
+        if (local_) {
+            local_->stop();
+            return;
+        }
+#endif
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        if (thread_.joinable()) {
+            curl_multi_wakeup(multi_);
+            thread_.join();
+        }
+        for (CURL *e : idle_) curl_easy_cleanup(e);
+        idle_.clear();
+        if (multi_) curl_multi_cleanup(multi_);
+        multi_ = nullptr;
+        curl_slist_free_all(headers_);
+        headers_ = nullptr;
+    }
+
+    // Thread safe; done runs on the event thread. tokens is what the request is expected
+    // to use against the tokens-per-minute limit.
+    void submit(std::string body, long tokens, Done done) {
+#ifdef LEGAL_OCR_WITH_LLAMA
+        if (local_) {
+            local_->submit(std::move(body), std::move(done));
+            return;
+        }
+#endif
+        auto t = std::make_unique<Transfer>();
+        t->body = std::move(body);
+        t->tokens = tokens;
+        t->done = std::move(done);
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            incoming_.push_back(std::move(t));
+        }
+        curl_multi_wakeup(multi_);
+    }
+
+    // After stop()
+    json stats() const { return window_.to_json(); }
+    json local_stats() const {
+#ifdef LEGAL_OCR_WITH_LLAMA
+        if (local_) return local_->stats();
+#endif
+        return json();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    static constexpr int kMaxAttempts = 4; // first attempt plus three retries
+
+    struct Transfer {
+        std::string body;
+        ModelReply reply;
+        Done done;
+        long tokens = 0;
+        int backoff_ms = 400;
+        bool paced = false;    // holds a limiter slot
+        Clock::time_point sent;
+        RateLimitHeaders limits;
+    };
+
+    static size_t header_cb(char *data, size_t size, size_t nmemb, void *userp) {
+        ((RateLimitHeaders *)userp)->parse_line(std::string_view(data, size * nmemb));
+        return size * nmemb;
+    }
+
+    void run() {
+        for (;;) {
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                for (auto &t : incoming_) queued_.push_back(std::move(t));
+                incoming_.clear();
+            }
+            // Due timers: paced sends start (their slot already counts against the cap),
+            // finished backoffs queue again for a new slot
+            auto now = Clock::now();
+            while (!timers_.empty() && timers_.begin()->first <= now) {
+                auto t = std::move(timers_.begin()->second);
+                timers_.erase(timers_.begin());
+                if (t->paced) {
+                    t->paced = false;
+                    paced_--;
+                    start_transfer(std::move(t));
+                } else {
+                    queued_.push_front(std::move(t));
+                }
+            }
+            while (!queued_.empty() && (int)running_.size() + paced_ < window_.limit()) {
+                auto t = std::move(queued_.front());
+                queued_.pop_front();
+                auto slot = limiter.reserve(t->tokens);
+                if (slot <= Clock::now()) {
+                    start_transfer(std::move(t));
+                    continue;
+                }
+                t->paced = true;
+                paced_++;
+                timers_.emplace(slot, std::move(t));
+            }
+
+            int still = 0;
+            curl_multi_perform(multi_, &still);
+            int left = 0, finished = 0;
+            while (CURLMsg *m = curl_multi_info_read(multi_, &left)) {
+                if (m->msg != CURLMSG_DONE) continue;
+                finish_transfer(m->easy_handle, m->data.result);
+                finished++;
+            }
+
+            if (running_.empty() && timers_.empty() && queued_.empty()) {
+                std::lock_guard<std::mutex> lk(mu_);
+                if (stop_ && incoming_.empty()) break;
+            }
+            int wait_ms = 1000;
+            if (finished && !queued_.empty()) wait_ms = 0;   // the window has room again
+            else if (!timers_.empty()) {
+                auto due = std::chrono::ceil<std::chrono::milliseconds>(timers_.begin()->first - Clock::now()).count();
+                wait_ms = (int)std::clamp<long long>(due, 0, 1000);
+            }
+            curl_multi_poll(multi_, nullptr, 0, wait_ms, nullptr);
+        }
+    }
+
+    void start_transfer(std::unique_ptr<Transfer> t) {
+        CURL *e = idle_.empty() ? curl_easy_init() : idle_.back();
+        if (!idle_.empty()) idle_.pop_back();
+        if (!e) {
+            t->reply.error = "curl init failed";
+            t->done(std::move(t->reply));
+            return;
+        }
+        curl_easy_reset(e);
+        http_pool.attach(e);
+        t->reply.body.clear();
+        t->limits = RateLimitHeaders{};
+        t->sent = Clock::now();
+        curl_easy_setopt(e, CURLOPT_URL, url_.c_str());
+        curl_easy_setopt(e, CURLOPT_HTTPHEADER, headers_);
+        curl_easy_setopt(e, CURLOPT_POSTFIELDS, t->body.c_str());
+        curl_easy_setopt(e, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)t->body.size());
+        curl_easy_setopt(e, CURLOPT_TIMEOUT, (long)timeout_sec_);
+        curl_easy_setopt(e, CURLOPT_WRITEFUNCTION, curl_write_cb);
+        curl_easy_setopt(e, CURLOPT_WRITEDATA, &t->reply.body);
+        curl_easy_setopt(e, CURLOPT_HEADERFUNCTION, header_cb);
+        curl_easy_setopt(e, CURLOPT_HEADERDATA, &t->limits);
+        curl_multi_add_handle(multi_, e);
+        running_.emplace(e, std::move(t));
+    }
+
+    void finish_transfer(CURL *e, CURLcode res) {
+        auto it = running_.find(e);
+        std::unique_ptr<Transfer> t = std::move(it->second);
+        running_.erase(it);
+        curl_multi_remove_handle(multi_, e);
+        long code = 0;
+        curl_easy_getinfo(e, CURLINFO_RESPONSE_CODE, &code);
+        if (res == CURLE_OK) http_pool.record(e);
+        idle_.push_back(e);
+
+        t->reply.attempts++;
+        if (res == CURLE_OK) {
+            limiter.observe(t->limits);
+            if (code == 429 || code == 503) window_.on_throttle(t->sent);
+            else if (code < 400) window_.on_success((int)running_.size() + 1);
+        }
+        bool transient = res != CURLE_OK || transient_http_status(code);
+        if (transient && t->reply.attempts < kMaxAttempts) {
+            timers_.emplace(Clock::now() + retry_delay(*t, code), std::move(t));
+            return;
+        }
+        if (res != CURLE_OK) t->reply.error = std::string("curl failed: ") + curl_easy_strerror(res);
+        else t->reply.http_code = code;
+        t->done(std::move(t->reply));
+    }
+
+    // Retry-After when the API sent one (it has also closed the limiter for everyone),
+    // else exponential backoff with jitter so requests throttled together spread out
+    std::chrono::milliseconds retry_delay(Transfer &t, long code) {
+        if (t.limits.retry_after_ms > 0) return std::chrono::milliseconds((long long)t.limits.retry_after_ms);
+        std::uniform_real_distribution<double> jitter(0.5, 1.0);
+        auto delay = std::chrono::milliseconds((long long)(t.backoff_ms * jitter(rng_)));
+        t.backoff_ms = code == 429 ? std::min(5000, t.backoff_ms * 2) : t.backoff_ms * 2;
+        return delay;
+    }
+
+    std::string url_;
+    int timeout_sec_ = 120;
+    curl_slist *headers_ = nullptr;
+    CURLM *multi_ = nullptr;
+    std::thread thread_;
+
+    std::mutex mu_;
+    std::vector<std::unique_ptr<Transfer>> incoming_;
+    bool stop_ = false;
+
+    // event thread only
+    std::deque<std::unique_ptr<Transfer>> queued_;                        // waiting for a send slot
+    std::multimap<Clock::time_point, std::unique_ptr<Transfer>> timers_;  // paced or backing off
+    std::unordered_map<CURL *, std::unique_ptr<Transfer>> running_;
+    std::vector<CURL *> idle_;
+    int paced_ = 0;   // timers_ entries that hold a limiter slot
+    AimdWindow window_;
+    std::mt19937 rng_{std::random_device{}()};
+#ifdef LEGAL_OCR_WITH_LLAMA
+    std::unique_ptr<LocalLlm> local_;
+#endif
+};
+
+// ---------------- Merge and redact ----------------
+// Model citations that point at a page:line the transcript index has are "verified".
+static void verify_citations(json &cites, const TranscriptIndex &ix) {
+    if (!cites.is_array()) return;
+    for (auto &c : cites) {
+        if (!c.is_object() || !c.contains("page")) continue;
+        const json &page = c["page"], line = c.value("line", json());
+        long p = page.is_number_integer() ? page.get<long>() : page.is_string() ? std::atol(page.get<std::string>().c_str()) : 0;
+        long l = line.is_number_integer() ? line.get<long>() : line.is_string() ? std::atol(line.get<std::string>().c_str()) : 0;
+        c["verified"] = p > 0 && l > 0 && ix.find((uint32_t)p, (unsigned)l) != nullptr;
+    }
+}
+
+static json merge_local_and_model(const DocTypeSpec &dt, const json &local_cand, json model, const TranscriptIndex *transcript) {
+    if (!model.contains("snippets") && local_cand.contains("important_snippets")) {
+        model["snippets"] = local_cand["important_snippets"];
+    }
+    if (local_cand.contains("name_candidate")) {
+        if (!model.contains("patient_name")) model["patient_name"] = local_cand["name_candidate"];
+        if (!model.contains("member")) model["member"] = local_cand["name_candidate"];
+    }
+    if (dt.transcript_citations && local_cand.contains("local_citations")) {
+        // if model has no citations, add locals
+        if (!model.contains("citations")) model["citations"] = local_cand["local_citations"];
+    }
+    if (transcript && model.contains("citations")) verify_citations(model["citations"], *transcript);
+    if (local_cand.contains("transcript")) model["transcript_layout"] = local_cand["transcript"];
+    return model;
+}
+
+// Redaction happens while the result is serialized: each string is scanned once and
+// written with its PII values masked, so no redacted copy of the DOM is built. Keys are
+// never redacted. Apart from the masks, the output is byte for byte what json::dump()
+// gives with error_handler_t::replace, so invalid UTF-8 becomes U+FFFD.
+using RedactionCounts = std::array<size_t, (size_t)Entity::Count>;
+
+static const uint32_t kRedactable = kAllEntities & ~(entity_bit(Entity::PageRef) | entity_bit(Entity::LineRef));
+
+// "ssn,phone,email" -> entity mask; "all" selects every redactable class.
+static uint32_t parse_redact_classes(const std::string &spec) {
+    uint32_t mask = 0;
+    std::stringstream ss(spec);
+    std::string name;
+    while (std::getline(ss, name, ',')) {
+        name = to_lower(std::string(trim_view(name)));
+        if (name.empty()) continue;
+        if (name == "all") { mask |= kRedactable; continue; }
+        uint32_t bit = 0;
+        for (unsigned k = 0; k < (unsigned)Entity::Count; ++k)
+            if (name == entity_name((Entity)k)) bit = entity_bit((Entity)k);
+        if (!(bit & kRedactable)) die("Unknown --redact class: " + name + " (use name,date,phone,ssn,email,mrn,claim)");
+        mask |= bit;
+    }
+    return mask;
+}
+
+static const char *redaction_mask(Entity e) {
+    switch (e) {
+    case Entity::Ssn:   return "***-**-****";
+    case Entity::Phone: return "***-***-****";
+    case Entity::Email: return "***@***.***";
+    case Entity::Name:  return "[NAME]";
+    case Entity::Date:  return "[DATE]";
+    case Entity::Mrn:   return "[MRN]";
+    case Entity::Claim: return "[CLAIM]";
+    default:            return "[REDACTED]";
+    }
+}
+
+// Length of the well-formed UTF-8 sequence at s[i], or 0 when it is invalid or cut
+// short; bad is then how many bytes one U+FFFD replaces. The byte that broke a
+// sequence is not part of it and is read again, as json::dump() does.
+static size_t utf8_sequence(std::string_view s, size_t i, size_t &bad) {
+    unsigned char c = (unsigned char)s[i];
+    size_t len;
+    unsigned char lo = 0x80, hi = 0xBF;
+    if (c >= 0xC2 && c <= 0xDF) len = 2;
+    else if (c >= 0xE0 && c <= 0xEF) { len = 3; if (c == 0xE0) lo = 0xA0; else if (c == 0xED) hi = 0x9F; }
+    else if (c >= 0xF0 && c <= 0xF4) { len = 4; if (c == 0xF0) lo = 0x90; else if (c == 0xF4) hi = 0x8F; }
+    else { bad = 1; return 0; }
+    size_t k = 1;
+    for (; k < len && i + k < s.size(); ++k) {
+        unsigned char d = (unsigned char)s[i + k];
+        if (d < lo || d > hi) break;
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    if (k == len) return len;
+    bad = k;
+    return 0;
+}
+
+// Same output as json::dump() with error_handler_t::replace: short escapes where JSON
+// has them, \u00xx for the other control bytes, U+FFFD for each invalid UTF-8
+// sequence (OCR and model output are not guaranteed to be valid), the rest verbatim.
+static void append_json_escaped(std::string &out, std::string_view s) {
+    size_t run = 0;
+    for (size_t i = 0; i < s.size();) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= 0x80) {
+            size_t bad = 0;
+            if (size_t n = utf8_sequence(s, i, bad)) { i += n; continue; }
+            out.append(s.data() + run, i - run);
+            out += "\xEF\xBF\xBD";
+            i += bad;
+            run = i;
+            continue;
         }
+        if (c >= 0x20 && c != '"' && c != '\\') { ++i; continue; }
+        out.append(s.data() + run, i - run);
+        run = ++i;
+        switch (c) {
+        case '"':  out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default: {
+            char buf[8];
+            std::snprintf(buf, sizeof buf, "\\u%04x", c);
+            out += buf;
+        }
+        }
+    }
+    out.append(s.data() + run, s.size() - run);
+}
+
+static void append_redacted_string(std::string &out, std::string_view s, uint32_t classes, RedactionCounts &counts) {
+    out += '"';
+    size_t last = 0;
+    if (classes) {
+        EntityScanner::scan(s, classes, [&](const EntitySpan &sp) {
+            // labels such as "Patient:" stay readable, only the value is masked
+            append_json_escaped(out, s.substr(last, sp.value_begin - last));
+            out += redaction_mask(sp.kind);
+            last = sp.value_end;
+            counts[(size_t)sp.kind]++;
+        });
+    }
+    append_json_escaped(out, s.substr(last));
+    out += '"';
+}
+
+// Serializes node compactly into out, masking the PII classes in `classes` (0 masks
+// nothing) and counting what was masked. With nothing masked the output equals
+// node.dump(-1, ' ', false, json::error_handler_t::replace).
+static void serialize_redacted(const json &node, uint32_t classes, std::string &out, RedactionCounts &counts) {
+    switch (node.type()) {
+    case json::value_t::object: {
+        out += '{';
+        bool first = true;
+        for (auto it = node.begin(); it != node.end(); ++it) {
+            if (!first) out += ',';
+            first = false;
+            out += '"';
+            append_json_escaped(out, it.key());
+            out += "\":";
+            serialize_redacted(it.value(), classes, out, counts);
+        }
+        out += '}';
+        break;
+    }
+    case json::value_t::array: {
+        out += '[';
+        bool first = true;
+        for (const auto &el : node) {
+            if (!first) out += ',';
+            first = false;
+            serialize_redacted(el, classes, out, counts);
+        }
+        out += ']';
+        break;
+    }
+    case json::value_t::string:
+        append_redacted_string(out, node.get_ref<const std::string &>(), classes, counts);
+        break;
+    default:
+        out += node.dump(); // numbers, booleans, null
+    }
+}
+
+static json redaction_counts_json(const RedactionCounts &counts, uint32_t classes) {
+    json o = json::object();
+    for (unsigned k = 0; k < (unsigned)Entity::Count; ++k)
+        if (classes & entity_bit((Entity)k)) o[entity_name((Entity)k)] = counts[k];
+    return o;
+}
+
+// ---------------- Cache ----------------
+static bool cache_load(const Config &cfg, const std::string &key, json &out) {
+    if (cfg.cache_dir.empty()) return false;
+    fs::create_directories(cfg.cache_dir);
+    std::string path = (fs::path(cfg.cache_dir) / (key + ".json")).string();
+    std::ifstream f(path);
+    if (!f) return false;
+    try {
+        out = json::parse(std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>()));
+        return true;
+    } catch (...) { return false; }
+}
+static void cache_store(const Config &cfg, const std::string &key, const json &val) {
+    if (cfg.cache_dir.empty()) return;
+    fs::create_directories(cfg.cache_dir);
+    std::string path = (fs::path(cfg.cache_dir) / (key + ".json")).string();
+    std::ofstream f(path);
+    if (f) f << val.dump();
+}
+
+// Cache key of one schema call. Covers whatever changes the answer: the backend
+// (endpoint or local model file, model name, dialect), the schema and the candidates,
+// so a cache directory can be shared between backends.
+static std::string model_cache_key(const Config &cfg, const DocTypeSpec &dt, const json &local) {
+    std::string endpoint = cfg.llama_model.empty() ? cfg.base_url : "llama:" + cfg.llama_model;
+    std::string cache_material = endpoint + "\n" + cfg.model + "\n" + std::to_string((int)cfg.dialect) + "\n" +
+                                 dt.id + "\n" + dt.schema.functions_json + "\n" + local.dump() +
+                                 (cfg.compactor ? "\ncompact\n" + std::to_string(cfg.compactor->fingerprint()) : "");
+    return std::to_string(fnv1a_64(cache_material));
+}
+
+// One request for several documents' calls (--coalesce). The reply is parsed once, by
+// whichever document is finished first, and each call takes its result out by id.
+// Billed and predicted usage are shared out in proportion to each document's own
+// predicted prompt. A call whose result is missing keeps its own request, so the
+// requeue pass can send it alone.
+struct CoalescedCall {
+    ModelRequest request;
+    ModelReply reply;                  // filled on the dispatcher thread
+    std::vector<long> weights;         // predicted prompt tokens of each document alone
+    std::vector<std::vector<uint32_t>> abbreviated; // each document's phrase abbreviations
+    bool parsed = false;               // main thread only from here on
+    std::optional<DocError> error;
+    std::unordered_map<std::string, json> results;
+
+    json take(const Config &cfg, size_t index, TokenUsage &usage) {
+        if (!parsed) {
+            parsed = true;
+            try {
+                json out = parse_model_reply(cfg, request, reply);
+                for (auto &r : out.value("results", json::array())) {
+                    if (!r.is_object() || !r.contains("id") || !r["id"].is_string()) continue;
+                    std::string id = r["id"].get<std::string>();
+                    r.erase("id");
+                    results.emplace(id, std::move(r));
+                }
+            } catch (const DocError &e) {
+                error = e;
+            }
+        }
+        if (error) throw *error;
+        auto it = results.find("d" + std::to_string(index));
+        if (it == results.end()) throw DocError("output", "Coalesced reply has no result for this document");
+        if (cfg.compactor && index < abbreviated.size()) {
+            expand_abbreviations(it->second, *cfg.compactor, abbreviated[index]);
+            abbreviated[index].clear();
+        }
+        long total = 0;
+        for (long w : weights) total += w;
+        double share = total > 0 ? (double)weights[index] / total : 1.0 / weights.size();
+        usage.predicted_prompt = std::lround(request.usage.predicted_prompt * share);
+        usage.prompt = std::lround(request.usage.prompt * share);
+        usage.cached = std::lround(request.usage.cached * share);
+        usage.completion = std::lround(request.usage.completion * share);
+        return it->second;
+    }
+};
+
+// One schema call for local candidates: answered from the cache when possible,
+// otherwise a request for the dispatcher.
+struct ModelCall {
+    json local;
+    std::string cache_key;
+    bool cached = false;
+    bool answered = false;     // result is final: cached, or a reply parsed without error
+    json result;               // model output, from the cache or the parsed reply
+    ModelRequest request;
+    ModelReply reply;          // filled on the dispatcher thread
+    std::shared_ptr<CoalescedCall> coalesced;  // sent with other documents; reply is not used
+    size_t coalesced_index = 0;
+};
+
+static ModelCall plan_model_call(const Config &cfg, const DocTypeSpec &dt, json local) {
+    ModelCall c;
+    c.local = std::move(local);
+    c.cache_key = model_cache_key(cfg, dt, c.local);
+    c.cached = c.answered = cache_load(cfg, c.cache_key, c.result);
+    if (!c.cached) c.request = build_model_request(cfg, dt, c.local, c.local.value("important_snippets", ""));
+    return c;
+}
+
+// ---------------- Map-reduce extraction ----------------
+// --chunked splits a long document into chunks of about --chunk-tokens tokens. Each
+// chunk with keyword hits gets its own ranked snippet and schema call (at most
+// --max-chunks, preferring the chunks with the most hit lines). The calls go out
+// together through the dispatcher, still paced by the shared limiter, and
+// reduce_partials() merges the partial JSONs deterministically in chunk order.
+static std::vector<LineRange> split_chunks(const DocText &doc, const Config &cfg) {
+    std::vector<LineRange> chunks;
+    LineRange cur;
+    size_t cost = 0;
+    for (size_t i = 0; i < doc.lines.size(); ++i) {
+        if (!doc.usable(i)) continue;
+        size_t c = count_tokens(cfg, doc.lines[i]) + 1;
+        if (cost + c > cfg.chunk_tokens && cost > 0) {
+            cur.end = i;
+            chunks.push_back(cur);
+            cur.begin = i;
+            cost = 0;
+        }
+        cost += c;
+    }
+    cur.end = doc.lines.size();
+    if (cost > 0) chunks.push_back(cur);
+    return chunks;
+}
+
+static std::string reduce_key(const json &v) {
+    if (!v.is_string()) return v.dump();
+    std::string out;
+    bool space = false;
+    for (unsigned char c : v.get<std::string>()) {
+        if (std::isspace(c)) { space = !out.empty(); continue; }
+        if (space) { out.push_back(' '); space = false; }
+        out.push_back((char)std::tolower(c));
+    }
+    return out;
+}
+
+// Per-schema reducer over partial results, in chunk order. The property type from the
+// doc type's schema (or the value's own type when the schema does not say) picks the
+// rule: arrays are unioned with case/whitespace-insensitive dedupe, numbers take the
+// max (confidence), strings take the most frequent value (earliest on ties), anything
+// else keeps the first value.
+static json reduce_partials(const DocTypeSpec &dt, const std::vector<json> &parts) {
+    json props = json::object();
+    if (dt.functions.size() == 1) props = dt.functions[0]["parameters"].value("properties", json::object());
+
+    std::vector<std::string> keys;
+    for (auto &p : parts) {
+        if (!p.is_object()) continue;
+        for (auto &kv : p.items()) if (std::find(keys.begin(), keys.end(), kv.key()) == keys.end()) keys.push_back(kv.key());
+    }
+
+    json out = json::object();
+    for (auto &k : keys) {
+        std::vector<const json *> vals;
+        for (auto &p : parts) if (p.is_object() && p.contains(k) && !p[k].is_null()) vals.push_back(&p[k]);
+        if (vals.empty()) continue;
+        std::string type = props.contains(k) ? props[k].value("type", "") : "";
+        if (type.empty()) type = vals[0]->is_array() ? "array" : vals[0]->is_number() ? "number" : vals[0]->is_string() ? "string" : "";
+
+        if (type == "array") {
+            json arr = json::array();
+            std::unordered_map<std::string, bool> seen;
+            for (auto *v : vals) {
+                if (!v->is_array()) continue;
+                for (auto &el : *v) if (seen.emplace(reduce_key(el), true).second) arr.push_back(el);
+            }
+            out[k] = arr;
+        } else if (type == "number" || type == "integer") {
+            const json *best = nullptr;
+            for (auto *v : vals) if (v->is_number() && (!best || v->get<double>() > best->get<double>())) best = v;
+            out[k] = best ? *best : *vals[0];
+        } else if (type == "string") {
+            std::unordered_map<std::string, int> freq;
+            for (auto *v : vals) if (v->is_string() && !v->get<std::string>().empty()) freq[reduce_key(*v)]++;
+            const json *best = nullptr;
+            int best_n = 0;
+            for (auto *v : vals) {
+                if (!v->is_string() || v->get<std::string>().empty()) continue;
+                int n = freq[reduce_key(*v)];
+                if (n > best_n) { best = v; best_n = n; }
+            }
+            out[k] = best ? *best : *vals[0];
+        } else {
+            out[k] = *vals[0];
+        }
+    }
+    return out;
+}
+
+// Candidates for each chunk call; empty when the document fits in one chunk, in which
+// case the caller makes the usual single call.
+static std::vector<json> chunk_locals(const DocText &doc, const DocTypeSpec &dt, const json &local, const Config &cfg) {
+    std::vector<LineRange> chunks = split_chunks(doc, cfg);
+    if (chunks.size() < 2) return {};
+
+    struct Part { size_t index; size_t hits; json local; };
+    std::vector<Part> work;
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        size_t hits = 0;
+        for (size_t i = chunks[c].begin; i < chunks[c].end; ++i)
+            if (!doc.boilerplate[i] && dt.snippet_matcher.any(doc.lines[i])) hits++;
+        if (!hits) continue;
+        std::pmr::vector<std::string_view> keep(doc.buf.get_allocator().resource());
+        select_ranked_windows(keep, doc, chunks[c], dt.snippet_matcher, cfg);
+        json part_local = local;
+        part_local["important_snippets"] = join_lines_budget(keep, doc, cfg);
+        part_local["chunk"] = std::to_string(c + 1) + "/" + std::to_string(chunks.size()) + " pages " +
+                              std::to_string(doc.page_of_line(chunks[c].begin) + 1) + "-" +
+                              std::to_string(doc.page_of_line(chunks[c].end - 1) + 1);
+        work.push_back({c, hits, std::move(part_local)});
+    }
+    if (work.size() < 2) return {};
+    if (work.size() > cfg.max_chunks) {
+        std::stable_sort(work.begin(), work.end(), [](const Part &a, const Part &b){ return a.hits > b.hits; });
+        work.resize(cfg.max_chunks);
+        std::sort(work.begin(), work.end(), [](const Part &a, const Part &b){ return a.index < b.index; });
+    }
+    std::vector<json> locals;
+    for (auto &w : work) locals.push_back(std::move(w.local));
+    return locals;
+}
+
+// ---------------- Near-duplicate reuse ----------------
+// 64-bit SimHash over word 3-shingles of the snippet text (lowercased, punctuation
+// dropped), so the same report faxed twice or re-scanned with a few OCR differences
+// lands within a few bits. The index splits signatures into radius+1 bands; by
+// pigeonhole any signature within the radius matches at least one band exactly, so
+// only those buckets are checked.
+static uint64_t snippet_simhash(std::string_view text) {
+    std::vector<uint64_t> words;
+    std::string w;
+    auto flush = [&]{ if (!w.empty()) { words.push_back(fnv1a_64(w)); w.clear(); } };
+    for (unsigned char c : text) {
+        if (std::isalnum(c)) w.push_back((char)std::tolower(c));
+        else flush();
+    }
+    flush();
+    if (words.empty()) return 0;
+
+    int weights[64] = {};
+    size_t shingles = words.size() >= 3 ? words.size() - 2 : 1;
+    for (size_t i = 0; i < shingles; ++i) {
+        uint64_t h = words[i];
+        for (size_t k = 1; k < 3 && i + k < words.size(); ++k) h = (h ^ words[i + k]) * 0x100000001b3ULL + k;
+        h ^= h >> 29; h *= 0xbf58476d1ce4e5b9ULL; h ^= h >> 32;
+        for (int b = 0; b < 64; ++b) weights[b] += (h >> b) & 1 ? 1 : -1;
+    }
+    uint64_t sig = 0;
+    for (int b = 0; b < 64; ++b) if (weights[b] > 0) sig |= 1ULL << b;
+    return sig;
+}
+
+// The filled-in part of a snippet: the values of labeled names, dates, phones, SSNs,
+// emails, MRNs and claim numbers, plus every token with a digit (IDs, amounts) or a
+// capital (unlabeled names). Two copies of one record share it; the same template
+// filled in for another person or claim does not, however close their SimHashes.
+static uint64_t identity_key(const json &local) {
+    std::string text = local.value("important_snippets", "");
+    for (const char *k : {"name_candidate", "date_candidate", "phone_candidate"}) {
+        if (local.contains(k) && local[k].is_string()) text += "\n" + local[k].get<std::string>();
+    }
+    std::vector<std::string> parts;
+    const uint32_t kinds = entity_bit(Entity::Name) | entity_bit(Entity::Date) | entity_bit(Entity::Phone) |
+                           entity_bit(Entity::Ssn) | entity_bit(Entity::Email) | entity_bit(Entity::Mrn) |
+                           entity_bit(Entity::Claim);
+    EntityScanner::scan(text, kinds, [&](const EntitySpan &sp) {
+        parts.push_back(to_lower(text.substr(sp.value_begin, sp.value_end - sp.value_begin)));
+    });
+    std::string w;
+    bool keep = false;
+    auto flush = [&]{
+        if (keep && !w.empty()) parts.push_back(w);
+        w.clear();
+        keep = false;
+    };
+    for (unsigned char c : text) {
+        if (is_trim_space((char)c)) { flush(); continue; }
+        if (!std::isalnum(c)) continue;   // "$1,250.00" and "1250.00" are the same amount
+        if (std::isdigit(c) || (w.empty() && std::isupper(c))) keep = true;
+        w.push_back((char)std::tolower(c));
+    }
+    flush();
+    std::sort(parts.begin(), parts.end());
+    parts.erase(std::unique(parts.begin(), parts.end()), parts.end());
+    std::string joined;
+    for (auto &p : parts) joined += p + '\n';
+    return fnv1a_64(joined);
+}
+
+// Answers are reused only between documents with the same identity_key(); a neighbour
+// within the radius that belongs to someone else is counted in rejected() and the
+// document gets its own model call.
+class NearDupIndex {
+public:
+    struct Hit { json model; std::string source; int distance; };
+
+    void configure(int radius) {
+        radius_ = radius;
+        bands_.assign(radius > 0 ? radius + 1 : 0, {});
+        width_ = radius > 0 ? 64 / (radius + 1) : 0;
+    }
+    bool enabled() const { return radius_ > 0; }
+
+    std::optional<Hit> find(const std::string &doc_type, uint64_t sig, uint64_t identity) const {
+        std::shared_lock<std::shared_mutex> lk(mu_);
+        const Entry *best = nullptr;
+        int best_d = radius_ + 1;
+        bool other_identity = false;
+        for (size_t b = 0; b < bands_.size(); ++b) {
+            auto it = bands_[b].find(band_key(sig, b));
+            if (it == bands_[b].end()) continue;
+            for (size_t e : it->second) {
+                const Entry &c = entries_[e];
+                int d = popcount64(c.sig ^ sig);
+                if (d > radius_ || c.doc_type != doc_type) continue;
+                if (c.identity != identity) { other_identity = true; continue; }
+                if (d < best_d) { best = &c; best_d = d; }
+            }
+        }
+        if (!best) {
+            if (other_identity) rejected_++;
+            return std::nullopt;
+        }
+        return Hit{best->model, best->source, best_d};
+    }
+
+    size_t rejected() const { return rejected_; }
+
+    void insert(const std::string &doc_type, uint64_t sig, uint64_t identity, const json &model, const std::string &source) {
+        std::unique_lock<std::shared_mutex> lk(mu_);
+        entries_.push_back({sig, identity, doc_type, model, source});
+        for (size_t b = 0; b < bands_.size(); ++b) bands_[b][band_key(sig, b)].push_back(entries_.size() - 1);
+    }
+
+private:
+    struct Entry { uint64_t sig; uint64_t identity; std::string doc_type; json model; std::string source; };
+
+    uint64_t band_key(uint64_t sig, size_t b) const {
+        return (sig >> (b * width_)) & ((1ULL << width_) - 1);
+    }
+
+    mutable std::shared_mutex mu_;
+    int radius_ = 0;
+    int width_ = 0;
+    std::vector<Entry> entries_;
+    std::vector<std::unordered_map<uint64_t, std::vector<size_t>>> bands_;
+    mutable std::atomic<size_t> rejected_{0};
+} near_dups;
+
+// ---------------- Document processing ----------------
+struct DocResult {
+    std::string input_path;
+    const DocTypeSpec *doc_type = nullptr;
+    std::string result_text;   // serialized result, PII already masked
+    bool ok = false;
+    std::string error;
+    std::string error_kind;    // DocError::kind; "" for other exceptions
+    long http_status = 0;
+    bool requeued = false;     // model stage failed once and was retried in the final pass
+    int pages = 0;
+    int chars_used = 0;
+    TokenUsage tokens;         // zero billed usage on cache hits
+    BoilerplateStats boilerplate;
+    bool near_duplicate = false; // model output reused from an earlier document
+    RedactionCounts redactions{};
+};
+
+static void add_usage(TokenUsage &to, const TokenUsage &u) {
+    to.predicted_prompt += u.predicted_prompt;
+    to.prompt += u.prompt;
+    to.cached += u.cached;
+    to.completion += u.completion;
+    to.snippet_raw += u.snippet_raw;
+    to.snippet_compact += u.snippet_compact;
+}
+
+// A document between its local stage and its model answers. prepare_document() runs
+// OCR and the local stage on a worker; the model calls go to the dispatcher; once the
+// last reply is in, finish_document() merges and serializes it. What the finish stage
+// needs is copied out of the per-document arena, which stays with the worker.
+struct DocJob {
+    size_t index = 0;                           // position in the input list
+    fs::path path;
+    DocResult r;                                // error set: failed before the model stage
+    const DocTypeSpec *dt = nullptr;
+    json local;
+    std::string preview;                        // --audit raw OCR preview
+    std::optional<TranscriptIndex> transcript;  // for checking model citations
+    bool near_dup_key = false;                  // sig is worth indexing
+    uint64_t sig = 0;
+    uint64_t identity = 0;
+    std::optional<NearDupIndex::Hit> dup;
+    std::vector<ModelCall> calls;               // one, or one per chunk with --chunked
+    int images = 0;
+    std::atomic<int> pending{0};                // calls still waiting for a reply
+};
+
+static std::unique_ptr<DocJob> prepare_document(const fs::path &path, const Config &cfg, const DocTypeRegistry &reg) {
+    auto job = std::make_unique<DocJob>();
+    job->path = path;
+    DocResult &r = job->r;
+    r.input_path = path.string();
+
+    try {
+        // Declared first so it outlives every per-document temporary below
+        DocArena arena(cfg.doc_arena);
+        std::pmr::memory_resource *mr = arena.resource();
+
+        std::vector<std::string> images;
+        std::pmr::vector<std::pmr::string> page_texts(mr);
+
+        if (is_pdf(path)) {
+            std::string tmpdir = (fs::temp_directory_path() / (path.stem().string() + "_ppm")).string();
+            images = pdf_to_images(path.string(), tmpdir);
+            if (images.empty()) throw DocError("ocr", "No pages produced from " + path.string());
+        } else if (is_image(path)) {
+            images.push_back(path.string());
+        } else {
+            throw DocError("ocr", "Unsupported file type: " + path.string());
+        }
+
+        int logical_pages = 0;
+        for (auto &img : images) logical_pages += ocr_image_path(img, cfg, page_texts);
+        if (page_texts.empty()) throw DocError("ocr", "OCR produced no text for " + path.string());
+
+        DocText doc(mr);
+        if (!cfg.normalize) doc.normalize.reset();
+        doc.assign_pages(page_texts);
+        r.pages = logical_pages;
+        job->images = (int)images.size();
+
+        LocalAnalysis analysis = analyze_document_text(doc, reg, cfg);
+        const DocTypeSpec &dt = *analysis.doc_type;
+        r.doc_type = job->dt = &dt;
+        r.boilerplate = analysis.boilerplate;
+        job->local = std::move(analysis.local);
+
+        const std::string snippet = job->local.value("important_snippets", "");
+        job->near_dup_key = near_dups.enabled() && !snippet.empty();
+        if (job->near_dup_key) {
+            job->sig = snippet_simhash(snippet);
+            job->identity = identity_key(job->local);
+            job->dup = near_dups.find(dt.id, job->sig, job->identity);
+        }
+        if (!job->dup) {
+            std::vector<json> parts;
+            if (cfg.chunked) parts = chunk_locals(doc, dt, job->local, cfg);
+            if (parts.empty()) parts.push_back(job->local);
+            for (auto &p : parts) job->calls.push_back(plan_model_call(cfg, dt, std::move(p)));
+        }
+
+        if (cfg.audit_raw_ocr) {
+            // keep only the first 4000 chars to avoid giant outputs
+            job->preview = preview_text(doc, 4000);
+        }
+        if (doc.transcript) job->transcript.emplace(*doc.transcript, std::pmr::new_delete_resource());
+        r.chars_used = (int)snippet.size();
+    } catch (const DocError &e) {
+        r.error = e.what();
+        r.error_kind = e.kind;
+    } catch (const std::exception &e) {
+        r.error = e.what();
+    } catch (...) {
+        r.error = "unknown error";
+    }
+    return job;
+}
+
+// Merges and serializes a job whose replies are all in. The job is left as it was
+// apart from its answered calls, so a failed model stage can be submitted again.
+static DocResult finish_document(DocJob &job, const Config &cfg) {
+    DocResult r = job.r;
+    if (!r.error.empty()) return r;
+
+    try {
+        const DocTypeSpec &dt = *job.dt;
+        json model;
+        if (job.dup) {
+            model = job.dup->model;
+            r.near_duplicate = true;
+        } else {
+            // parse every reply first, so one bad chunk does not hide the others' answers
+            std::optional<DocError> failure;
+            for (auto &c : job.calls) {
+                if (c.answered) continue;
+                try {
+                    c.result = c.coalesced ? c.coalesced->take(cfg, c.coalesced_index, c.request.usage)
+                                           : parse_model_reply(cfg, c.request, c.reply);
+                } catch (const DocError &e) {
+                    if (!failure) failure = e;
+                    continue;
+                }
+                c.answered = true;
+                cache_store(cfg, c.cache_key, c.result);
+                add_usage(job.r.tokens, c.request.usage);
+            }
+            r.tokens = job.r.tokens;
+            if (failure) throw *failure;
 
-        if (cfg.redact) redact_in_place(merged);
+            std::vector<json> parts;
+            for (auto &c : job.calls) parts.push_back(c.result);
+            model = parts.size() > 1 ? reduce_partials(dt, parts) : std::move(parts[0]);
+            if (job.near_dup_key) near_dups.insert(dt.id, job.sig, job.identity, model, job.path.filename().string());
+        }
+
+        json merged = merge_local_and_model(dt, job.local, model, job.transcript ? &*job.transcript : nullptr);
+        if (job.calls.size() > 1) merged["chunk_count"] = (int)job.calls.size();
+        if (job.dup) merged["near_duplicate_of"] = {{"source", job.dup->source}, {"distance_bits", job.dup->distance}};
+        merged["doc_type"] = dt.id;
+        merged["source"] = job.path.filename().string();
+        merged["page_count"] = r.pages;
+        if (r.pages > job.images) merged["condensed_sheets"] = (r.pages - job.images) / 3;
+        if (cfg.audit_raw_ocr) merged["raw_ocr_preview"] = job.preview;
 
-        r.chars_used = (int)local.value("important_snippets", "").size();
-        r.result_json = merged;
+        serialize_redacted(merged, cfg.redact_mask, r.result_text, r.redactions);
         r.ok = true;
+    } catch (const DocError &e) {
+        r.ok = false;
+        r.error = e.what();
+        r.error_kind = e.kind;
+        r.http_status = e.http_status;
     } catch (const std::exception &e) {
         r.ok = false;
         r.error = e.what();
@@ -790,13 +3900,406 @@ static DocResult process_single_document(const fs::path &path, const Config &cfg
     return r;
 }
 
+// Documents whose model replies are all in, for the main thread to finish
+class CompletionQueue {
+public:
+    void push(std::unique_ptr<DocJob> job) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            q_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+    std::unique_ptr<DocJob> pop() {
+        std::unique_lock<std::mutex> lk(mu_);
+        cv_.wait(lk, [&]{ return !q_.empty(); });
+        auto job = std::move(q_.front());
+        q_.pop_front();
+        return job;
+    }
+private:
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::unique_ptr<DocJob>> q_;
+};
+
+// Completion tokens assumed per request when reserving against --tpm; the API's
+// remaining-tokens header corrects the estimate.
+static constexpr long kCompletionReserve = 300;
+
+// Sends each of the job's unanswered calls as its own request; the last reply queues
+// the job, which the calls own until then.
+static void send_document(DocJob *j, LlmDispatcher &dispatcher, CompletionQueue &done) {
+    // The last reply can hand j to the main thread, which frees it, before submit()
+    // returns; after the last submit only the local list is touched.
+    std::vector<ModelCall *> calls;
+    for (auto &c : j->calls) {
+        if (c.answered) continue;
+        c.coalesced.reset();
+        calls.push_back(&c);
+    }
+    j->pending = (int)calls.size();
+    for (ModelCall *call : calls) {
+        dispatcher.submit(call->request.body, call->request.usage.predicted_prompt + kCompletionReserve, [j, call, &done](ModelReply &&reply) {
+            call->reply = std::move(reply);
+            if (--j->pending == 0) done.push(std::unique_ptr<DocJob>(j));
+        });
+    }
+}
+
+// Groups small documents of the same doc type into one request (--coalesce). A group is
+// sent when it has --coalesce documents, or when its first document has waited
+// --coalesce-wait ms; flush() sends whatever is held, e.g. once OCR has finished. A
+// group of one goes out as a normal request.
+class Coalescer {
+public:
+    Coalescer(const Config &cfg, LlmDispatcher &dispatcher, CompletionQueue &done)
+        : cfg_(cfg), dispatcher_(dispatcher), done_(done) {}
+
+    void start() {
+        if (cfg_.coalesce) thread_ = std::thread([this]{ run(); });
+    }
+
+    // Sends everything still held
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        if (thread_.joinable()) thread_.join();
+        flush();
+    }
+
+    // A single small call of a doc type that has a coalesced schema. Requeued jobs
+    // go alone.
+    bool accepts(const DocJob &job) const {
+        if (!cfg_.coalesce || job.r.requeued || job.calls.size() != 1 || job.dt->coalesced.func_name.empty()) return false;
+        const ModelCall &c = job.calls[0];
+        return !c.answered && c.request.document_tokens <= cfg_.coalesce_tokens;
+    }
+
+    void add(std::unique_ptr<DocJob> job) {
+        std::vector<DocJob *> full;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            Group &g = groups_[job->dt];
+            if (g.jobs.empty()) g.deadline = Clock::now() + std::chrono::milliseconds(cfg_.coalesce_wait_ms);
+            g.jobs.push_back(job.release());
+            if ((int)g.jobs.size() >= cfg_.coalesce) full.swap(g.jobs);
+        }
+        if (!full.empty()) send(std::move(full));
+        else cv_.notify_one();
+    }
+
+    void flush() {
+        for (auto &jobs : take_groups(Clock::time_point::max())) send(std::move(jobs));
+    }
+
+    json stats() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return {{"requests", requests_}, {"documents", documents_}};
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    struct Group {
+        std::vector<DocJob *> jobs;
+        Clock::time_point deadline;
+    };
+
+    // Groups due by the given time, taken out
+    std::vector<std::vector<DocJob *>> take_groups(Clock::time_point due) {
+        std::lock_guard<std::mutex> lk(mu_);
+        std::vector<std::vector<DocJob *>> out;
+        for (auto &[dt, g] : groups_) {
+            if (g.jobs.empty() || g.deadline > due) continue;
+            out.push_back(std::move(g.jobs));
+            g.jobs.clear();
+        }
+        return out;
+    }
+
+    void run() {
+        for (;;) {
+            for (auto &jobs : take_groups(Clock::now())) send(std::move(jobs));
+            std::unique_lock<std::mutex> lk(mu_);
+            if (stop_) return;
+            auto next = Clock::time_point::max();
+            for (auto &[dt, g] : groups_) if (!g.jobs.empty()) next = std::min(next, g.deadline);
+            if (next == Clock::time_point::max()) cv_.wait(lk);
+            else cv_.wait_until(lk, next);
+        }
+    }
+
+    void send(std::vector<DocJob *> jobs) {
+        if (jobs.size() == 1) {
+            send_document(jobs[0], dispatcher_, done_);
+            return;
+        }
+        auto cc = std::make_shared<CoalescedCall>();
+        std::vector<const ModelRequest *> docs;
+        for (DocJob *j : jobs) {
+            docs.push_back(&j->calls[0].request);
+            cc->weights.push_back(j->calls[0].request.usage.predicted_prompt);
+            cc->abbreviated.push_back(j->calls[0].request.abbreviated);
+        }
+        cc->request = build_coalesced_request(cfg_, *jobs[0]->dt, docs);
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            jobs[i]->calls[0].coalesced = cc;
+            jobs[i]->calls[0].coalesced_index = i;
+            jobs[i]->pending = 1;
+        }
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            requests_++;
+            documents_ += jobs.size();
+        }
+        long tokens = cc->request.usage.predicted_prompt + kCompletionReserve * (long)jobs.size();
+        dispatcher_.submit(cc->request.body, tokens, [cc, jobs, &done = done_](ModelReply &&reply) {
+            cc->reply = std::move(reply);
+            for (DocJob *j : jobs) {
+                j->pending = 0;
+                done.push(std::unique_ptr<DocJob>(j));
+            }
+        });
+    }
+
+    const Config &cfg_;
+    LlmDispatcher &dispatcher_;
+    CompletionQueue &done_;
+    std::thread thread_;
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    std::unordered_map<const DocTypeSpec *, Group> groups_;
+    bool stop_ = false;
+    size_t requests_ = 0, documents_ = 0;
+};
+
+// Hands the job's unanswered calls to the coalescer when it takes them, otherwise to
+// the dispatcher. Jobs with nothing to send are queued right away.
+static void submit_document(std::unique_ptr<DocJob> job, LlmDispatcher &dispatcher, CompletionQueue &done,
+                            Coalescer *coalescer = nullptr) {
+    int n = 0;
+    for (auto &c : job->calls) n += !c.answered;
+    if (!job->r.error.empty() || job->dup || n == 0) {
+        done.push(std::move(job));
+        return;
+    }
+    if (coalescer && coalescer->accepts(*job)) {
+        coalescer->add(std::move(job));
+        return;
+    }
+    send_document(job.release(), dispatcher, done);
+}
+
+// ---------------- Offline batch ----------------
+// Phase one (--batch-out) writes each unanswered call as a line of the provider's batch
+// input format and the prepared documents to a state file; phase two (--batch-in)
+// rebuilds the jobs from the state file with each call's reply taken from the batch
+// results, so they finish exactly like documents answered over the dispatcher.
+// custom_id is the call's cache key: stable across runs, and identical requests from
+// different documents are sent once.
+static std::string batch_custom_id(const ModelCall &c) { return "lop-" + c.cache_key; }
+
+static json usage_json(const TokenUsage &u) {
+    return {{"predicted_prompt", u.predicted_prompt}, {"snippet_raw", u.snippet_raw}, {"snippet_compact", u.snippet_compact}};
+}
+
+static json batch_job_state(const DocJob &job) {
+    json d;
+    d["source"] = job.r.input_path;
+    d["pages"] = job.r.pages;
+    d["images"] = job.images;
+    d["chars_used"] = job.r.chars_used;
+    d["boilerplate"] = {{"lines", job.r.boilerplate.lines}, {"chars", job.r.boilerplate.chars},
+                        {"tokens", job.r.boilerplate.tokens}};
+    if (!job.r.error.empty()) {
+        d["error"] = job.r.error;
+        d["error_kind"] = job.r.error_kind;
+        return d;
+    }
+    d["doc_type"] = job.dt->id;
+    d["local"] = job.local;
+    if (!job.preview.empty()) d["preview"] = job.preview;
+    if (job.transcript) d["transcript"] = job.transcript->to_json();
+    json calls = json::array();
+    for (auto &c : job.calls) {
+        json cj = {{"custom_id", batch_custom_id(c)}, {"cache_key", c.cache_key}, {"local", c.local}};
+        if (c.answered) cj["result"] = c.result;
+        else cj["request"] = {{"abbreviated", c.request.abbreviated}, {"usage", usage_json(c.request.usage)}};
+        calls.push_back(cj);
+    }
+    d["calls"] = calls;
+    return d;
+}
+
+// Writes the batch input and the state file; returns the number of requests written.
+static size_t write_batch(const Config &cfg, const std::vector<std::unique_ptr<DocJob>> &jobs, const std::string &state_path) {
+    std::ofstream out(cfg.batch_out);
+    if (!out) die("Cannot open batch output: " + cfg.batch_out);
+    std::unordered_map<std::string, bool> written;
+    json docs = json::array();
+    for (auto &job : jobs) {
+        for (auto &c : job->calls) {
+            if (c.answered || !written.emplace(batch_custom_id(c), true).second) continue;
+            out << "{\"custom_id\":\"" << batch_custom_id(c) << "\",\"method\":\"POST\",\"url\":\"/v1/chat/completions\",\"body\":"
+                << c.request.body << "}\n";
+        }
+        docs.push_back(batch_job_state(*job));
+    }
+    if (!out) die("Failed writing batch output: " + cfg.batch_out);
+
+    std::ofstream st(state_path);
+    if (!st) die("Cannot open batch state: " + state_path);
+    st << json{{"version", 1}, {"model", cfg.model}, {"doc_types", cfg.doctypes_path}, {"documents", docs}}.dump();
+    if (!st) die("Failed writing batch state: " + state_path);
+    return written.size();
+}
+
+// custom_id -> reply. Lines that cannot be read are skipped with a warning; their
+// documents then fail with a "batch" error.
+static std::unordered_map<std::string, ModelReply> load_batch_results(const std::string &path) {
+    std::ifstream in(path);
+    if (!in) die("Cannot open batch results: " + path);
+    std::unordered_map<std::string, ModelReply> replies;
+    std::string line;
+    size_t n = 0;
+    while (std::getline(in, line)) {
+        ++n;
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+        try {
+            json j = json::parse(line);
+            ModelReply reply;
+            reply.attempts = 1;
+            const json &resp = j.contains("response") ? j["response"] : json();
+            if (resp.is_object()) {
+                reply.http_code = resp.value("status_code", 0L);
+                reply.body = resp.contains("body") ? resp["body"].dump() : std::string();
+            } else {
+                const json &err = j.contains("error") ? j["error"] : json();
+                reply.error_kind = "batch";
+                reply.error = "batch error";
+                if (err.is_object()) reply.error += " " + err.value("code", std::string()) + ": " + err.value("message", std::string());
+            }
+            replies[j.at("custom_id").get<std::string>()] = std::move(reply);
+        } catch (const std::exception &e) {
+            std::cerr << "Warning: skipping batch results line " << n << ": " << e.what() << "\n";
+        }
+    }
+    return replies;
+}
+
+// Jobs from the state file, in input order, their calls answered from the results
+static std::vector<std::unique_ptr<DocJob>> load_batch_jobs(const Config &cfg, const DocTypeRegistry &reg) {
+    if (cfg.batch_state.empty()) die("--batch-in needs --batch-state (written next to --batch-out)");
+    std::ifstream in(cfg.batch_state);
+    if (!in) die("Cannot open batch state: " + cfg.batch_state);
+    json state;
+    try {
+        state = json::parse(in);
+    } catch (const std::exception &e) {
+        die("Invalid batch state " + cfg.batch_state + ": " + e.what());
+    }
+    if (state.value("model", cfg.model) != cfg.model)
+        std::cerr << "Warning: batch state was written for model " << state.value("model", "") << "\n";
+    auto replies = load_batch_results(cfg.batch_in);
+
+    std::vector<std::unique_ptr<DocJob>> jobs;
+    try {
+        for (auto &d : state.at("documents")) {
+            auto job = std::make_unique<DocJob>();
+            job->index = jobs.size();
+            job->path = d.at("source").get<std::string>();
+            DocResult &r = job->r;
+            r.input_path = job->path.string();
+            r.pages = d.value("pages", 0);
+            r.chars_used = d.value("chars_used", 0);
+            job->images = d.value("images", 0);
+            if (d.contains("boilerplate")) {
+                r.boilerplate.lines = d["boilerplate"].value("lines", (size_t)0);
+                r.boilerplate.chars = d["boilerplate"].value("chars", (size_t)0);
+                r.boilerplate.tokens = d["boilerplate"].value("tokens", (size_t)0);
+            }
+            if (d.contains("error")) {
+                r.error = d["error"].get<std::string>();
+                r.error_kind = d.value("error_kind", "");
+                jobs.push_back(std::move(job));
+                continue;
+            }
+            const std::string type = d.at("doc_type").get<std::string>();
+            job->dt = reg.find(type);
+            if (!job->dt) die("Batch state uses doc type \"" + type + "\", which is not loaded; pass the same --doctypes");
+            r.doc_type = job->dt;
+            job->local = d.at("local");
+            job->preview = d.value("preview", "");
+            if (d.contains("transcript")) {
+                job->transcript.emplace(std::pmr::new_delete_resource());
+                job->transcript->from_json(d["transcript"]);
+            }
+            for (auto &cj : d.at("calls")) {
+                ModelCall c;
+                c.local = cj.at("local");
+                c.cache_key = cj.at("cache_key").get<std::string>();
+                if (cj.contains("result")) {
+                    c.cached = c.answered = true;
+                    c.result = cj["result"];
+                } else {
+                    const json &rq = cj.at("request");
+                    c.request.abbreviated = rq.at("abbreviated").get<std::vector<uint32_t>>();
+                    const json &u = rq.at("usage");
+                    c.request.usage.predicted_prompt = u.value("predicted_prompt", 0L);
+                    c.request.usage.snippet_raw = u.value("snippet_raw", 0L);
+                    c.request.usage.snippet_compact = u.value("snippet_compact", 0L);
+                    auto it = replies.find(cj.at("custom_id").get<std::string>());
+                    if (it != replies.end()) {
+                        c.reply = it->second;
+                    } else {
+                        c.reply.error_kind = "batch";
+                        c.reply.error = "no result for " + cj["custom_id"].get<std::string>() + " in " + cfg.batch_in;
+                    }
+                }
+                job->calls.push_back(std::move(c));
+            }
+            jobs.push_back(std::move(job));
+        }
+    } catch (const json::exception &e) {
+        die("Invalid batch state " + cfg.batch_state + ": " + e.what());
+    }
+    return jobs;
+}
+
 // ---------------- Main ----------------
+#ifndef LEGAL_OCR_NO_MAIN
 int main(int argc, char** argv) {
     Config cfg = parse_cli(argc, argv);
+    const DocTypeRegistry reg = load_doc_registry(cfg.doctypes_path);
+    BpeTokenizer tokenizer;
+    if (!cfg.tokenizer_path.empty()) {
+        if (!tokenizer.load(cfg.tokenizer_path)) die("Cannot load tokenizer: " + cfg.tokenizer_path);
+        cfg.tokenizer = &tokenizer;
+    } else if (cfg.max_tokens) {
+        std::cerr << "Warning: --max-tokens without --tokenizer, estimating tokens from characters\n";
+    }
+    CompactOptions compact_opt;
+    compact_opt.keep_newlines = true; // snippet windows are separated by lines
+    TextCompactor compactor(compact_opt);
+    if (cfg.abbrev_path.empty()) compactor.load_abbreviations_text(kBuiltinAbbreviations);
+    else if (!compactor.load_abbreviations(cfg.abbrev_path)) die("Cannot read abbreviations: " + cfg.abbrev_path);
+    if (cfg.compact_prompt) cfg.compactor = &compactor;
+    if (!cfg.redact_classes.empty()) cfg.redact_mask = parse_redact_classes(cfg.redact_classes);
+    near_dups.configure(cfg.near_dup_bits);
+    limiter.configure(cfg.rpm, cfg.tpm);
     curl_global_init(CURL_GLOBAL_ALL);
+    http_pool.init();
 
     std::vector<fs::path> inputs;
-    if (fs::is_directory(cfg.input_path)) {
+    std::vector<std::unique_ptr<DocJob>> ingested;   // --batch-in
+    if (!cfg.batch_in.empty()) {
+        ingested = load_batch_jobs(cfg, reg);
+        for (auto &job : ingested) inputs.push_back(job->path);
+        if (inputs.empty()) die("Batch state has no documents");
+    } else if (fs::is_directory(cfg.input_path)) {
         for (auto &entry : fs::directory_iterator(cfg.input_path)) {
             if (!entry.is_regular_file()) continue;
             if (is_pdf(entry.path()) || is_image(entry.path())) inputs.push_back(entry.path());
@@ -807,11 +4310,10 @@ int main(int argc, char** argv) {
         inputs.push_back(cfg.input_path);
     }
 
-    std::mutex io_mu;
     std::vector<DocResult> results(inputs.size());
     std::atomic<size_t> idx{0};
 
-    int thread_count = std::min<int>(cfg.threads, (int)inputs.size());
+    int thread_count = ingested.empty() ? std::min<int>(cfg.threads, (int)inputs.size()) : 0;
     std::vector<std::thread> workers;
     workers.reserve(thread_count);
 
@@ -827,7 +4329,7 @@ int main(int argc, char** argv) {
         fs::path p = r.input_path;
         fs::path outp = p.parent_path() / (p.stem().string() + ".extracted.json");
         std::ofstream f(outp);
-        if (f) f << r.result_json.dump();
+        if (f) f << r.result_text;
     };
 
     auto write_jsonl = [&](const DocResult &r){
@@ -835,60 +4337,187 @@ int main(int argc, char** argv) {
         json one;
         one["ok"] = r.ok;
         one["source"] = r.input_path;
-        one["doc_type"] = doc_type_str(r.doc_type);
+        one["doc_type"] = r.doc_type ? r.doc_type->id : reg.unknown.id;
         one["page_count"] = r.pages;
-        if (r.ok) one["data"] = r.result_json;
-        else one["error"] = r.error;
-        (*jsonl_stream) << one.dump() << "\n";
+        if (!r.ok) one["error"] = r.error;
+        if (!r.error_kind.empty()) one["error_kind"] = r.error_kind;
+        if (r.http_status) one["http_status"] = r.http_status;
+        if (r.requeued) one["requeued"] = true;
+        one["tokens"] = {{"predicted_prompt", r.tokens.predicted_prompt}, {"billed_prompt", r.tokens.prompt},
+                         {"cached_prompt", r.tokens.cached},
+                         {"billed_completion", r.tokens.completion}};
+        if (cfg.compactor) {
+            one["tokens"]["snippet_before_compact"] = r.tokens.snippet_raw;
+            one["tokens"]["snippet_after_compact"] = r.tokens.snippet_compact;
+        }
+        if (cfg.redact_mask) one["redactions"] = redaction_counts_json(r.redactions, cfg.redact_mask);
+        // "data" sorts first, so the serialized result is spliced in after the brace
+        std::string line = one.dump();
+        if (r.ok) line.insert(1, "\"data\":" + r.result_text + ",");
+        (*jsonl_stream) << line << "\n";
         jsonl_stream->flush();
     };
 
+    const bool batch = !cfg.batch_out.empty() || !cfg.batch_in.empty();
+    LlmDispatcher dispatcher;
+    if (!batch) dispatcher.start(cfg);
+    CompletionQueue completed;
+    Coalescer coalescer(cfg, dispatcher, completed);
+    if (!batch) coalescer.start();
+    std::atomic<int> active_workers{thread_count};
+
+    // Workers only run OCR and the local stage; model replies come back through the queue
     auto worker = [&](){
         while (true) {
             size_t i = idx.fetch_add(1);
             if (i >= inputs.size()) break;
-            DocResult r = process_single_document(inputs[i], cfg);
-            {
-                std::lock_guard<std::mutex> lk(io_mu);
-                results[i] = std::move(r);
-                write_per_file(results[i]);
-                write_jsonl(results[i]);
-                std::cout << "[" << i+1 << "/" << inputs.size() << "] "
-                          << fs::path(results[i].input_path).filename().string()
-                          << " -> " << (results[i].ok ? "OK" : "ERR") << "\n";
-            }
+            auto job = prepare_document(inputs[i], cfg, reg);
+            job->index = i;
+            if (cfg.batch_out.empty()) submit_document(std::move(job), dispatcher, completed, &coalescer);
+            else completed.push(std::move(job));
         }
+        // no more documents are coming, so partial groups need not wait out their timeout
+        if (--active_workers == 0) coalescer.flush();
     };
 
     for (int t = 0; t < thread_count; ++t) workers.emplace_back(worker);
+    for (auto &job : ingested) completed.push(std::move(job));
+
+    if (!cfg.batch_out.empty()) {
+        std::vector<std::unique_ptr<DocJob>> jobs(inputs.size());
+        for (size_t n = 1; n <= inputs.size(); ++n) {
+            auto job = completed.pop();
+            std::cout << "[" << n << "/" << inputs.size() << "] " << job->path.filename().string()
+                      << " -> " << (job->r.error.empty() ? "prepared" : "ERR") << "\n";
+            jobs[job->index] = std::move(job);
+        }
+        for (auto &th : workers) th.join();
+        std::string state_path = fs::path(cfg.batch_out).replace_extension(".state.json").string();
+        size_t requests = write_batch(cfg, jobs, state_path);
+        std::cout << "Batch requests written: " << cfg.batch_out << " (" << requests << ")\n"
+                  << "Batch state written: " << state_path << "\n";
+        http_pool.cleanup();
+        curl_global_cleanup();
+        return 0;
+    }
+
+    // Documents whose model stage failed in a retryable way are held back (not written)
+    // and submitted once more after everything else has finished.
+    std::vector<std::unique_ptr<DocJob>> failed;
+    size_t finished = 0;
+    auto finish = [&](std::unique_ptr<DocJob> job, bool can_requeue){
+        DocResult r = finish_document(*job, cfg);
+        if (!r.ok && can_requeue && retryable_failure(r.error_kind, r.http_status)) {
+            std::cout << "[requeue] " << job->path.filename().string() << ": " << r.error << "\n";
+            failed.push_back(std::move(job));
+            return;
+        }
+        results[job->index] = std::move(r);
+        const DocResult &out = results[job->index];
+        write_per_file(out);
+        write_jsonl(out);
+        std::cout << "[" << ++finished << "/" << inputs.size() << "] "
+                  << fs::path(out.input_path).filename().string()
+                  << " -> " << (out.ok ? "OK" : "ERR") << "\n";
+    };
+
+    for (size_t n = 0; n < inputs.size(); ++n) finish(completed.pop(), !batch);
+    if (!failed.empty()) {
+        std::cout << "Retrying the model stage of " << failed.size() << " document(s)\n";
+        size_t n = failed.size();
+        for (auto &job : failed) {
+            job->r.requeued = true;
+            submit_document(std::move(job), dispatcher, completed);
+        }
+        failed.clear();
+        for (size_t k = 0; k < n; ++k) finish(completed.pop(), false);
+    }
     for (auto &th : workers) th.join();
+    coalescer.stop();
+    dispatcher.stop();
+    json rate_limit = limiter.to_json();
+    rate_limit.update(dispatcher.stats());
+    json local_inference = dispatcher.local_stats();
 
     // Combined JSON
     json out;
     out["generated_at"] = (long long)std::time(nullptr);
     out["model"] = cfg.model;
-    out["documents"] = json::array();
     out["errors"] = json::array();
+    std::string documents = "[";
+    size_t ok_count = 0;
+    RedactionCounts total_redactions{};
 
     size_t total_chars = 0;
+    size_t near_duplicates = 0;
+    size_t requeued = 0, recovered = 0;
+    TokenUsage total_tokens;
+    BoilerplateStats total_boilerplate;
     for (auto &r : results) {
+        total_boilerplate.lines += r.boilerplate.lines;
+        total_boilerplate.chars += r.boilerplate.chars;
+        total_boilerplate.tokens += r.boilerplate.tokens;
+        total_tokens.predicted_prompt += r.tokens.predicted_prompt;
+        total_tokens.prompt += r.tokens.prompt;
+        total_tokens.cached += r.tokens.cached;
+        total_tokens.completion += r.tokens.completion;
+        total_tokens.snippet_raw += r.tokens.snippet_raw;
+        total_tokens.snippet_compact += r.tokens.snippet_compact;
+        if (r.near_duplicate) near_duplicates++;
+        if (r.requeued) { requeued++; recovered += r.ok; }
+        for (size_t k = 0; k < total_redactions.size(); ++k) total_redactions[k] += r.redactions[k];
         if (r.ok) {
-            out["documents"].push_back(r.result_json);
+            if (ok_count++) documents += ',';
+            documents += r.result_text;
             total_chars += r.chars_used;
         } else {
-            out["errors"].push_back({{"source", r.input_path}, {"error", r.error}});
+            json e = {{"source", r.input_path}, {"error", r.error}};
+            if (!r.error_kind.empty()) e["kind"] = r.error_kind;
+            if (r.http_status) e["http_status"] = r.http_status;
+            out["errors"].push_back(e);
         }
     }
     out["stats"] = {
         {"processed", results.size()},
-        {"ok", out["documents"].size()},
+        {"ok", ok_count},
         {"errors", out["errors"].size()},
-        {"avg_snippet_chars", out["documents"].size() ? (int)(total_chars / std::max<size_t>(1, out["documents"].size())) : 0}
+        {"avg_snippet_chars", ok_count ? (int)(total_chars / ok_count) : 0},
+        {"near_duplicates_reused", near_duplicates},
+        {"near_duplicates_other_identity", near_dups.rejected()},
+        {"requeued", requeued},
+        {"recovered_on_requeue", recovered},
+        {"coalesced", coalescer.stats()},
+        {"http", http_pool.stats.to_json()},
+        {"rate_limit", rate_limit},
+        {"tokens", {
+            {"tokenizer", cfg.tokenizer ? cfg.tokenizer->name() : std::string("estimate")},
+            {"predicted_prompt", total_tokens.predicted_prompt},
+            {"billed_prompt", total_tokens.prompt},
+            {"cached_prompt", total_tokens.cached},
+            {"cache_hit_ratio", total_tokens.prompt ? std::round(1000.0 * total_tokens.cached / total_tokens.prompt) / 1000 : 0.0},
+            {"billed_completion", total_tokens.completion}
+        }},
+        {"boilerplate_removed", {
+            {"lines", total_boilerplate.lines},
+            {"chars", total_boilerplate.chars},
+            {"tokens", total_boilerplate.tokens}
+        }}
     };
+    if (cfg.compactor) {
+        out["stats"]["tokens"]["snippet_before_compact"] = total_tokens.snippet_raw;
+        out["stats"]["tokens"]["snippet_after_compact"] = total_tokens.snippet_compact;
+    }
+    if (cfg.redact_mask) out["stats"]["redactions"] = redaction_counts_json(total_redactions, cfg.redact_mask);
+    if (!local_inference.is_null()) out["stats"]["local_inference"] = local_inference;
+    documents += ']';
+
+    // "documents" sorts first; splice the already serialized results in after the brace
+    std::string combined = out.dump();
+    combined.insert(1, "\"documents\":" + documents + ",");
 
     std::ofstream f(cfg.output_json);
     if (!f) die("Failed to open output file");
-    f << out.dump();
+    f << combined;
     f.close();
 
     if (jsonl_stream && *jsonl_stream) {
@@ -896,6 +4525,8 @@ int main(int argc, char** argv) {
     }
     std::cout << "Combined JSON written: " << cfg.output_json << "\n";
 
+    http_pool.cleanup();
     curl_global_cleanup();
     return 0;
 }
+#endif // LEGAL_OCR_NO_MAIN
@@ -0,0 +1,223 @@
+// Regression tests for legal_ocr_pro's local stages. No OCR or network; documents are
+// built in memory. Exits non-zero when a check fails.
+//
+// Build (one command):
+// g++ -std=c++17 -O2 -pthread -o legal_ocr_test legal_ocr_test.cpp
+//   -ltesseract -llept -lopencv_core -lopencv_imgproc -lopencv_imgcodecs -lcurl
+// With -DLEGAL_OCR_WITH_LLAMA and -lllama, local_small_ctx also runs the model in
+// LEGAL_OCR_TEST_GGUF.
+//
+// Usage:
+// ./legal_ocr_test [TEST|all]
+
+#define LEGAL_OCR_NO_MAIN
+#include "legal_ocr_pro.cpp"
+
+#include <cstdio>
+#include <set>
+
+static int g_failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { std::printf("  FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond); g_failures++; } \
+} while (0)
+
+// ---------------- near-dup: same template, different people ----------------
+// A no-fault intake form filled in for two claimants. The boilerplate dominates the
+// SimHash, so the two land within the radius; the second must not get the first
+// claimant's answer. A rescan of the first form (lowercase OCR noise) still reuses it.
+static std::string intake_form(const std::string &name, const std::string &dob, const std::string &claim,
+                               const std::string &amount, const std::string &noise = "") {
+    std::string t = "NO-FAULT APPLICATION FOR BENEFITS. Patient: " + name + " DOB: " + dob + " Claim no. " + claim + "\n";
+    for (int i = 0; i < 6; ++i) {
+        t += "the applicant must complete every section of this form and return it within thirty days of the "
+             "accident to the insurer named above together with any bills and records of treatment received " +
+             noise + "\n";
+    }
+    t += "Amount claimed: $" + amount + "\n";
+    return t;
+}
+
+static void test_near_dup_identity() {
+    near_dups.configure(15);
+    json a = {{"important_snippets", intake_form("John Smith", "01/02/1980", "NF-2024-1001", "1,250.00")}};
+    json b = {{"important_snippets", intake_form("Maria Lopez", "07/19/1991", "NF-2024-7730", "980.00")}};
+    json a_rescan = {{"important_snippets", intake_form("John Smith", "01/02/1980", "NF-2024-1001", "1250.00", "recieved")}};
+
+    uint64_t sa = snippet_simhash(a["important_snippets"].get<std::string>());
+    uint64_t sb = snippet_simhash(b["important_snippets"].get<std::string>());
+    uint64_t sr = snippet_simhash(a_rescan["important_snippets"].get<std::string>());
+    CHECK(popcount64(sa ^ sb) <= 15);   // otherwise the case below proves nothing
+    CHECK(popcount64(sa ^ sr) <= 15);
+
+    json model_a = {{"patient_name", "John Smith"}, {"claim_number", "NF-2024-1001"}, {"confidence", 0.9}};
+    near_dups.insert("no_fault", sa, identity_key(a), model_a, "a.pdf");
+
+    CHECK(identity_key(a) != identity_key(b));
+    CHECK(!near_dups.find("no_fault", sb, identity_key(b)));
+    CHECK(near_dups.rejected() == 1);
+
+    auto hit = near_dups.find("no_fault", sr, identity_key(a_rescan));
+    CHECK(hit && hit->model == model_a && hit->source == "a.pdf");
+    near_dups.configure(0);
+}
+
+// ---------------- compact-prompt: only introduced abbreviations expand ----------------
+// "MRI" is in the source (and is also what the compactor makes of "magnetic resonance
+// imaging"); "history of present illness" becomes HPI only through the compactor.
+// Only HPI is expanded, and only in free text, not in a one-word field.
+static void test_abbreviation_expansion() {
+    CompactOptions opt;
+    opt.keep_newlines = true;
+    TextCompactor compactor(opt);
+    compactor.load_abbreviations_text(kBuiltinAbbreviations);
+    Config cfg;
+    cfg.compactor = &compactor;
+    const DocTypeRegistry reg = load_doc_registry("");
+    const DocTypeSpec &dt = *reg.find("imaging_report");
+
+    ModelRequest mr = build_model_request(cfg, dt, json::object(),
+        "MRI of the lumbar spine. Technique: magnetic resonance imaging without contrast.\n"
+        "History of present illness: low back pain after MVA.");
+    CHECK(mr.document.find("HPI") != std::string::npos);
+    CHECK(mr.document.find("magnetic") == std::string::npos); // abbreviated to MRI too
+
+    json answer = {{"study_type", "MRI"}, {"patient_name", "HPI"},
+                   {"impression", {"MRI shows L4-L5 herniation. HPI: low back pain."}}};
+    ModelReply reply;
+    reply.http_code = 200;
+    reply.body = json({{"choices", {{{"message", {{"content", answer.dump()}}}}}}}).dump();
+    json out = parse_model_reply(cfg, mr, reply);
+    CHECK(out["study_type"] == "MRI");
+    CHECK(out["patient_name"] == "HPI");
+    CHECK(out["impression"][0] == "MRI shows L4-L5 herniation. history of present illness: low back pain.");
+}
+
+// ---------------- cache key: one per backend ----------------
+// The same candidates sent to another endpoint, model, dialect or local model file must
+// not be answered from each other's cache entries (or share a batch custom_id).
+static void test_cache_key_backend() {
+    const DocTypeRegistry reg = load_doc_registry("");
+    const DocTypeSpec &dt = *reg.find("imaging_report");
+    json local = {{"important_snippets", "IMPRESSION: L4-L5 disc herniation."}};
+    Config base;
+    std::vector<Config> variants(4, base);
+    variants[0].base_url = "http://127.0.0.1:8080/v1";
+    variants[1].model = "gpt-4o";
+    variants[2].dialect = Dialect::Tools;
+    variants[3].llama_model = "/models/qwen2.5-3b-instruct-q4_k_m.gguf";
+    std::set<std::string> keys = {model_cache_key(base, dt, local)};
+    for (auto &v : variants) keys.insert(model_cache_key(v, dt, local));
+    CHECK(keys.size() == variants.size() + 1);
+    CHECK(model_cache_key(base, dt, local) == model_cache_key(base, dt, local));
+}
+
+// ---------------- cache key: abbreviation table contents ----------------
+// An edited --abbrev file at the same path must not serve answers to prompts that were
+// compacted with the old table.
+static void test_cache_key_abbreviations() {
+    const DocTypeRegistry reg = load_doc_registry("");
+    const DocTypeSpec &dt = *reg.find("medical_record");
+    json local = {{"important_snippets", "History of present illness: neck pain."}};
+    TextCompactor before, same, edited;
+    before.load_abbreviations_text("history of present illness\tHPI\n");
+    same.load_abbreviations_text("history of present illness\tHPI\n");
+    edited.load_abbreviations_text("history of present illness\tH/PI\n");
+    Config cfg;
+    cfg.abbrev_path = "abbreviations.tsv";
+    cfg.compactor = &before;
+    std::string key = model_cache_key(cfg, dt, local);
+    cfg.compactor = &same;
+    CHECK(model_cache_key(cfg, dt, local) == key);
+    cfg.compactor = &edited;
+    CHECK(model_cache_key(cfg, dt, local) != key);
+}
+
+// ---------------- redacted serializer: invalid UTF-8 ----------------
+// OCR and model text can hold invalid UTF-8. The streaming serializer must write what
+// json::dump() writes with the replace handler (U+FFFD), never the raw bytes.
+static void test_serialize_invalid_utf8() {
+    auto check = [](const std::string &text) {
+        json doc = {{"text", text}, {"k\xff", {text, 1, nullptr}}};
+        std::string out;
+        RedactionCounts counts{};
+        serialize_redacted(doc, 0, out, counts);
+        CHECK(out == doc.dump(-1, ' ', false, json::error_handler_t::replace));
+        bool valid = true;
+        try { (void)json::parse(out); } catch (...) { valid = false; }
+        CHECK(valid);
+    };
+    check("Pat\xe9 Jane, DOB 04/12/1979");           // Latin-1 byte from OCR
+    check("\xc3\xa9t\xc3 \xe2\x82 \xf0\x9f\x98\x80 \xed\xa0\x80 \xc0\xaf end\xe2\x82");
+    check("caf\xc3\xa9 \"quoted\" \\ \t\x01");
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> byte(0, 255), len(0, 24);
+    for (int n = 0; n < 2000; ++n) {
+        std::string text;
+        for (int k = len(rng); k > 0; --k) text += (char)byte(rng);
+        std::string out;
+        RedactionCounts counts{};
+        serialize_redacted(json(text), 0, out, counts);
+        if (out != json(text).dump(-1, ' ', false, json::error_handler_t::replace)) { CHECK(!"random bytes differ from dump()"); break; }
+    }
+}
+
+#ifdef LEGAL_OCR_WITH_LLAMA
+// ---------------- local model: several doc types in a small context ----------------
+// Each doc type leaves its system/schema prefix in the worker's KV cache. With a small
+// --llama-ctx the prefixes of earlier types must give way, not fill the cache. Needs a
+// GGUF model in LEGAL_OCR_TEST_GGUF; skipped without one.
+static void test_local_small_ctx() {
+    const char *gguf = std::getenv("LEGAL_OCR_TEST_GGUF");
+    if (!gguf) { std::printf("  skipped (LEGAL_OCR_TEST_GGUF not set)\n"); return; }
+    Config cfg;
+    cfg.llama_model = gguf;
+    cfg.llama_ctx = 1536;
+    cfg.llama_workers = 1;
+    const DocTypeRegistry reg = load_doc_registry("");
+    LocalLlm llm;
+    llm.start(cfg);
+    json local = {{"important_snippets", "Patient: DOE, JANE  DOB: 04/12/1979\nImpression: lumbar strain."}};
+    for (int round = 0; round < 2; ++round) {
+        for (auto &dt : reg.types) {
+            ModelRequest mr = build_model_request(cfg, dt, local, local["important_snippets"].get<std::string>());
+            std::promise<ModelReply> p;
+            llm.submit(mr.body, [&p](ModelReply &&r) { p.set_value(std::move(r)); });
+            ModelReply reply = p.get_future().get();
+            if (!reply.error.empty()) std::printf("  %s: %s\n", dt.id.c_str(), reply.error.c_str());
+            CHECK(reply.error.empty() && reply.http_code == 200);
+        }
+    }
+    json st = llm.stats();
+    llm.stop();
+    CHECK(st["requests"] == 2 * reg.types.size());
+}
+#endif
+
+// ---------------- Main ----------------
+int main(int argc, char **argv) {
+    std::string which = argc > 1 ? argv[1] : "all";
+    struct Test { const char *name; void (*fn)(); };
+    const Test tests[] = {
+        {"near_dup_identity", test_near_dup_identity},
+        {"abbreviation_expansion", test_abbreviation_expansion},
+        {"cache_key_backend", test_cache_key_backend},
+        {"cache_key_abbreviations", test_cache_key_abbreviations},
+        {"serialize_invalid_utf8", test_serialize_invalid_utf8},
+#ifdef LEGAL_OCR_WITH_LLAMA
+        {"local_small_ctx", test_local_small_ctx},
+#endif
+    };
+    bool ran = false;
+    for (auto &t : tests) {
+        if (which != "all" && which != t.name) continue;
+        std::printf("== %s\n", t.name);
+        int before = g_failures;
+        t.fn();
+        std::printf("  %s\n", g_failures == before ? "ok" : "FAILED");
+        ran = true;
+    }
+    if (!ran) die("Unknown test: " + which);
+    return g_failures ? 1 : 0;
+}
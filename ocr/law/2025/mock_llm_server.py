@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+"""Local stand-in for an OpenAI-compatible chat/completions server.
+
+Used to benchmark and test legal_ocr_pro without API costs:
+
+    python3 mock_llm_server.py --port=8089 --latency-ms=400 --error-rate=0.02
+    ./legal_ocr_pro docs/ - out.json --base-url=http://127.0.0.1:8089/v1 --auth=none
+
+Answers in the dialect of the request: function_call for "functions", tool_calls
+for "tools", JSON content for a "response_format" schema. The arguments come from
+--responses (a JSON object keyed by function name) or are filled in from the
+function's parameter schema. Coalesced requests (a "results" array of items with an
+"id") get one item per "### <id>" line of the user message. Keep-alive HTTP/1.1, one
+thread per connection.
+
+Options:
+  --port=8089            listen port (127.0.0.1)
+  --latency-ms=300       mean latency per request
+  --jitter-ms=100        latency is uniform in mean +/- jitter
+  --error-rate=0.0       fraction of requests answered with 500
+  --throttle-rate=0.0    fraction answered with 429 and Retry-After
+  --retry-after=1        Retry-After seconds sent with 429
+  --rpm=0                requests per minute; above it 429, and x-ratelimit-* headers are sent
+  --tpm=0                tokens per minute, likewise
+  --responses=FILE       canned arguments: {"function_name": {...}, ...}
+  --cache-min-tokens=1024  prompt cache: a prompt prefix seen before, in 128-token blocks
+                         and at least this long, is reported as usage.prompt_tokens_details
+                         .cached_tokens; 0 disables
+  --seed=1               random seed for latency and errors
+
+GET /stats returns the counters as JSON.
+"""
+
+import http.server
+import json
+import random
+import re
+import socketserver
+import sys
+import threading
+import time
+from collections import deque
+
+
+def parse_args(argv):
+    opts = {"port": 8089, "latency-ms": 300.0, "jitter-ms": 100.0, "error-rate": 0.0,
+            "throttle-rate": 0.0, "retry-after": 1.0, "rpm": 0.0, "tpm": 0.0,
+            "responses": "", "seed": 1, "cache-min-tokens": 1024}
+    for a in argv:
+        if not a.startswith("--") or "=" not in a:
+            sys.exit("Unknown argument: " + a)
+        key, val = a[2:].split("=", 1)
+        if key not in opts:
+            sys.exit("Unknown option: --" + key)
+        opts[key] = type(opts[key])(val)
+    return opts
+
+
+OPTS = parse_args(sys.argv[1:])
+CANNED = json.load(open(OPTS["responses"])) if OPTS["responses"] else {}
+RNG = random.Random(OPTS["seed"])
+LOCK = threading.Lock()
+STATS = {"requests": 0, "ok": 0, "errors": 0, "throttled": 0, "prompt_tokens": 0, "completion_tokens": 0,
+         "cached_tokens": 0}
+WINDOW = deque()  # (time, tokens) of the last minute, for --rpm/--tpm
+CACHE = set()     # hashes of prompt prefixes seen, whole 128-token blocks
+
+
+def sample_value(name, schema):
+    t = schema.get("type", "string")
+    if "enum" in schema:
+        return schema["enum"][0]
+    if t == "number":
+        return 0.9
+    if t == "integer":
+        return 1
+    if t == "boolean":
+        return False
+    if t == "array":
+        return []
+    if t == "object":
+        return {k: sample_value(k, v) for k, v in schema.get("properties", {}).items()}
+    return "mock " + name
+
+
+def answer_args(name, params, user_text):
+    if name in CANNED:
+        return CANNED[name]
+    props = params.get("properties", {})
+    items = props.get("results", {}).get("items", {})
+    if "id" in items.get("properties", {}):
+        return {"results": [dict(sample_value("result", items), id=i)
+                            for i in re.findall(r"^### (\S+)$", user_text, re.M)]}
+    return {k: sample_value(k, v) for k, v in props.items()}
+
+
+def find_function(req):
+    """(dialect, function name, parameter schema) requested."""
+    if "response_format" in req:
+        js = req["response_format"].get("json_schema", {})
+        return "json", js.get("name", "extract"), js.get("schema", {})
+    if "tools" in req:
+        fns = [t["function"] for t in req["tools"]]
+        choice = req.get("tool_choice", {})
+        want = choice.get("function", {}).get("name") if isinstance(choice, dict) else None
+        dialect = "tools"
+    else:
+        fns = req.get("functions", [])
+        choice = req.get("function_call", {})
+        want = choice.get("name") if isinstance(choice, dict) else None
+        dialect = "functions"
+    fn = next((f for f in fns if f.get("name") == want), fns[0] if fns else {"name": "extract"})
+    return dialect, fn.get("name", "extract"), fn.get("parameters", {})
+
+
+def cached_tokens(req):
+    """Prompt tokens a provider-side prefix cache would serve. The prompt is rendered
+    schema first, then the messages in order; tokens are bytes / 4. Call under LOCK."""
+    if not OPTS["cache-min-tokens"]:
+        return 0
+    schema = {k: req[k] for k in ("functions", "tools", "response_format") if k in req}
+    text = json.dumps(schema, sort_keys=True) + "".join(
+        "<%s>%s" % (m.get("role", ""), m.get("content") or "") for m in req.get("messages", []))
+    block = 128 * 4
+    hit = 0
+    for k in range(1, len(text) // block + 1):
+        key = hash(text[:k * block])
+        if key in CACHE and hit == k - 1:
+            hit = k
+        CACHE.add(key)
+    tokens = hit * block // 4
+    return tokens if tokens >= OPTS["cache-min-tokens"] else 0
+
+
+def rate_limit(now, tokens):
+    """(allowed, headers) under --rpm/--tpm over a sliding minute."""
+    if not OPTS["rpm"] and not OPTS["tpm"]:
+        return True, {}
+    while WINDOW and WINDOW[0][0] < now - 60:
+        WINDOW.popleft()
+    used_req = len(WINDOW)
+    used_tok = sum(t for _, t in WINDOW)
+    ok = (not OPTS["rpm"] or used_req + 1 <= OPTS["rpm"]) and (not OPTS["tpm"] or used_tok + tokens <= OPTS["tpm"])
+    if ok:
+        WINDOW.append((now, tokens))
+        used_req += 1
+        used_tok += tokens
+    headers = {}
+    if OPTS["rpm"]:
+        headers["x-ratelimit-limit-requests"] = str(int(OPTS["rpm"]))
+        headers["x-ratelimit-remaining-requests"] = str(max(0, int(OPTS["rpm"]) - used_req))
+    if OPTS["tpm"]:
+        headers["x-ratelimit-limit-tokens"] = str(int(OPTS["tpm"]))
+        headers["x-ratelimit-remaining-tokens"] = str(max(0, int(OPTS["tpm"]) - used_tok))
+    return ok, headers
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def send(self, code, body, headers=None):
+        data = json.dumps(body).encode()
+        self.send_response(code)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        for k, v in (headers or {}).items():
+            self.send_header(k, v)
+        self.end_headers()
+        self.wfile.write(data)
+
+    def do_GET(self):
+        if self.path.rstrip("/").endswith("/stats"):
+            with LOCK:
+                self.send(200, dict(STATS))
+        else:
+            self.send(404, {"error": {"message": "not found"}})
+
+    def do_POST(self):
+        raw = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        if not self.path.rstrip("/").endswith("/chat/completions"):
+            self.send(404, {"error": {"message": "not found"}})
+            return
+        try:
+            req = json.loads(raw)
+        except ValueError:
+            self.send(400, {"error": {"message": "invalid JSON body"}})
+            return
+        prompt_tokens = len(raw) // 4
+
+        with LOCK:
+            STATS["requests"] += 1
+            roll = RNG.random()
+            delay = max(0.0, OPTS["latency-ms"] + RNG.uniform(-OPTS["jitter-ms"], OPTS["jitter-ms"])) / 1000
+            allowed, headers = rate_limit(time.time(), prompt_tokens)
+            if not allowed or roll < OPTS["throttle-rate"]:
+                STATS["throttled"] += 1
+                outcome = 429
+            elif roll < OPTS["throttle-rate"] + OPTS["error-rate"]:
+                STATS["errors"] += 1
+                outcome = 500
+            else:
+                outcome = 200
+
+        if outcome == 429:
+            headers["retry-after"] = str(OPTS["retry-after"])
+            self.send(429, {"error": {"message": "Rate limit reached (mock)", "type": "requests"}}, headers)
+            return
+        time.sleep(delay)
+        if outcome == 500:
+            self.send(500, {"error": {"message": "The server had an error (mock)"}}, headers)
+            return
+
+        dialect, name, params = find_function(req)
+        user_text = "\n".join(m.get("content") or "" for m in req.get("messages", []) if m.get("role") == "user")
+        args = json.dumps(answer_args(name, params, user_text), separators=(",", ":"))
+        completion_tokens = len(args) // 4 + 1
+        if dialect == "functions":
+            message = {"role": "assistant", "content": None, "function_call": {"name": name, "arguments": args}}
+        elif dialect == "tools":
+            message = {"role": "assistant", "content": None, "tool_calls": [
+                {"id": "call_mock", "type": "function", "function": {"name": name, "arguments": args}}]}
+        else:
+            message = {"role": "assistant", "content": args}
+        with LOCK:
+            STATS["ok"] += 1
+            STATS["prompt_tokens"] += prompt_tokens
+            STATS["completion_tokens"] += completion_tokens
+            cached = min(cached_tokens(req), prompt_tokens)
+            STATS["cached_tokens"] += cached
+        self.send(200, {
+            "id": "chatcmpl-mock", "object": "chat.completion", "created": int(time.time()),
+            "model": req.get("model", "mock"),
+            "choices": [{"index": 0, "message": message, "finish_reason": "stop"}],
+            "usage": {"prompt_tokens": prompt_tokens, "completion_tokens": completion_tokens,
+                      "total_tokens": prompt_tokens + completion_tokens,
+                      "prompt_tokens_details": {"cached_tokens": cached}},
+        }, headers)
+
+    def log_message(self, *args):
+        pass
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    request_queue_size = 256
+
+
+if __name__ == "__main__":
+    print("mock LLM server on http://127.0.0.1:%d/v1" % OPTS["port"], flush=True)
+    Server(("127.0.0.1", OPTS["port"]), Handler).serve_forever()
@@ -0,0 +1,520 @@
+// text_compactor.hpp
+// Word-level prompt compactor, grown out of processText() in ocr-enhanced.cpp:
+// whitespace cleanup, comma removal, word and phrase abbreviations, and the lossy
+// phonetic shortening of long words (drop every vowel after the first).
+//
+// Used by ocr-enhanced.cpp and by legal_ocr_pro's --compact-prompt stage. Header only,
+// no dependencies beyond the standard library.
+//
+// The guard (on by default) keeps facts intact: words that contain a digit or an
+// uppercase letter (names, case captions, MRNs, dates, dosages) are never shortened
+// phonetically and keep their commas ("DOE, JANE", "1,250.00").
+//
+// Text is processed in one streaming pass (CompactStream): input can arrive in chunks
+// of any size and output is appended as soon as each word is complete (or, for a
+// possible phrase, as soon as the longest match is decided), so multi-GB transcript
+// dumps run in constant memory.
+
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// ---------------- Perfect hash map ----------------
+// Static string map with a collision-free hash (hash and displace). Keys are grouped
+// into buckets by one hash; each bucket then gets the first seed that sends all of its
+// keys to free slots. A lookup is two hashes and a single key compare.
+template <class V>
+class PerfectHashMap {
+public:
+    // Later duplicates of a key replace earlier ones.
+    void build(std::vector<std::pair<std::string, V>> items) {
+        items_.clear();
+        std::vector<size_t> idx(items.size());
+        for (size_t i = 0; i < idx.size(); ++i) idx[i] = i;
+        std::stable_sort(idx.begin(), idx.end(), [&](size_t a, size_t b) { return items[a].first < items[b].first; });
+        for (size_t k = 0; k < idx.size(); ++k) {
+            if (k + 1 < idx.size() && items[idx[k + 1]].first == items[idx[k]].first) continue;
+            items_.push_back(std::move(items[idx[k]]));
+        }
+
+        const size_t n = items_.size();
+        nbuckets_ = n / 4 + 1;
+        nslots_ = n + n / 4 + 1;
+        seeds_.assign(nbuckets_, 0);
+        slots_.assign(nslots_, -1);
+
+        std::vector<std::vector<uint32_t>> buckets(nbuckets_);
+        for (uint32_t i = 0; i < n; ++i) buckets[hash(items_[i].first, 0) % nbuckets_].push_back(i);
+        std::vector<uint32_t> by_size(nbuckets_);
+        for (uint32_t b = 0; b < nbuckets_; ++b) by_size[b] = b;
+        std::stable_sort(by_size.begin(), by_size.end(),
+                         [&](uint32_t a, uint32_t b) { return buckets[a].size() > buckets[b].size(); });
+
+        std::vector<uint32_t> placed;
+        for (uint32_t b : by_size) {
+            if (buckets[b].empty()) break;
+            for (uint32_t seed = 1;; ++seed) {
+                placed.clear();
+                bool ok = true;
+                for (uint32_t i : buckets[b]) {
+                    uint32_t s = (uint32_t)(hash(items_[i].first, seed) % nslots_);
+                    if (slots_[s] >= 0 || std::find(placed.begin(), placed.end(), s) != placed.end()) { ok = false; break; }
+                    placed.push_back(s);
+                }
+                if (!ok) continue;
+                for (size_t k = 0; k < placed.size(); ++k) slots_[placed[k]] = (int32_t)buckets[b][k];
+                seeds_[b] = seed;
+                break;
+            }
+        }
+    }
+
+    const V *find(std::string_view key) const {
+        if (items_.empty()) return nullptr;
+        uint32_t seed = seeds_[hash(key, 0) % nbuckets_];
+        int32_t i = slots_[hash(key, seed) % nslots_];
+        if (i < 0 || items_[i].first != key) return nullptr;
+        return &items_[i].second;
+    }
+
+    size_t size() const { return items_.size(); }
+
+private:
+    static uint64_t hash(std::string_view s, uint64_t seed) {
+        uint64_t h = 1469598103934665603ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+        for (unsigned char c : s) { h ^= c; h *= 1099511628211ULL; }
+        h ^= h >> 31; h *= 0xbf58476d1ce4e5b9ULL; h ^= h >> 29;
+        return h;
+    }
+
+    std::vector<std::pair<std::string, V>> items_;
+    std::vector<uint32_t> seeds_;
+    std::vector<int32_t> slots_;
+    size_t nbuckets_ = 1, nslots_ = 1;
+};
+
+// ---------------- Phrase trie ----------------
+// Word-level trie for multi-word abbreviations ("history of present illness" -> HPI).
+// Words are interned through a perfect hash and edges are (node, word id) pairs, so a
+// step is two lookups. Phrases match case-insensitively.
+class PhraseTrie {
+public:
+    static constexpr uint32_t npos = ~0u;
+
+    // phrases: lowercase words separated by single spaces; a later duplicate wins.
+    void build(const std::vector<std::string> &phrases) {
+        std::unordered_map<std::string, uint32_t> ids;
+        std::vector<std::vector<std::string>> split(phrases.size());
+        for (size_t p = 0; p < phrases.size(); ++p) {
+            size_t i = 0;
+            const std::string &s = phrases[p];
+            while (i < s.size()) {
+                size_t j = s.find(' ', i);
+                if (j == std::string::npos) j = s.size();
+                split[p].push_back(s.substr(i, j - i));
+                ids.emplace(split[p].back(), (uint32_t)ids.size());
+                i = j + 1;
+            }
+        }
+        vocab_.build(std::vector<std::pair<std::string, uint32_t>>(ids.begin(), ids.end()));
+
+        next_.clear();
+        terminal_.assign(1, -1);
+        fanout_.assign(1, 0);
+        for (size_t p = 0; p < split.size(); ++p) {
+            uint32_t node = 0;
+            for (auto &w : split[p]) {
+                uint64_t edge = ((uint64_t)node << 32) | *vocab_.find(w);
+                auto it = next_.find(edge);
+                if (it == next_.end()) {
+                    it = next_.emplace(edge, (uint32_t)terminal_.size()).first;
+                    terminal_.push_back(-1);
+                    fanout_.push_back(0);
+                    fanout_[node]++;
+                }
+                node = it->second;
+            }
+            if (node) terminal_[node] = (int32_t)p;
+        }
+    }
+
+    bool empty() const { return next_.empty(); }
+
+    uint32_t step(uint32_t node, std::string_view word_lower) const {
+        const uint32_t *id = vocab_.find(word_lower);
+        if (!id) return npos;
+        auto it = next_.find(((uint64_t)node << 32) | *id);
+        return it == next_.end() ? npos : it->second;
+    }
+    int32_t phrase_at(uint32_t node) const { return terminal_[node]; }
+    bool has_children(uint32_t node) const { return fanout_[node] > 0; }
+
+private:
+    PerfectHashMap<uint32_t> vocab_;
+    std::unordered_map<uint64_t, uint32_t> next_;
+    std::vector<int32_t> terminal_;
+    std::vector<uint32_t> fanout_;
+};
+
+// ---------------- Compactor ----------------
+struct CompactOptions {
+    bool abbreviate = true;
+    bool phonetic = true;       // lossy; see shorten_phonetically()
+    bool guard = true;          // no phonetic step or comma removal on names and numbers
+    bool keep_newlines = false; // keep line breaks (one per run) instead of folding to spaces
+};
+
+class TextCompactor {
+public:
+    explicit TextCompactor(CompactOptions opt = {}) : opt_(opt) {
+        entries_ = {{"example", "ex"}, {"information", "info"}, {"approximate", "approx"}};
+        rebuild();
+    }
+
+    // A key with spaces is a phrase: matched longest-first, case-insensitively, across
+    // line breaks, and reversible with expand_phrases(). Single words match their exact
+    // alphanumeric core.
+    void add_abbreviation(std::string word, std::string abbr) {
+        add_entry(std::move(word), std::move(abbr));
+        rebuild();
+    }
+
+    // Abbreviation table, one "word or phrase<TAB>abbreviation" per line; blank lines and
+    // lines starting with '#' are skipped. Entries add to (and override) the built-in ones.
+    bool load_abbreviations(const std::string &path) {
+        std::ifstream f(path);
+        if (!f) return false;
+        std::stringstream ss;
+        ss << f.rdbuf();
+        load_abbreviations_text(ss.str());
+        return true;
+    }
+
+    void load_abbreviations_text(std::string_view text) {
+        size_t i = 0;
+        while (i < text.size()) {
+            size_t j = text.find('\n', i);
+            if (j == std::string_view::npos) j = text.size();
+            std::string_view line = text.substr(i, j - i);
+            i = j + 1;
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (line.empty() || line[0] == '#') continue;
+            size_t tab = line.find('\t');
+            if (tab == std::string_view::npos || tab == 0) continue;
+            add_entry(std::string(line.substr(0, tab)), std::string(line.substr(tab + 1)));
+        }
+        rebuild();
+    }
+
+    const CompactOptions &options() const { return opt_; }
+    size_t abbreviation_count() const { return abbr_.size() + phrases_.size(); }
+    const PhraseTrie &phrases() const { return trie_; }
+    // Hash of the options and the whole abbreviation table: equal fingerprints compact
+    // the same text the same way (for cache keys).
+    uint64_t fingerprint() const { return fingerprint_; }
+    const std::string &phrase_abbreviation(uint32_t p) const { return phrases_[p].second; }
+
+    // Removes a letter from a 7+ letter word while keeping phonetic similarity:
+    // every vowel after the first is dropped.
+    static std::string shorten_phonetically(std::string_view word) {
+        std::string result;
+        append_phonetic(word, result);
+        return result;
+    }
+
+    static bool is_space(unsigned char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+    static bool is_alnum(unsigned char c) {
+        return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+    }
+
+    // Names and numbers: any digit or uppercase letter.
+    static bool is_guarded(std::string_view word) {
+        for (unsigned char c : word) if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z')) return true;
+        return false;
+    }
+
+    // Bounds of the alphanumeric core of a token: punctuation before b and from e on.
+    static void core_bounds(std::string_view w, size_t &b, size_t &e) {
+        b = 0;
+        e = w.size();
+        while (b < e && !is_alnum((unsigned char)w[b])) ++b;
+        while (e > b && !is_alnum((unsigned char)w[e - 1])) --e;
+    }
+
+    // used, when given, receives the phrase indices that were abbreviated.
+    std::string compact(std::string_view in, std::vector<uint32_t> *used = nullptr) const;
+
+    // Reverses the phrase abbreviations listed in used (whole-word matches only), e.g.
+    // "HPI" back to "history of present illness" in the model's answer.
+    std::string expand_phrases(std::string_view text, const std::vector<uint32_t> &used) const {
+        if (used.empty()) return std::string(text);
+        std::string out;
+        out.reserve(text.size());
+        size_t i = 0;
+        while (i < text.size()) {
+            if (!is_alnum((unsigned char)text[i])) { out.push_back(text[i++]); continue; }
+            size_t j = i;
+            while (j < text.size() && is_alnum((unsigned char)text[j])) ++j;
+            std::string_view tok = text.substr(i, j - i);
+            const std::string *full = nullptr;
+            for (uint32_t p : used) if (phrases_[p].second == tok) { full = &phrases_[p].first; break; }
+            out.append(full ? std::string_view(*full) : tok);
+            i = j;
+        }
+        return out;
+    }
+
+    // Drops from used the phrases whose abbreviation the original text already contains
+    // as a whole word ("MRI" written by the author), so expand_phrases() keeps those as is.
+    void keep_introduced(std::string_view original, std::vector<uint32_t> &used) const {
+        std::unordered_set<std::string_view> words;
+        size_t i = 0;
+        while (i < original.size()) {
+            if (!is_alnum((unsigned char)original[i])) { ++i; continue; }
+            size_t j = i;
+            while (j < original.size() && is_alnum((unsigned char)original[j])) ++j;
+            words.insert(original.substr(i, j - i));
+            i = j;
+        }
+        used.erase(std::remove_if(used.begin(), used.end(),
+                                  [&](uint32_t p) { return words.count(phrases_[p].second) > 0; }),
+                   used.end());
+    }
+
+    // Appends the compacted form of one whitespace-free token.
+    void append_word(std::string_view raw, std::string &out) const {
+        const bool guarded = opt_.guard && is_guarded(raw);
+
+        // Remove commas; guarded words keep them ("DOE, JANE", "1,250.00")
+        std::string_view w = raw;
+        std::string no_commas;
+        if (!guarded && raw.find(',') != std::string_view::npos) {
+            for (char c : raw) if (c != ',') no_commas.push_back(c);
+            w = no_commas;
+        }
+
+        // Rewrite only the alphanumeric core; surrounding punctuation stays as is
+        size_t b, e;
+        core_bounds(w, b, e);
+        if (b == e) { out.append(w); return; }
+        out.append(w.substr(0, b));
+        std::string_view core = w.substr(b, e - b);
+
+        if (opt_.abbreviate) {
+            if (const std::string *a = abbr_.find(core)) core = *a;
+        }
+        if (opt_.phonetic && !guarded) append_phonetic(core, out);
+        else out.append(core);
+        out.append(w.substr(e));
+    }
+
+private:
+    static bool is_vowel(char c) {
+        switch (c) { case 'a': case 'e': case 'i': case 'o': case 'u':
+                     case 'A': case 'E': case 'I': case 'O': case 'U': return true; }
+        return false;
+    }
+    static void append_phonetic(std::string_view word, std::string &out) {
+        if (word.size() < 7) { out.append(word); return; }
+        bool first_vowel = true;
+        for (char c : word) {
+            if (is_vowel(c)) {
+                if (first_vowel) {
+                    out.push_back(c);
+                    first_vowel = false;
+                }
+            } else {
+                out.push_back(c);
+            }
+        }
+    }
+
+    void add_entry(std::string key, std::string abbr) {
+        if (key.find(' ') == std::string::npos) { entries_.emplace_back(std::move(key), std::move(abbr)); return; }
+        std::string norm;
+        for (char c : key) {
+            if (c == ' ') { if (!norm.empty() && norm.back() != ' ') norm.push_back(' '); }
+            else norm.push_back((char)std::tolower((unsigned char)c));
+        }
+        while (!norm.empty() && norm.back() == ' ') norm.pop_back();
+        phrases_.emplace_back(std::move(norm), std::move(abbr));
+    }
+
+    void rebuild() {
+        abbr_.build(entries_);
+        std::vector<std::string> keys;
+        for (auto &p : phrases_) keys.push_back(p.first);
+        trie_.build(keys);
+
+        uint64_t h = 1469598103934665603ULL;
+        auto mix = [&h](std::string_view s) {
+            for (unsigned char c : s) { h ^= c; h *= 1099511628211ULL; }
+            h ^= 0xff; h *= 1099511628211ULL;   // separator, so "ab"+"c" != "a"+"bc"
+        };
+        const char flags[] = {char('0' + opt_.abbreviate), char('0' + opt_.phonetic), char('0' + opt_.guard),
+                              char('0' + opt_.keep_newlines)};
+        mix(std::string_view(flags, sizeof flags));
+        for (auto &e : entries_) { mix(e.first); mix(e.second); }
+        mix("phrases");
+        for (auto &p : phrases_) { mix(p.first); mix(p.second); }
+        fingerprint_ = h;
+    }
+
+    CompactOptions opt_;
+    std::vector<std::pair<std::string, std::string>> entries_;
+    std::vector<std::pair<std::string, std::string>> phrases_; // normalized phrase, abbreviation
+    PerfectHashMap<std::string> abbr_;
+    PhraseTrie trie_;
+    uint64_t fingerprint_ = 0;
+};
+
+// Incremental driver: feed() any slice of the input, the output grows by every word
+// completed so far; a word split across slices is carried over. finish() flushes the
+// rest. Words that may still begin a phrase wait in a window no longer than the
+// longest phrase, so memory is bounded by that and the longest word, not the input.
+class CompactStream {
+public:
+    explicit CompactStream(const TextCompactor &c) : c_(c) {}
+
+    void feed(std::string_view data, std::string &out) {
+        size_t i = 0;
+        const size_t n = data.size();
+        if (!carry_.empty()) {
+            while (i < n && !TextCompactor::is_space((unsigned char)data[i])) ++i;
+            carry_.append(data.substr(0, i));
+            if (i == n) return;
+            push(carry_, out);
+            carry_.clear();
+        }
+        while (i < n) {
+            unsigned char c = (unsigned char)data[i];
+            if (TextCompactor::is_space(c)) {
+                if (c == '\n' && c_.options().keep_newlines) pending_ = '\n';
+                else if (!pending_) pending_ = ' ';
+                ++i;
+                continue;
+            }
+            size_t j = i;
+            while (j < n && !TextCompactor::is_space((unsigned char)data[j])) ++j;
+            if (j == n) { carry_.assign(data.substr(i)); return; }
+            push(data.substr(i, j - i), out);
+            i = j;
+        }
+    }
+
+    void finish(std::string &out) {
+        if (!carry_.empty()) push(carry_, out);
+        carry_.clear();
+        resolve(true, out);
+        pending_ = 0;
+    }
+
+    // Phrase indices abbreviated so far, in first-use order.
+    const std::vector<uint32_t> &used() const { return used_; }
+
+private:
+    struct Held { std::string word; char sep; };
+
+    void push(std::string_view word, std::string &out) {
+        char sep = pending_;
+        pending_ = 0;
+        if (window_.empty() && step(0, word) == PhraseTrie::npos) { emit(word, sep, out); return; }
+        window_.push_back({std::string(word), sep});
+        resolve(false, out);
+    }
+
+    uint32_t step(uint32_t node, std::string_view word) {
+        const PhraseTrie &t = c_.phrases();
+        if (t.empty()) return PhraseTrie::npos;
+        size_t b, e;
+        TextCompactor::core_bounds(word, b, e);
+        key_.clear();
+        for (size_t k = b; k < e; ++k) key_.push_back((char)std::tolower((unsigned char)word[k]));
+        return t.step(node, key_);
+    }
+
+    // Greedy longest match at the front of the window. Inner phrase words may not carry
+    // punctuation; the first may have leading and the last trailing punctuation.
+    void resolve(bool final, std::string &out) {
+        const PhraseTrie &t = c_.phrases();
+        while (!window_.empty()) {
+            uint32_t node = 0;
+            size_t best = 0;
+            int32_t phrase = -1;
+            bool open = true;
+            for (size_t k = 0; k < window_.size(); ++k) {
+                size_t b, e;
+                TextCompactor::core_bounds(window_[k].word, b, e);
+                if (k > 0 && b > 0) { open = false; break; }
+                node = step(node, window_[k].word);
+                if (node == PhraseTrie::npos) { open = false; break; }
+                if (t.phrase_at(node) >= 0) { best = k + 1; phrase = t.phrase_at(node); }
+                if (e < window_[k].word.size()) { open = false; break; }
+            }
+            if (open && !final && t.has_children(node)) return; // a longer phrase may follow
+
+            if (best) {
+                const std::string &first = window_.front().word, &last = window_[best - 1].word;
+                size_t fb, fe, lb, le;
+                TextCompactor::core_bounds(first, fb, fe);
+                TextCompactor::core_bounds(last, lb, le);
+                owe(window_.front().sep);
+                if (owed_ && started_) out.push_back(owed_);
+                out.append(first, 0, fb);
+                out.append(c_.phrase_abbreviation((uint32_t)phrase));
+                out.append(last, le, std::string::npos);
+                owed_ = 0;
+                started_ = true;
+                if (std::find(used_.begin(), used_.end(), (uint32_t)phrase) == used_.end()) used_.push_back((uint32_t)phrase);
+                window_.erase(window_.begin(), window_.begin() + (long)best);
+            } else {
+                emit(window_.front().word, window_.front().sep, out);
+                window_.erase(window_.begin());
+            }
+        }
+    }
+
+    void owe(char sep) {
+        if (sep == '\n' || (sep && !owed_)) owed_ = sep;
+    }
+
+    void emit(std::string_view word, char sep, std::string &out) {
+        owe(sep);
+        size_t mark = out.size();
+        if (owed_ && started_) out.push_back(owed_);
+        size_t body = out.size();
+        c_.append_word(word, out);
+        if (out.size() == body) { out.resize(mark); return; } // nothing left, e.g. a lone ","
+        owed_ = 0;
+        started_ = true;
+    }
+
+    const TextCompactor &c_;
+    std::string carry_;
+    std::string key_;
+    std::vector<Held> window_;
+    std::vector<uint32_t> used_;
+    char pending_ = 0; // whitespace seen since the last word: ' ' or '\n'
+    char owed_ = 0;    // separator owed before the next output
+    bool started_ = false;
+};
+
+inline std::string TextCompactor::compact(std::string_view in, std::vector<uint32_t> *used) const {
+    std::string out;
+    out.reserve(in.size());
+    CompactStream s(*this);
+    s.feed(in, out);
+    s.finish(out);
+    if (used) *used = s.used();
+    return out;
+}
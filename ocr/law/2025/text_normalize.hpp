@@ -0,0 +1,215 @@
+// text_normalize.hpp
+// One-pass normalization of raw OCR page text, vectorized with SSE2/AVX2 and a scalar
+// fallback. Per line it:
+// - drops leading and trailing whitespace
+// - collapses inner whitespace runs, control bytes included, to a single space
+// - optionally lowercases ASCII
+// - optionally strips a transcript margin line number ("12   Q. Did you ...")
+// - optionally rejoins a word hyphenated across a line break ("radi-\nating" becomes
+//   "radiating\n"), so the line count does not change
+//
+// Lines are kept one for one, empty ones included, so line indices still map to the
+// page layout.
+//
+// The SIMD path only speeds up copying runs of ordinary bytes. Every decision is made
+// by the same scalar state machine, so all kernels produce identical output.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#define TEXT_NORMALIZE_X86 1
+#endif
+
+struct NormalizeOptions {
+    bool lowercase = false;
+    bool dehyphenate = true;
+    bool strip_margin_numbers = false; // 1-2 digit line number at the start of a line
+};
+
+namespace text_normalize_detail {
+
+inline bool is_hspace(unsigned char c) { return c <= 0x20 && c != '\n'; }
+inline char lower(unsigned char c, bool on) { return (char)(on && c >= 'A' && c <= 'Z' ? c | 0x20 : c); }
+inline bool is_alpha(unsigned char c) { return (c | 0x20) >= 'a' && (c | 0x20) <= 'z'; }
+
+// Copies bytes that need no decision; returns at the first one that does. A byte needs
+// a decision when it is a control byte, a space followed by whitespace, or (when
+// dehyphenating) a '-' followed by whitespace. The last byte of the input always does.
+struct ScalarScan {
+    const char *operator()(const char *p, const char *end, char *&w, const NormalizeOptions &o) const {
+        while (p + 1 < end) {
+            unsigned char c = (unsigned char)p[0], next = (unsigned char)p[1];
+            if (c < 0x20) break;
+            if ((c == ' ' || (c == '-' && o.dehyphenate)) && next <= 0x20) break;
+            *w++ = lower(c, o.lowercase);
+            ++p;
+        }
+        return p;
+    }
+};
+
+#ifdef TEXT_NORMALIZE_X86
+// 16 bytes per step; the +1 load gives each byte its successor.
+struct Sse2Scan {
+    const char *operator()(const char *p, const char *end, char *&w, const NormalizeOptions &o) const {
+        const __m128i c1f = _mm_set1_epi8(0x1F), c20 = _mm_set1_epi8(0x20), dash = _mm_set1_epi8('-');
+        const __m128i upper_bias = _mm_set1_epi8(0x3F), upper_lim = _mm_set1_epi8(-128 + 26);
+        const __m128i dash_on = _mm_set1_epi8(o.dehyphenate ? -1 : 0);
+        while (p + 17 <= end) {
+            __m128i v = _mm_loadu_si128((const __m128i *)p);
+            __m128i nx = _mm_loadu_si128((const __m128i *)(p + 1));
+            __m128i ctrl = _mm_cmpeq_epi8(_mm_min_epu8(v, c1f), v);
+            __m128i nx_ws = _mm_cmpeq_epi8(_mm_min_epu8(nx, c20), nx);
+            __m128i sp = _mm_and_si128(_mm_cmpeq_epi8(v, c20), nx_ws);
+            __m128i hy = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v, dash), nx_ws), dash_on);
+            unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(ctrl, _mm_or_si128(sp, hy)));
+            if (o.lowercase) {
+                // 'A'..'Z' + 0x3F lands on -128..-103; everything else lands above
+                __m128i up = _mm_cmplt_epi8(_mm_add_epi8(v, upper_bias), upper_lim);
+                v = _mm_or_si128(v, _mm_and_si128(up, c20));
+            }
+            _mm_storeu_si128((__m128i *)w, v);
+            if (!mask) { p += 16; w += 16; continue; }
+            unsigned k = (unsigned)__builtin_ctz(mask);
+            p += k;
+            w += k;
+            return p;
+        }
+        return ScalarScan()(p, end, w, o);
+    }
+};
+
+struct Avx2Scan {
+    __attribute__((target("avx2")))
+    const char *operator()(const char *p, const char *end, char *&w, const NormalizeOptions &o) const {
+        const __m256i c1f = _mm256_set1_epi8(0x1F), c20 = _mm256_set1_epi8(0x20), dash = _mm256_set1_epi8('-');
+        const __m256i upper_bias = _mm256_set1_epi8(0x3F), upper_lim = _mm256_set1_epi8(-128 + 26);
+        const __m256i dash_on = _mm256_set1_epi8(o.dehyphenate ? -1 : 0);
+        while (p + 33 <= end) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)p);
+            __m256i nx = _mm256_loadu_si256((const __m256i *)(p + 1));
+            __m256i ctrl = _mm256_cmpeq_epi8(_mm256_min_epu8(v, c1f), v);
+            __m256i nx_ws = _mm256_cmpeq_epi8(_mm256_min_epu8(nx, c20), nx);
+            __m256i sp = _mm256_and_si256(_mm256_cmpeq_epi8(v, c20), nx_ws);
+            __m256i hy = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v, dash), nx_ws), dash_on);
+            unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(ctrl, _mm256_or_si256(sp, hy)));
+            if (o.lowercase) {
+                __m256i up = _mm256_cmpgt_epi8(upper_lim, _mm256_add_epi8(v, upper_bias));
+                v = _mm256_or_si256(v, _mm256_and_si256(up, c20));
+            }
+            _mm256_storeu_si256((__m256i *)w, v);
+            if (!mask) { p += 32; w += 32; continue; }
+            unsigned k = (unsigned)__builtin_ctz(mask);
+            p += k;
+            w += k;
+            return p;
+        }
+        return Sse2Scan()(p, end, w, o);
+    }
+};
+#endif
+
+// Skips leading whitespace and, if enabled, a margin line number.
+inline const char *skip_line_start(const char *p, const char *end, const NormalizeOptions &o) {
+    while (p < end && is_hspace((unsigned char)*p)) ++p;
+    if (o.strip_margin_numbers) {
+        const char *q = p;
+        while (q < end && q - p < 3 && *q >= '0' && *q <= '9') ++q;
+        if (q > p && q - p <= 2 && (q == end || is_hspace((unsigned char)*q) || *q == '\n')) {
+            p = q;
+            while (p < end && is_hspace((unsigned char)*p)) ++p;
+        }
+    }
+    return p;
+}
+
+template <class Scan>
+inline size_t normalize(const char *in, size_t n, char *out, const NormalizeOptions &o, Scan scan) {
+    const char *p = in, *end = in + n;
+    char *w = out;
+    bool line_start = true;
+    while (p < end) {
+        if (line_start) {
+            p = skip_line_start(p, end, o);
+            line_start = false;
+            continue;
+        }
+        p = scan(p, end, w, o);
+        if (p >= end) break;
+        unsigned char c = (unsigned char)*p;
+        if (c == '\n') {
+            *w++ = '\n';
+            ++p;
+            line_start = true;
+            continue;
+        }
+        if (is_hspace(c)) {
+            const char *q = p;
+            while (q < end && is_hspace((unsigned char)*q)) ++q;
+            if (q < end && *q != '\n') *w++ = ' ';
+            p = q;
+            continue;
+        }
+        if (c == '-' && o.dehyphenate && w > out && is_alpha((unsigned char)w[-1])) {
+            const char *q = p + 1;
+            while (q < end && is_hspace((unsigned char)*q)) ++q;
+            if (q < end && *q == '\n') {
+                const char *r = skip_line_start(q + 1, end, o);
+                if (r < end && *r >= 'a' && *r <= 'z') {
+                    // Pull the rest of the word up; the line break moves after it
+                    while (r < end && (unsigned char)*r > 0x20) *w++ = lower((unsigned char)*r++, o.lowercase);
+                    *w++ = '\n';
+                    p = r;
+                    while (p < end && is_hspace((unsigned char)*p)) ++p;
+                    continue;
+                }
+            }
+        }
+        *w++ = lower(c, o.lowercase);
+        ++p;
+    }
+    return (size_t)(w - out);
+}
+
+#ifdef TEXT_NORMALIZE_X86
+__attribute__((target("avx2")))
+inline size_t normalize_avx2(const char *in, size_t n, char *out, const NormalizeOptions &o) {
+    return normalize(in, n, out, o, Avx2Scan());
+}
+#endif
+
+} // namespace text_normalize_detail
+
+// Kernel picked for this CPU: "avx2", "sse2" or "scalar".
+inline const char *normalize_kernel_name() {
+#ifdef TEXT_NORMALIZE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2 ? "avx2" : "sse2";
+#else
+    return "scalar";
+#endif
+}
+
+// Normalizes in into out and returns the output length, which never exceeds
+// in.size(). out must hold in.size() bytes and must not overlap in.
+inline size_t normalize_text(std::string_view in, char *out, const NormalizeOptions &o = {}) {
+    namespace d = text_normalize_detail;
+#ifdef TEXT_NORMALIZE_X86
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return d::normalize_avx2(in.data(), in.size(), out, o);
+    return d::normalize(in.data(), in.size(), out, o, d::Sse2Scan());
+#else
+    return d::normalize(in.data(), in.size(), out, o, d::ScalarScan());
+#endif
+}
+
+// Reference implementation, byte for byte the same output as normalize_text().
+inline size_t normalize_text_scalar(std::string_view in, char *out, const NormalizeOptions &o = {}) {
+    namespace d = text_normalize_detail;
+    return d::normalize(in.data(), in.size(), out, o, d::ScalarScan());
+}